@@ -8,16 +8,35 @@ SCXRELAY=./scxrelay
 # Default paths.
 UINPUT_PATH=/dev/uinput
 EVENT_PREFIX=/dev/input/event
+SYSFS=/sys
 
-# Paths to system utilities.
-UDEVADM=udevadm
-GREP=grep
+# Virtual device (under /sys/devices/virtual) with X/Y axes and joystick or
+# gamepad buttons (udev's ID_INPUT_JOYSTICK), which is characteristic of the
+# Steam Controller virtual xpad device.  Reads sysfs with builtins only, so
+# the search forks no process.  Capability files hold 64-bit hex words,
+# most significant first.
+is_xpad () {
+  local caps="$1/device/capabilities" abs key word
+  read -r -a abs < "$caps/abs" || return 1
+  read -r -a key < "$caps/key" || return 1
+  # ABS_X, ABS_Y: bits 0 and 1.
+  (( (16#${abs[-1]} & 3) == 3 )) || return 1
+  # BTN_JOYSTICK..BTN_DIGI-1 (0x120-0x13f): upper half of word 4.
+  (( ${#key[@]} > 4 )) || return 1
+  word=${key[${#key[@]} - 5]}
+  (( ((16#$word >> 32) & 0xffffffff) != 0 ))
+}
 
-for evdev in "$EVENT_PREFIX"*; do
-  # Search for the two lines "P: [...]/virtual/[...]" and "E: ID_INPUT_JOYSTICK=1", which are characteristic of the Steam Controller virtual xpad device.
-  if [ `$UDEVADM info -n "$evdev" | $GREP -c '^\(P: .*/virtual/\|E: ID_INPUT_JOYSTICK=1\)'` = 2 ]; then
+MATCHES=()
+for sysdev in "$SYSFS"/devices/virtual/input/input*/event*; do
+  if [ -e "$sysdev" ] && is_xpad "$sysdev"; then
+    evdev="$EVENT_PREFIX${sysdev##*/event}"
     # match
-    $SCXRELAY "$evdev" "$UINPUT_PATH"
+    MATCHES+=("$evdev")
   fi
 done
 
+# Relay every match from a single process.
+if [ ${#MATCHES[@]} -gt 0 ]; then
+  $SCXRELAY -U "$UINPUT_PATH" -m "${MATCHES[@]}"
+fi
@@ -0,0 +1,1859 @@
+/*
+    Steam Controller Xpad Relayer
+    Copyright (C) 2017  PhaethonH
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+/* librelay: see librelay.h. */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/futex.h>
+
+#include <linux/major.h>
+
+#include "librelay.h"
+
+#define RELAY_EVBUF_COUNT 256	/* input_event slots in the read buffer. */
+#define RELAY_OUTBUF_COUNT (2 * RELAY_STATE_MAXEV)	/* waiting for uinput. */
+
+
+/** Logging **/
+int relay_logthreshold = 0;
+
+/* Asynchronous logging: records in a bounded lock-free ring (many
+   producers, one consumer: a slot is claimed by its sequence number), and a
+   thread that formats and writes them. */
+#define RELAY_LOG_SLOTS 1024	/* power of two. */
+#define RELAY_LOG_ARGS 8	/* conversions per message. */
+#define RELAY_LOG_STRBYTES 64	/* bytes of %s arguments per message. */
+/* After a message, the thread keeps draining on a tick for a while before
+   it sleeps on the futex again.  Messages come in bursts (a line per frame
+   lost to a full uinput, say); while the thread is awake, producers store
+   a record and do not wake it, so the relay pays no futex syscall past the
+   first message of a burst.  The price is RELAY_LOG_IDLE_TICKS wakeups of
+   the log thread (100 ms) after the last message; a quiet relay has none. */
+#define RELAY_LOG_TICK_MS 10	/* drain period while messages come. */
+#define RELAY_LOG_IDLE_TICKS 10	/* empty drains before sleeping for good. */
+
+struct relay_logrec_s
+{
+  uint64_t seq;			/* slot state, see relay_log_put(). */
+  uint64_t ns;			/* CLOCK_MONOTONIC when logged. */
+  const char *fmt;		/* message id: the format string itself. */
+  int level;
+  union
+  {
+    long long i;
+    double d;
+    const void *p;
+    int soff;			/* %s: offset in str[]. */
+  } arg[RELAY_LOG_ARGS];
+  char str[RELAY_LOG_STRBYTES];
+};
+
+static struct
+{
+  int running;			/* thread started; producers enqueue. */
+  int stopping;
+  int sleeping;			/* futex: consumer waits for a wake. */
+  pthread_t thread;
+  uint64_t head;		/* next slot to claim (producers). */
+  uint64_t tail;		/* next slot to drain (consumer). */
+  unsigned long long dropped, dropped_told;
+  unsigned long long unwritten;	/* bytes stderr did not take. */
+  int midline;			/* the last record did not end a line. */
+  struct relay_logrec_s ring[RELAY_LOG_SLOTS];
+} relay_log;
+
+/* One printf conversion of 'fmt' (at a '%'): its length, and the kind of
+   argument it takes ('i', 'l' long, 'L' long long, 'z' size_t, 'd', 's',
+   'p', '%' none, 0 unknown); *stars counts '*' width/precision ints. */
+static int
+relay_log_spec (const char *fmt, int *kind, int *stars)
+{
+  const char *c = fmt + 1;
+  int longs = 0, size = 0;
+
+  *stars = 0;
+  while (*c && strchr ("-+ #0'", *c))
+    c++;
+  for (; *c && (strchr ("0123456789.", *c) || (*c == '*')); c++)
+    *stars += (*c == '*');
+  for (; *c && strchr ("hlLqjzt", *c); c++)
+    {
+      longs += (*c == 'l');
+      longs += 2 * ((*c == 'q') || (*c == 'L') || (*c == 'j'));
+      size |= (*c == 'z') || (*c == 't');
+    }
+  switch (*c)
+    {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      *kind = size ? 'z' : (longs >= 2) ? 'L' : longs ? 'l' : 'i';
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+    case 'a': case 'A':
+      *kind = 'd';
+      break;
+    case 's': case 'p': case '%':
+      *kind = *c;
+      break;
+    default:
+      *kind = 0;
+      return c - fmt;
+    }
+  return c + 1 - fmt;
+}
+
+/* All of buf to stderr, across short writes and signals; what stderr
+   refuses (closed, or a full non-blocking pipe) is counted, and told with
+   the next drain that gets through. */
+static void
+relay_log_write (const char *buf, int len)
+{
+  ssize_t res;
+
+  while (len > 0)
+    {
+      res = write (STDERR_FILENO, buf, len);
+      if ((res < 0) && (errno == EINTR))
+	continue;
+      if (res <= 0)
+	{
+	  relay_log.unwritten += len;
+	  return;
+	}
+      buf += res;
+      len -= res;
+    }
+}
+
+/* Write records from the ring to stderr, each line that a record starts
+   stamped "[seconds.microseconds] " (CLOCK_MONOTONIC, as in dmesg) with
+   the time it was logged; returns how many. */
+static int
+relay_log_drain ()
+{
+  struct relay_logrec_s *rec;
+  char out[4096], spec[32];
+  const char *f;
+  int n = 0, len = 0, a, kind, stars, speclen, star[2];
+  unsigned long long dropped, unwritten;
+
+  for (;;)
+    {
+      rec = relay_log.ring + (relay_log.tail & (RELAY_LOG_SLOTS - 1));
+      if (__atomic_load_n (&(rec->seq), __ATOMIC_ACQUIRE)
+	  != relay_log.tail + 1)
+	break;
+      if (len > (int) sizeof (out) - 512)
+	{
+	  relay_log_write (out, len);
+	  len = 0;
+	}
+      if (!relay_log.midline)
+	len += snprintf (out + len, 32, "[%llu.%06llu] ",
+			 (unsigned long long) (rec->ns / 1000000000),
+			 (unsigned long long) (rec->ns % 1000000000 / 1000));
+      /* Format into out[], flushing it when full. */
+      for (f = rec->fmt, a = 0; *f; f += speclen)
+	{
+	  if (len > (int) sizeof (out) - 512)
+	    {
+	      relay_log_write (out, len);
+	      len = 0;
+	    }
+	  if (*f != '%')
+	    {
+	      speclen = strcspn (f, "%");
+	      speclen = (speclen > 256) ? 256 : speclen;
+	      memcpy (out + len, f, speclen);
+	      len += speclen;
+	      continue;
+	    }
+	  speclen = relay_log_spec (f, &kind, &stars);
+	  if (!kind || (speclen >= (int) sizeof (spec))
+	      || (a + stars + (kind != '%') > RELAY_LOG_ARGS))
+	    {
+	      /* Arguments were not kept: the rest goes out as is. */
+	      speclen = strnlen (f, 256);
+	      memcpy (out + len, f, speclen);
+	      len += speclen;
+	      continue;
+	    }
+	  memcpy (spec, f, speclen);
+	  spec[speclen] = 0;
+	  star[0] = stars ? rec->arg[a].i : 0;
+	  star[1] = (stars > 1) ? rec->arg[a + 1].i : 0;
+	  a += stars;
+#define RELAY_LOG_FMT(value) \
+  ((stars == 2) ? snprintf (out + len, 256, spec, star[0], star[1], value) \
+   : stars ? snprintf (out + len, 256, spec, star[0], value) \
+   : snprintf (out + len, 256, spec, value))
+	  switch (kind)
+	    {
+	    case 'i': len += RELAY_LOG_FMT ((int) rec->arg[a].i); break;
+	    case 'l': len += RELAY_LOG_FMT ((long) rec->arg[a].i); break;
+	    case 'L': len += RELAY_LOG_FMT (rec->arg[a].i); break;
+	    case 'z': len += RELAY_LOG_FMT ((size_t) rec->arg[a].i); break;
+	    case 'd': len += RELAY_LOG_FMT (rec->arg[a].d); break;
+	    case 'p': len += RELAY_LOG_FMT (rec->arg[a].p); break;
+	    case 's':
+	      len += RELAY_LOG_FMT (rec->str + rec->arg[a].soff);
+	      break;
+	    case '%': out[len++] = '%'; a--; break;
+	    }
+#undef RELAY_LOG_FMT
+	  if (len > (int) sizeof (out) - 256)
+	    len = sizeof (out) - 256;	/* snprintf may report more. */
+	  a++;
+	}
+      if (len > 0)
+	relay_log.midline = (out[len - 1] != '\n');
+      __atomic_store_n (&(rec->seq), relay_log.tail + RELAY_LOG_SLOTS,
+			__ATOMIC_RELEASE);
+      relay_log.tail++;
+      n++;
+    }
+  dropped = __atomic_load_n (&relay_log.dropped, __ATOMIC_RELAXED);
+  if (dropped != relay_log.dropped_told)
+    {
+      len += snprintf (out + len, 128, "[%llu log records dropped]\n",
+		       dropped - relay_log.dropped_told);
+      relay_log.dropped_told = dropped;
+    }
+  if (relay_log.unwritten)
+    {
+      unwritten = relay_log.unwritten;
+      relay_log.unwritten = 0;
+      len += snprintf (out + len, 128, "[%llu bytes of log not written]\n",
+		       unwritten);
+    }
+  relay_log_write (out, len);
+  return n;
+}
+
+static void
+relay_futex (int *word, int op, int val, const struct timespec *timeout)
+{
+  syscall (SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+static void *
+relay_log_thread (void *arg)
+{
+  const struct timespec tick = { 0, RELAY_LOG_TICK_MS * 1000000L };
+  int idle = 0;
+
+  (void) arg;
+  for (;;)
+    {
+      if (relay_log_drain () > 0)
+	idle = 0;
+      else if (__atomic_load_n (&relay_log.stopping, __ATOMIC_ACQUIRE))
+	break;
+      if (++idle < RELAY_LOG_IDLE_TICKS)
+	{
+	  /* Messages are coming: drain every tick; producers need not
+	     wake us (see RELAY_LOG_TICK_MS). */
+	  nanosleep (&tick, NULL);
+	  continue;
+	}
+      /* Quiet: sleep until the next producer (or stop) wakes us.  Flag
+	 first, then look, so a record cannot slip in unnoticed. */
+      __atomic_store_n (&relay_log.sleeping, 1, __ATOMIC_SEQ_CST);
+      if ((__atomic_load_n (&(relay_log.ring[relay_log.tail
+					      & (RELAY_LOG_SLOTS - 1)].seq),
+			    __ATOMIC_SEQ_CST) != relay_log.tail + 1)
+	  && !__atomic_load_n (&relay_log.stopping, __ATOMIC_SEQ_CST))
+	relay_futex (&relay_log.sleeping, FUTEX_WAIT_PRIVATE, 1, NULL);
+      __atomic_store_n (&relay_log.sleeping, 0, __ATOMIC_SEQ_CST);
+      idle = 0;
+    }
+  return NULL;
+}
+
+/* Claim a slot and store one record; drops it when the ring is full. */
+static void
+relay_log_put (int loglevel, const char *fmt, va_list vp)
+{
+  struct relay_logrec_s *rec;
+  struct timespec now;
+  const char *f, *str;
+  uint64_t pos, seq;
+  int a, kind, stars, soff = 0, slen;
+
+  pos = __atomic_load_n (&relay_log.head, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      rec = relay_log.ring + (pos & (RELAY_LOG_SLOTS - 1));
+      seq = __atomic_load_n (&(rec->seq), __ATOMIC_ACQUIRE);
+      if (seq == pos)
+	{
+	  if (__atomic_compare_exchange_n (&relay_log.head, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    break;
+	}
+      else if (seq < pos)
+	{
+	  __atomic_add_fetch (&relay_log.dropped, 1, __ATOMIC_RELAXED);
+	  return;
+	}
+      else
+	pos = __atomic_load_n (&relay_log.head, __ATOMIC_RELAXED);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  rec->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  rec->fmt = fmt;
+  rec->level = loglevel;
+  for (f = fmt, a = 0; (f = strchr (f, '%')); )
+    {
+      f += relay_log_spec (f, &kind, &stars);
+      for (; stars && (a < RELAY_LOG_ARGS); stars--)
+	rec->arg[a++].i = va_arg (vp, int);
+      if (!kind || (a >= RELAY_LOG_ARGS))
+	break;
+      switch (kind)
+	{
+	case 'i': rec->arg[a++].i = va_arg (vp, int); break;
+	case 'l': rec->arg[a++].i = va_arg (vp, long); break;
+	case 'L': rec->arg[a++].i = va_arg (vp, long long); break;
+	case 'z': rec->arg[a++].i = va_arg (vp, size_t); break;
+	case 'd': rec->arg[a++].d = va_arg (vp, double); break;
+	case 'p': rec->arg[a++].p = va_arg (vp, void *); break;
+	case 's':
+	  /* Copied: the string may be gone by drain time. */
+	  str = va_arg (vp, const char *);
+	  str = str ? str : "(null)";
+	  slen = strnlen (str, RELAY_LOG_STRBYTES - 1 - soff);
+	  memcpy (rec->str + soff, str, slen);
+	  rec->str[soff + slen] = 0;
+	  rec->arg[a++].soff = soff;
+	  soff += slen + (soff + slen < RELAY_LOG_STRBYTES - 1);
+	  break;
+	}
+    }
+  __atomic_store_n (&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+
+  /* Wake the consumer only if it sleeps for good (quiet until now). */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&relay_log.sleeping, __ATOMIC_RELAXED)
+      && __atomic_exchange_n (&relay_log.sleeping, 0, __ATOMIC_SEQ_CST))
+    relay_futex (&relay_log.sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+int
+relay_log_start ()
+{
+  static int registered;
+  sigset_t all, old;
+  uint64_t i;
+
+  if (relay_log.running)
+    return 0;
+  if (!registered++)
+    atexit (relay_log_stop);	/* flush on exit() too. */
+  for (i = 0; i < RELAY_LOG_SLOTS; i++)
+    relay_log.ring[(relay_log.head + i) & (RELAY_LOG_SLOTS - 1)].seq =
+      relay_log.head + i;
+  relay_log.tail = relay_log.head;
+  relay_log.stopping = 0;
+  relay_log.midline = 0;
+  /* Signals stay with the caller's threads (e.g. for its signalfd). */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  errno = pthread_create (&relay_log.thread, NULL, relay_log_thread, NULL);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (errno)
+    return -1;
+  __atomic_store_n (&relay_log.running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void
+relay_log_stop ()
+{
+  if (!relay_log.running)
+    return;
+  __atomic_store_n (&relay_log.running, 0, __ATOMIC_RELEASE);
+  __atomic_store_n (&relay_log.stopping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n (&relay_log.sleeping, 0, __ATOMIC_SEQ_CST))
+    relay_futex (&relay_log.sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+  pthread_join (relay_log.thread, NULL);
+  relay_log_drain ();
+}
+
+unsigned long long
+relay_log_dropped ()
+{
+  return __atomic_load_n (&relay_log.dropped, __ATOMIC_RELAXED);
+}
+
+int
+relay_vlogmsg (int loglevel, const char *fmt, va_list vp)
+{
+  int retval = 0;
+  if (loglevel > relay_logthreshold)
+    {
+      if (__atomic_load_n (&relay_log.running, __ATOMIC_ACQUIRE))
+	{
+	  relay_log_put (loglevel, fmt, vp);
+	  return 0;
+	}
+      retval = vfprintf (stderr, fmt, vp);
+      fflush (stderr);
+    }
+  return retval;
+}
+
+int
+relay_logmsg (int loglevel, const char *fmt, ...)
+{
+  va_list vp;
+  int retval = 0;
+  va_start (vp, fmt);
+  retval = relay_vlogmsg (loglevel, fmt, vp);
+  va_end (vp);
+  return retval;
+}
+
+
+/** Device capabilities **/
+
+/* A word at a time: empty words (most of the 96 bytes of KEY_* bits) cost
+   one test, and each set bit is found directly, with no per-bit loop. */
+void
+relay_walk_bits (const char *bv, int nbytes,
+		 void (*cb) (int idx, void *ctx), void *ctx)
+{
+  uint64_t word;
+  size_t base;
+
+  for (base = 0; base < (size_t) nbytes; base += sizeof (word))
+    {
+      word = 0;
+      memcpy (&word, bv + base, (nbytes - base < sizeof (word))
+	      ? nbytes - base : sizeof (word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      word = __builtin_bswap64 (word);	/* bit 0 is in the first byte. */
+#endif
+      for (; word; word &= word - 1)
+	cb (base * 8 + __builtin_ctzll (word), ctx);
+    }
+}
+
+void
+relay_identify (int fd, struct input_id *id, char *name, char *uniq)
+{
+  memset (id, 0, sizeof (*id));
+  memset (name, 0, UINPUT_MAX_NAME_SIZE);
+  memset (uniq, 0, UINPUT_MAX_NAME_SIZE);
+  ioctl (fd, EVIOCGID, id);
+  ioctl (fd, EVIOCGNAME (UINPUT_MAX_NAME_SIZE - 1), name);
+  ioctl (fd, EVIOCGUNIQ (UINPUT_MAX_NAME_SIZE - 1), uniq);
+}
+
+/* relay_walk_bits() callbacks: one ioctl per set bit. */
+struct relay_ioc_s
+{
+  int fd;
+  unsigned long req;
+  void *arg;
+  int failed;
+};
+
+static void
+relay_cb_get_absinfo (int idx, void *ctx)
+{
+  struct relay_ioc_s *ioc = ctx;
+  struct input_absinfo *absinfo = ioc->arg;
+
+  if ((idx < ABS_CNT) && (ioctl (ioc->fd, EVIOCGABS (idx), absinfo + idx) < 0))
+    ioc->failed = 1;
+}
+
+static void
+relay_cb_set_bit (int idx, void *ctx)
+{
+  struct relay_ioc_s *ioc = ctx;
+
+  if (ioctl (ioc->fd, ioc->req, idx) < 0)
+    ioc->failed = 1;
+}
+
+int
+relay_query_caps (int fd, struct relay_caps_s *caps)
+{
+  struct relay_ioc_s ioc = { fd, 0, caps->absinfo, 0 };
+
+  memset (caps, 0, sizeof (*caps));
+  ioctl (fd, EVIOCGBIT (0, RELAY_NBV_EV), caps->have_ev);
+  ioctl (fd, EVIOCGBIT (EV_ABS, RELAY_NBV_ABS), caps->have_abs);
+  ioctl (fd, EVIOCGBIT (EV_KEY, RELAY_NBV_KEY), caps->have_key);
+  if (caps->have_ev[EV_FF / 8] & (1 << (EV_FF % 8)))
+    {
+      ioctl (fd, EVIOCGBIT (EV_FF, RELAY_NBV_FF), caps->have_ff);
+      ioctl (fd, EVIOCGEFFECTS, &(caps->ff_max));
+      if (caps->ff_max > RELAY_FF_MAX)
+	caps->ff_max = RELAY_FF_MAX;
+    }
+  relay_walk_bits (caps->have_abs, RELAY_NBV_ABS, relay_cb_get_absinfo, &ioc);
+  relay_identify (fd, &(caps->id), caps->name, caps->uniq);
+  return ioc.failed ? -1 : 0;
+}
+
+/* relay_create_device(): per axis, the bit and its absinfo. */
+struct relay_abs_setup_s
+{
+  int fd;
+  const struct relay_caps_s *caps;
+  struct uinput_user_dev *uidev;	/* legacy descriptor, or NULL. */
+  int failed;
+};
+
+static void
+relay_cb_setup_abs (int idx, void *ctx)
+{
+  struct relay_abs_setup_s *setup = ctx;
+  const struct input_absinfo *absinfo = setup->caps->absinfo + idx;
+  struct uinput_abs_setup abs;
+
+  if (idx >= ABS_CNT)
+    return;
+  if (ioctl (setup->fd, UI_SET_ABSBIT, idx) < 0)
+    setup->failed = 1;
+  if (setup->uidev)
+    {
+      setup->uidev->absmin[idx] = absinfo->minimum;
+      setup->uidev->absmax[idx] = absinfo->maximum;
+      setup->uidev->absfuzz[idx] = absinfo->fuzz;
+      setup->uidev->absflat[idx] = absinfo->flat;
+      return;
+    }
+  /* The whole absinfo, resolution included. */
+  memset (&abs, 0, sizeof (abs));
+  abs.code = idx;
+  abs.absinfo = *absinfo;
+  if (ioctl (setup->fd, UI_ABS_SETUP, &abs) < 0)
+    setup->failed = 1;
+}
+
+int
+relay_create_device (int uinputfd, const struct relay_caps_s *caps,
+		     const char *name, const struct input_id *id)
+{
+  struct uinput_setup dev;
+  struct uinput_user_dev uidev;
+  struct relay_ioc_s ioc = { uinputfd, 0, NULL, 0 };
+  struct relay_abs_setup_s abs = { uinputfd, caps, NULL, 0 };
+
+  /* Tell uinput of supported input features. */
+  ioc.req = UI_SET_EVBIT;
+  relay_walk_bits (caps->have_ev, RELAY_NBV_EV, relay_cb_set_bit, &ioc);
+  ioc.req = UI_SET_KEYBIT;
+  relay_walk_bits (caps->have_key, RELAY_NBV_KEY, relay_cb_set_bit, &ioc);
+  ioc.req = UI_SET_FFBIT;
+  relay_walk_bits (caps->have_ff, RELAY_NBV_FF, relay_cb_set_bit, &ioc);
+  if (ioc.failed)
+    return -1;
+
+  memset (&dev, 0, sizeof (dev));
+  dev.id = *id;
+  snprintf (dev.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+  dev.ff_effects_max = caps->ff_max;
+  if (ioctl (uinputfd, UI_DEV_SETUP, &dev) < 0)
+    {
+      if ((errno != EINVAL) && (errno != ENOTTY))
+	return -1;
+      /* Before Linux 4.5: the legacy descriptor, written once the axes are
+         in it (it has no room for resolution). */
+      memset (&uidev, 0, sizeof (uidev));
+      uidev.id = *id;
+      snprintf (uidev.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+      uidev.ff_effects_max = caps->ff_max;
+      abs.uidev = &uidev;
+    }
+
+  /* Axes: bit and absinfo in one pass. */
+  relay_walk_bits (caps->have_abs, RELAY_NBV_ABS, relay_cb_setup_abs, &abs);
+  if (abs.failed)
+    return -1;
+  if (abs.uidev && (write (uinputfd, &uidev, sizeof (uidev)) < 0))
+    return -1;
+
+  /* Create ("connect") the device. */
+  return ioctl (uinputfd, UI_DEV_CREATE);
+}
+
+int
+relay_destroy_device (int uinputfd)
+{
+  return ioctl (uinputfd, UI_DEV_DESTROY);
+}
+
+int
+relay_device_node (int uinputfd, char *path, size_t size, int timeout_ms)
+{
+  char sysname[64], dir[PATH_MAX], mark[PATH_MAX];
+  const char *watch;
+  struct dirent *ent;
+  struct timespec t0, now;
+  struct pollfd pfd;
+  char buf[4096];
+  DIR *dp;
+  int node = -1, left;
+
+  /* inputNN in sysfs; its evdev handler is eventMM, major 13. */
+  memset (sysname, 0, sizeof (sysname));
+  if (ioctl (uinputfd, UI_GET_SYSNAME (sizeof (sysname) - 1), sysname) < 0)
+    return -1;
+  snprintf (dir, sizeof (dir), "/sys/devices/virtual/input/%s", sysname);
+  dp = opendir (dir);
+  if (!dp)
+    return -1;
+  while ((ent = readdir (dp)))
+    {
+      if (sscanf (ent->d_name, "event%d", &node) == 1)
+	break;
+    }
+  closedir (dp);
+  if (!ent)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+  snprintf (path, size, "/dev/input/event%d", node);
+
+  /* udev records a device in its database once it is done with it. */
+  if (access ("/run/udev/control", F_OK) == 0)
+    {
+      watch = "/run/udev/data";
+      snprintf (mark, sizeof (mark), "%s/c%d:%d", watch, INPUT_MAJOR, node);
+    }
+  else
+    {
+      watch = "/dev/input";
+      snprintf (mark, sizeof (mark), "%s", path);
+    }
+
+  /* Watch first, then look, so the creation cannot slip in between. */
+  pfd.fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  pfd.events = POLLIN;
+  if (pfd.fd < 0)
+    return -1;
+  inotify_add_watch (pfd.fd, watch, IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  for (;;)
+    {
+      if (access (mark, F_OK) == 0)
+	{
+	  close (pfd.fd);
+	  return 0;
+	}
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      left = timeout_ms - ((now.tv_sec - t0.tv_sec) * 1000
+			   + (now.tv_nsec - t0.tv_nsec) / 1000000);
+      if ((left <= 0) || (poll (&pfd, 1, left) == 0))
+	break;
+      while (read (pfd.fd, buf, sizeof (buf)) > 0)
+	;
+    }
+  close (pfd.fd);
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+
+/** Force feedback **/
+
+void
+relay_ff_init (struct relay_ff_s *ff, int srcfd, int uinputfd)
+{
+  int id;
+
+  memset (ff, 0, sizeof (*ff));
+  ff->srcfd = srcfd;
+  ff->uinputfd = uinputfd;
+  for (id = 0; id < RELAY_FF_MAX; id++)
+    ff->src_id[id] = -1;
+  fcntl (uinputfd, F_SETFL, fcntl (uinputfd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Put cached effect 'id' on the source; returns 0 or -errno. */
+static int
+relay_ff_upload_source (struct relay_ff_s *ff, int id)
+{
+  struct ff_effect effect = ff->effect[id];
+
+  if (ff->srcfd < 0)
+    return 0;			/* uploaded on attach. */
+  effect.id = ff->src_id[id];	/* -1: new effect; else an update. */
+  if (ioctl (ff->srcfd, EVIOCSFF, &effect) < 0)
+    return -errno;
+  ff->src_id[id] = effect.id;
+  return 0;
+}
+
+static void
+relay_ff_upload (struct relay_ff_s *ff, int request_id)
+{
+  struct uinput_ff_upload up;
+  int id;
+
+  memset (&up, 0, sizeof (up));
+  up.request_id = request_id;
+  if (ioctl (ff->uinputfd, UI_BEGIN_FF_UPLOAD, &up) < 0)
+    return;
+  id = up.effect.id;
+  if ((id < 0) || (id >= RELAY_FF_MAX))
+    up.retval = -EINVAL;
+  else if ((up.effect.type == FF_PERIODIC)
+	   && (up.effect.u.periodic.waveform == FF_CUSTOM))
+    up.retval = -EINVAL;	/* its samples are in the game's memory. */
+  else
+    {
+      ff->effect[id] = up.effect;
+      ff->cached[id] = 1;
+      up.retval = relay_ff_upload_source (ff, id);
+    }
+  ioctl (ff->uinputfd, UI_END_FF_UPLOAD, &up);
+}
+
+static void
+relay_ff_erase (struct relay_ff_s *ff, int request_id)
+{
+  struct uinput_ff_erase er;
+  int id;
+
+  memset (&er, 0, sizeof (er));
+  er.request_id = request_id;
+  if (ioctl (ff->uinputfd, UI_BEGIN_FF_ERASE, &er) < 0)
+    return;
+  id = er.effect_id;
+  if ((id >= 0) && (id < RELAY_FF_MAX))
+    {
+      if ((ff->srcfd >= 0) && (ff->src_id[id] >= 0))
+	ioctl (ff->srcfd, EVIOCRMFF, ff->src_id[id]);
+      ff->src_id[id] = -1;
+      ff->cached[id] = 0;
+    }
+  ioctl (ff->uinputfd, UI_END_FF_ERASE, &er);
+}
+
+/* Play/stop an effect, or set gain or autocenter, on the source.
+   Returns the write(2) result, 0 if there is nothing to write. */
+static ssize_t
+relay_ff_play (struct relay_ff_s *ff, const struct input_event *ev)
+{
+  struct input_event out;
+
+  if (ff->srcfd < 0)
+    return 0;
+  memset (&out, 0, sizeof (out));
+  out.type = EV_FF;
+  out.value = ev->value;
+  if ((ev->code == FF_GAIN) || (ev->code == FF_AUTOCENTER))
+    out.code = ev->code;
+  else if ((ev->code < RELAY_FF_MAX) && (ff->src_id[ev->code] >= 0))
+    out.code = ff->src_id[ev->code];
+  else
+    return 0;
+  return write (ff->srcfd, &out, sizeof (out));
+}
+
+int
+relay_ff_handle (struct relay_ff_s *ff)
+{
+  struct input_event ev[16];
+  ssize_t res;
+  int i, n, handled = 0;
+
+  while ((res = read (ff->uinputfd, ev, sizeof (ev))) > 0)
+    {
+      n = res / sizeof (ev[0]);
+      for (i = 0; i < n; i++)
+	{
+	  if ((ev[i].type == EV_UINPUT) && (ev[i].code == UI_FF_UPLOAD))
+	    relay_ff_upload (ff, ev[i].value);
+	  else if ((ev[i].type == EV_UINPUT) && (ev[i].code == UI_FF_ERASE))
+	    relay_ff_erase (ff, ev[i].value);
+	  else if (ev[i].type == EV_FF)
+	    relay_ff_play (ff, ev + i);
+	  else
+	    continue;
+	  handled++;
+	}
+    }
+  ff->requests += handled;
+  if ((res < 0) && (errno != EAGAIN) && (errno != EINTR))
+    return -1;
+  return handled;
+}
+
+void
+relay_ff_attach (struct relay_ff_s *ff, int srcfd)
+{
+  int id;
+
+  ff->srcfd = srcfd;
+  for (id = 0; id < RELAY_FF_MAX; id++)
+    {
+      ff->src_id[id] = -1;
+      if (ff->cached[id] && (relay_ff_upload_source (ff, id) < 0))
+	ff->cached[id] = 0;
+    }
+}
+
+void
+relay_ff_release (struct relay_ff_s *ff)
+{
+  struct input_event stop;
+  int id;
+
+  if (ff->srcfd < 0)
+    return;
+  memset (&stop, 0, sizeof (stop));
+  stop.type = EV_FF;
+  for (id = 0; id < RELAY_FF_MAX; id++)
+    {
+      if (ff->src_id[id] < 0)
+	continue;
+      stop.code = ff->src_id[id];
+      if (write (ff->srcfd, &stop, sizeof (stop)) < 0)
+	break;			/* closing srcfd flushes its effects anyway. */
+      ioctl (ff->srcfd, EVIOCRMFF, ff->src_id[id]);
+      ff->src_id[id] = -1;
+    }
+}
+
+
+/** Input state **/
+
+/* Resting value of an axis: 0 where in range (signed sticks, hats), the
+   center of an unsigned stick (one with a flat zone), else the minimum
+   (triggers, pedals). */
+static int
+relay_state_rest_value (const struct input_absinfo *a)
+{
+  if ((a->minimum <= 0) && (a->maximum >= 0))
+    return 0;
+  if (a->flat > 0)
+    return a->minimum + (a->maximum - a->minimum) / 2;
+  return a->minimum;
+}
+
+void
+relay_state_init (struct relay_state_s *st, const struct relay_caps_s *caps)
+{
+  int code;
+
+  memset (st, 0, sizeof (*st));
+  memcpy (st->have_key, caps->have_key, sizeof (st->have_key));
+  memcpy (st->have_abs, caps->have_abs, sizeof (st->have_abs));
+  for (code = 0; code < ABS_CNT; code++)
+    {
+      st->abs[code] = caps->absinfo[code].value;
+      st->rest[code] = relay_state_rest_value (caps->absinfo + code);
+    }
+}
+
+void
+relay_state_track (struct relay_state_s *st, const struct input_event *ev,
+		   int nev)
+{
+  for (; nev > 0; ev++, nev--)
+    {
+      if ((ev->type == EV_KEY) && (ev->code < KEY_CNT))
+	{
+	  if (ev->value)
+	    st->key[ev->code / 8] |= 1 << (ev->code % 8);
+	  else
+	    st->key[ev->code / 8] &= ~(1 << (ev->code % 8));
+	}
+      else if ((ev->type == EV_ABS) && (ev->code < ABS_CNT))
+	st->abs[ev->code] = ev->value;
+    }
+}
+
+/* relay_walk_bits() callbacks, appending to a resync frame. */
+struct relay_diff_s
+{
+  const struct relay_state_s *st;
+  int srcfd;
+  const char *key;		/* current keys. */
+  struct input_event *frame;
+  int n;
+  int failed;
+};
+
+static void
+relay_cb_diff_key (int idx, void *ctx)
+{
+  struct relay_diff_s *diff = ctx;
+  struct input_event *ev = diff->frame + diff->n++;
+
+  ev->type = EV_KEY;
+  ev->code = idx;
+  ev->value = (diff->key[idx / 8] >> (idx % 8)) & 1;
+}
+
+static void
+relay_cb_diff_abs (int idx, void *ctx)
+{
+  struct relay_diff_s *diff = ctx;
+  struct input_absinfo absinfo;
+  struct input_event *ev;
+
+  if (idx >= ABS_CNT)
+    return;
+  if (diff->srcfd < 0)
+    absinfo.value = diff->st->rest[idx];
+  else if (ioctl (diff->srcfd, EVIOCGABS (idx), &absinfo) < 0)
+    {
+      diff->failed = 1;
+      return;
+    }
+  if (absinfo.value == diff->st->abs[idx])
+    return;
+  ev = diff->frame + diff->n++;
+  ev->type = EV_ABS;
+  ev->code = idx;
+  ev->value = absinfo.value;
+}
+
+int
+relay_state_diff (const struct relay_state_s *st, int srcfd,
+		  const struct timeval *time, struct input_event *frame)
+{
+  char key[RELAY_NBV_KEY], changed[RELAY_NBV_KEY];
+  struct relay_diff_s diff = { st, srcfd, key, frame, 0, 0 };
+  struct timespec now;
+  int i;
+
+  memset (key, 0, sizeof (key));
+  if ((srcfd >= 0) && (ioctl (srcfd, EVIOCGKEY (sizeof (key)), key) < 0))
+    return -1;
+  for (i = 0; i < RELAY_NBV_KEY; i++)
+    changed[i] = (key[i] ^ st->key[i]) & st->have_key[i];
+  relay_walk_bits (changed, RELAY_NBV_KEY, relay_cb_diff_key, &diff);
+  relay_walk_bits (st->have_abs, RELAY_NBV_ABS, relay_cb_diff_abs, &diff);
+  if (diff.failed)
+    return -1;
+  if (diff.n == 0)
+    return 0;
+
+  frame[diff.n].type = EV_SYN;
+  frame[diff.n].code = SYN_REPORT;
+  frame[diff.n++].value = 0;
+  if (!time)
+    {
+      clock_gettime (CLOCK_REALTIME, &now);
+      frame[0].time.tv_sec = now.tv_sec;
+      frame[0].time.tv_usec = now.tv_nsec / 1000;
+      time = &(frame[0].time);
+    }
+  for (i = 0; i < diff.n; i++)
+    frame[i].time = *time;
+  return diff.n;
+}
+
+
+/** Frame splitting **/
+
+int
+relay_split_frames (const struct relay_split_s *sp, struct input_event *buf,
+		    size_t *bytes, int count)
+{
+  struct input_event *ev, *start = buf, *end, *last = NULL;
+  struct relay_state_s *st = sp->state;
+  int nframes = 0, n = 0;
+
+  end = buf + *bytes / sizeof (struct input_event);
+  if (sp->batch && !sp->per_event && !st->dropping)
+    {
+      for (ev = start; ev < end; ev++)
+	{
+	  if ((ev->type == EV_SYN) && (ev->code == SYN_DROPPED))
+	    {
+	      n = 0;		/* repair frame by frame instead. */
+	      break;
+	    }
+	  if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+	    {
+	      last = ev;
+	      n++;
+	    }
+	}
+      if (n > 1)
+	{
+	  sp->batch (sp->ctx, start, last + 1 - start);
+	  nframes += n;
+	  start = last + 1;
+	}
+    }
+
+  for (ev = start; ev < end; ev++)
+    {
+      if ((ev->type == EV_SYN) && (ev->code == SYN_DROPPED))
+	{
+	  st->dropping = 1;
+	  if (sp->syn_dropped)
+	    (*sp->syn_dropped)++;
+	}
+      if (st->dropping)
+	{
+	  /* events up to the next SYN_REPORT are incomplete: discard
+	     them, then relay what differs from the actual state. */
+	  if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+	    {
+	      st->dropping = 0;
+	      nframes += sp->resync (sp->ctx, &(ev->time));
+	    }
+	  start = ev + 1;
+	  continue;
+	}
+      if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+	{
+	  nframes++;
+	  if (!sp->per_event)
+	    {
+	      sp->frame (sp->ctx, start, ev + 1 - start);
+	      start = ev + 1;
+	    }
+	}
+      if (sp->per_event)
+	{
+	  sp->frame (sp->ctx, ev, 1);
+	  start = ev + 1;
+	}
+    }
+  if ((start == buf) && (end == buf + count))
+    {
+      /* frame too large to hold; relay in pieces. */
+      sp->frame (sp->ctx, start, end - start);
+      start = end;
+    }
+  *bytes -= (char *) start - (char *) buf;
+  memmove (buf, start, *bytes);
+  return nframes;
+}
+
+
+/** Writer thread **/
+
+const char *const relay_backpressure_names[] =
+  { "block", "coalesce", "drop-oldest", NULL };
+
+int
+relay_coalesce (const struct input_event *in, int nev,
+		struct input_event *out)
+{
+  const struct input_event *ev;
+  struct input_event *cur = out;
+  int n = 0, i;
+
+  for (ev = in; ev < in + nev; ev++)
+    {
+      if (ev->type == EV_SYN)
+	{
+	  if (ev->code == SYN_REPORT)
+	    cur[n] = *ev;	/* the frame's SYN_REPORT, if it ends here. */
+	  continue;
+	}
+      for (i = 0; i < n; i++)
+	{
+	  if ((cur[i].type == ev->type) && (cur[i].code == ev->code))
+	    break;
+	}
+      if ((i < n) && (ev->type == EV_ABS))
+	{
+	  cur[i] = *ev;
+	  continue;
+	}
+      if ((i < n) && (ev->type == EV_REL))
+	{
+	  cur[i].value += ev->value;
+	  cur[i].time = ev->time;
+	  continue;
+	}
+      if (i < n)
+	{
+	  /* a repeated key (or other state change) ends the frame. */
+	  cur[n] = ev[-1];
+	  cur[n].type = EV_SYN;
+	  cur[n].code = SYN_REPORT;
+	  cur[n].value = 0;
+	  cur += n + 1;
+	  n = 0;
+	}
+      cur[n++] = *ev;
+    }
+  /* 'in' ends in SYN_REPORT, copied to cur[n] above. */
+  return cur + n + 1 - out;
+}
+
+/* Ring positions count frames in the high 32 bits and events in the low
+   32, so one compare-and-swap moves both. */
+#define RELAY_POS(frames, events) \
+  (((uint64_t) (uint32_t) (frames) << 32) | (uint32_t) (events))
+#define RELAY_POS_FRAMES(pos) ((uint32_t) ((pos) >> 32))
+#define RELAY_POS_EVENTS(pos) ((uint32_t) (pos))
+
+/* Frames are queued at 'head', which only the relay loop (producer) moves,
+   and taken from 'tail', which the writer (consumer) moves by
+   compare-and-swap after copying them out; so can the producer, to drop
+   the oldest, and the writer's copy is then discarded.  Each side sleeps on
+   a futex flag while it cannot proceed.  The sides' fields sit on separate
+   cache lines. */
+struct relay_writer_s
+{
+  /* Producer's side. */
+  uint64_t head __attribute__ ((aligned (64)));
+  int producer_waiting;		/* futex: waiting for room. */
+  struct relay_state_s state;	/* as pushed, for the drop-oldest repair. */
+  char lost_key[RELAY_NBV_KEY];	/* set by dropped frames, to set again. */
+  char lost_abs[RELAY_NBV_ABS];
+  int nlost;
+  unsigned long long frames, dropped, blocked, occupancy_sum;
+  unsigned occupancy_max;
+
+  /* Consumer's side. */
+  uint64_t tail __attribute__ ((aligned (64)));
+  int consumer_waiting;		/* futex: waiting for frames. */
+  int stopping;
+  unsigned long long written, coalesced, writes, eagain, errors;
+  /* what the writer took, and its merge under RELAY_BP_COALESCE. */
+  struct input_event out[RELAY_RING_EVENTS];
+  struct input_event merged[2 * RELAY_RING_EVENTS];
+
+  /* Set at start. */
+  int sinkfd;
+  enum relay_backpressure_e policy;
+  void (*hook) (void *ctx, const struct input_event *frame, int nev);
+  void *hook_ctx;
+  pthread_t thread;
+
+  /* The ring. */
+  int len[RELAY_RING_FRAMES];	/* events per frame. */
+  struct input_event ev[RELAY_RING_EVENTS];
+};
+
+/* Write 'nev' events from 'buf' in full, then note each frame written. */
+static void
+relay_writer_write (relay_writer_t *w, const struct input_event *buf,
+		    int nev)
+{
+  const struct input_event *ev, *start = buf;
+  struct pollfd pfd = { w->sinkfd, POLLOUT, 0 };
+  size_t done = 0, want = nev * sizeof (*buf);
+  ssize_t res;
+
+  while (done < want)
+    {
+      res = write (w->sinkfd, (const char *) buf + done, want - done);
+      w->writes++;
+      if (res >= 0)
+	done += res;
+      else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	{
+	  w->eagain++;
+	  poll (&pfd, 1, -1);
+	}
+      else if (errno != EINTR)
+	{
+	  w->errors++;
+	  break;
+	}
+    }
+  for (ev = buf; (ev < buf + nev) && ((char *) (ev + 1) - (char *) buf
+				      <= (ssize_t) done); ev++)
+    {
+      if ((ev->type != EV_SYN) || (ev->code != SYN_REPORT))
+	continue;
+      w->written++;
+      if (w->hook)
+	w->hook (w->hook_ctx, start, ev + 1 - start);
+      start = ev + 1;
+    }
+}
+
+static void *
+relay_writer_thread (void *arg)
+{
+  relay_writer_t *w = arg;
+  uint64_t head, tail;
+  uint32_t first, nframes, nev, part;
+  int n;
+
+  for (;;)
+    {
+      tail = __atomic_load_n (&w->tail, __ATOMIC_ACQUIRE);
+      head = __atomic_load_n (&w->head, __ATOMIC_ACQUIRE);
+      if (head == tail)
+	{
+	  if (__atomic_load_n (&w->stopping, __ATOMIC_ACQUIRE))
+	    break;
+	  /* Flag first, then look, so a frame cannot slip in unnoticed. */
+	  __atomic_store_n (&w->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	  if ((__atomic_load_n (&w->head, __ATOMIC_SEQ_CST) == head)
+	      && !__atomic_load_n (&w->stopping, __ATOMIC_SEQ_CST))
+	    relay_futex (&w->consumer_waiting, FUTEX_WAIT_PRIVATE, 1, NULL);
+	  __atomic_store_n (&w->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+	  continue;
+	}
+
+      /* Take everything queued, then give its room back at once. */
+      nframes = RELAY_POS_FRAMES (head) - RELAY_POS_FRAMES (tail);
+      nev = RELAY_POS_EVENTS (head) - RELAY_POS_EVENTS (tail);
+      first = RELAY_POS_EVENTS (tail) & (RELAY_RING_EVENTS - 1);
+      part = (nev < RELAY_RING_EVENTS - first) ? nev : RELAY_RING_EVENTS - first;
+      memcpy (w->out, w->ev + first, part * sizeof (w->out[0]));
+      memcpy (w->out + part, w->ev, (nev - part) * sizeof (w->out[0]));
+      if (!__atomic_compare_exchange_n (&w->tail, &tail, head, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	continue;		/* the oldest were dropped meanwhile. */
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&w->producer_waiting, __ATOMIC_RELAXED)
+	  && __atomic_exchange_n (&w->producer_waiting, 0, __ATOMIC_SEQ_CST))
+	relay_futex (&w->producer_waiting, FUTEX_WAKE_PRIVATE, 1, NULL);
+
+      if ((w->policy == RELAY_BP_COALESCE) && (nframes > 1)
+	  && (w->out[nev - 1].type == EV_SYN)
+	  && (w->out[nev - 1].code == SYN_REPORT))
+	{
+	  n = relay_coalesce (w->out, nev, w->merged);
+	  w->coalesced += nev - n;
+	  relay_writer_write (w, w->merged, n);
+	}
+      else
+	relay_writer_write (w, w->out, nev);
+    }
+  return NULL;
+}
+
+relay_writer_t *
+relay_writer_start (int sinkfd, enum relay_backpressure_e policy,
+		    void (*hook) (void *ctx, const struct input_event *frame,
+				  int nev), void *ctx,
+		    const pthread_attr_t *attr)
+{
+  relay_writer_t *w;
+  sigset_t all, old;
+
+  errno = posix_memalign ((void **) &w, 64, sizeof (*w));
+  if (errno)
+    return NULL;
+  memset (w, 0, sizeof (*w));
+  w->sinkfd = sinkfd;
+  w->policy = policy;
+  w->hook = hook;
+  w->hook_ctx = ctx;
+  /* Signals stay with the caller's threads. */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  errno = pthread_create (&w->thread, attr, relay_writer_thread, w);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (errno)
+    {
+      free (w);
+      return NULL;
+    }
+  return w;
+}
+
+/* Discard the oldest queued frame, unless the writer took it meanwhile;
+   what it changed is set again by the next frame pushed. */
+static void
+relay_writer_drop (relay_writer_t *w, uint64_t tail)
+{
+  uint32_t frame = RELAY_POS_FRAMES (tail), first = RELAY_POS_EVENTS (tail);
+  const struct input_event *ev;
+  int i, n = w->len[frame & (RELAY_RING_FRAMES - 1)];
+
+  if (!__atomic_compare_exchange_n (&w->tail, &tail,
+				    RELAY_POS (frame + 1, first + n), 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+  w->dropped++;
+  for (i = 0; i < n; i++)
+    {
+      ev = w->ev + ((first + i) & (RELAY_RING_EVENTS - 1));
+      if ((ev->type == EV_KEY) && (ev->code < KEY_CNT)
+	  && !(w->lost_key[ev->code / 8] & (1 << (ev->code % 8))))
+	{
+	  w->lost_key[ev->code / 8] |= 1 << (ev->code % 8);
+	  w->nlost++;
+	}
+      else if ((ev->type == EV_ABS) && (ev->code < ABS_CNT)
+	       && !(w->lost_abs[ev->code / 8] & (1 << (ev->code % 8))))
+	{
+	  w->lost_abs[ev->code / 8] |= 1 << (ev->code % 8);
+	  w->nlost++;
+	}
+    }
+}
+
+/* Set lost codes again, as last pushed, in the frame being queued. */
+struct relay_repair_s
+{
+  relay_writer_t *w;
+  const struct input_event *frame;
+  int nev;
+  int type;
+  uint32_t pos;			/* next event slot. */
+};
+
+static void
+relay_cb_repair (int code, void *ctx)
+{
+  struct relay_repair_s *rp = ctx;
+  struct input_event *ev;
+  int i;
+
+  for (i = 0; i < rp->nev; i++)
+    {
+      if ((rp->frame[i].type == rp->type) && (rp->frame[i].code == code))
+	return;			/* set by the frame itself. */
+    }
+  ev = rp->w->ev + (rp->pos++ & (RELAY_RING_EVENTS - 1));
+  ev->time = rp->frame[rp->nev - 1].time;
+  ev->type = rp->type;
+  ev->code = code;
+  if (rp->type == EV_KEY)
+    ev->value = (rp->w->state.key[code / 8] >> (code % 8)) & 1;
+  else
+    ev->value = rp->w->state.abs[code];
+}
+
+int
+relay_writer_push (relay_writer_t *w, const struct input_event *frame,
+		   int nev)
+{
+  struct relay_repair_s rp = { w, frame, nev, 0, 0 };
+  uint64_t head = w->head, tail;
+  uint32_t used, first, part;
+  int waited = 0;
+
+  if ((nev < 1) || (nev > RELAY_RING_EVENTS - RELAY_STATE_MAXEV))
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+  relay_state_track (&w->state, frame, nev);
+  for (;;)
+    {
+      tail = __atomic_load_n (&w->tail, __ATOMIC_ACQUIRE);
+      used = RELAY_POS_EVENTS (head) - RELAY_POS_EVENTS (tail);
+      if ((RELAY_POS_FRAMES (head) - RELAY_POS_FRAMES (tail)
+	   < RELAY_RING_FRAMES)
+	  && (used + nev + w->nlost <= RELAY_RING_EVENTS))
+	break;
+      if (w->policy == RELAY_BP_DROP_OLDEST)
+	{
+	  relay_writer_drop (w, tail);
+	  continue;
+	}
+      /* Wait for the writer to take some.  Flag first, then look. */
+      if (!waited++)
+	w->blocked++;
+      __atomic_store_n (&w->producer_waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&w->tail, __ATOMIC_SEQ_CST) == tail)
+	relay_futex (&w->producer_waiting, FUTEX_WAIT_PRIVATE, 1, NULL);
+      __atomic_store_n (&w->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+  used = RELAY_POS_FRAMES (head) - RELAY_POS_FRAMES (tail);
+  w->frames++;
+  w->occupancy_sum += used;
+  if (used > w->occupancy_max)
+    w->occupancy_max = used;
+
+  first = RELAY_POS_EVENTS (head) & (RELAY_RING_EVENTS - 1);
+  part = ((uint32_t) nev < RELAY_RING_EVENTS - first)
+    ? (uint32_t) nev : RELAY_RING_EVENTS - first;
+  memcpy (w->ev + first, frame, part * sizeof (*frame));
+  memcpy (w->ev, frame + part, (nev - part) * sizeof (*frame));
+  rp.pos = RELAY_POS_EVENTS (head) + nev;
+  if (w->nlost && (frame[nev - 1].type == EV_SYN)
+      && (frame[nev - 1].code == SYN_REPORT))
+    {
+      /* after dropped frames: their keys and axes, then SYN_REPORT. */
+      rp.pos--;
+      rp.type = EV_KEY;
+      relay_walk_bits (w->lost_key, RELAY_NBV_KEY, relay_cb_repair, &rp);
+      rp.type = EV_ABS;
+      relay_walk_bits (w->lost_abs, RELAY_NBV_ABS, relay_cb_repair, &rp);
+      w->ev[rp.pos++ & (RELAY_RING_EVENTS - 1)] = frame[nev - 1];
+      memset (w->lost_key, 0, sizeof (w->lost_key));
+      memset (w->lost_abs, 0, sizeof (w->lost_abs));
+      w->nlost = 0;
+    }
+  w->len[RELAY_POS_FRAMES (head) & (RELAY_RING_FRAMES - 1)] =
+    rp.pos - RELAY_POS_EVENTS (head);
+  __atomic_store_n (&w->head, RELAY_POS (RELAY_POS_FRAMES (head) + 1, rp.pos),
+		    __ATOMIC_RELEASE);
+
+  /* Wake the writer only if it sleeps. */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&w->consumer_waiting, __ATOMIC_RELAXED)
+      && __atomic_exchange_n (&w->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+    relay_futex (&w->consumer_waiting, FUTEX_WAKE_PRIVATE, 1, NULL);
+  return 0;
+}
+
+void
+relay_writer_stats (const relay_writer_t *w, struct relay_writer_stats_s *st)
+{
+  uint64_t head, tail;
+
+  /* each counter is exact; taken together they may be a push apart. */
+  tail = __atomic_load_n (&w->tail, __ATOMIC_ACQUIRE);
+  head = __atomic_load_n (&w->head, __ATOMIC_ACQUIRE);
+  st->occupancy = RELAY_POS_FRAMES (head) - RELAY_POS_FRAMES (tail);
+  st->frames = __atomic_load_n (&w->frames, __ATOMIC_RELAXED);
+  st->dropped = __atomic_load_n (&w->dropped, __ATOMIC_RELAXED);
+  st->blocked = __atomic_load_n (&w->blocked, __ATOMIC_RELAXED);
+  st->occupancy_sum = __atomic_load_n (&w->occupancy_sum, __ATOMIC_RELAXED);
+  st->occupancy_max = __atomic_load_n (&w->occupancy_max, __ATOMIC_RELAXED);
+  st->written = __atomic_load_n (&w->written, __ATOMIC_RELAXED);
+  st->coalesced = __atomic_load_n (&w->coalesced, __ATOMIC_RELAXED);
+  st->writes = __atomic_load_n (&w->writes, __ATOMIC_RELAXED);
+  st->eagain = __atomic_load_n (&w->eagain, __ATOMIC_RELAXED);
+  st->errors = __atomic_load_n (&w->errors, __ATOMIC_RELAXED);
+}
+
+void
+relay_writer_stop (relay_writer_t *w, struct relay_writer_stats_s *st)
+{
+  if (!w)
+    return;
+  __atomic_store_n (&w->stopping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n (&w->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+    relay_futex (&w->consumer_waiting, FUTEX_WAKE_PRIVATE, 1, NULL);
+  pthread_join (w->thread, NULL);
+  if (st)
+    relay_writer_stats (w, st);
+  free (w);
+}
+
+
+/** Embeddable relay **/
+
+struct relay_s
+{
+  int srcfd;			/* source event device, non-blocking. */
+  int sinkfd;			/* uinput (or a stand-in). */
+  int flags;			/* RELAY_* from relay_open(). */
+  int connected;		/* virtual device created. */
+  struct relay_caps_s caps;	/* of srcfd. */
+
+  /* Frame batching: events read but not yet terminated by SYN_REPORT. */
+  struct input_event evbuf[RELAY_EVBUF_COUNT];
+  size_t evbytes;		/* bytes held in evbuf. */
+  struct relay_split_s split;	/* cuts evbuf into frames. */
+
+  void (*hook) (void *ctx, const struct input_event *frame, int nev);
+  void *hook_ctx;
+
+  int has_ff;			/* virtual device takes force feedback. */
+  struct relay_ff_s ff;
+
+  struct relay_state_s state;	/* as relayed, for resync. */
+
+  /* Written while uinput was full (EAGAIN): the source is not read until
+     this is out. */
+  struct input_event outbuf[RELAY_OUTBUF_COUNT];
+  size_t outbytes;
+  size_t outsent;		/* of those, already written. */
+
+  relay_writer_t *writer;	/* relay_start_writer(), or NULL. */
+
+  struct relay_stats_s stats;
+};
+
+static void relay_split_frame (void *ctx, struct input_event *frame, int nev);
+static int relay_split_resync (void *ctx, const struct timeval *time);
+
+relay_t *
+relay_open_fd (int srcfd, int sinkfd, int flags)
+{
+  relay_t *r;
+  int fl;
+
+  fl = fcntl (srcfd, F_GETFL);
+  if ((fl < 0) || (fcntl (srcfd, F_SETFL, fl | O_NONBLOCK) < 0))
+    return NULL;
+  r = calloc (1, sizeof (*r));
+  if (!r)
+    return NULL;
+  r->srcfd = srcfd;
+  r->sinkfd = sinkfd;
+  r->flags = flags;
+  relay_query_caps (srcfd, &(r->caps));
+  relay_state_init (&(r->state), &(r->caps));
+  r->split.frame = relay_split_frame;
+  r->split.resync = relay_split_resync;
+  r->split.ctx = r;
+  r->split.per_event = (flags & RELAY_PER_EVENT) != 0;
+  r->split.state = &(r->state);
+  r->split.syn_dropped = &(r->stats.syn_dropped);
+  return r;
+}
+
+relay_t *
+relay_open (const char *event_path, const char *uinput_path, int flags)
+{
+  relay_t *r;
+  int srcfd, sinkfd, err;
+
+  srcfd = open (event_path, O_RDWR | O_NONBLOCK);
+  if (srcfd < 0)
+    srcfd = open (event_path, O_RDONLY | O_NONBLOCK);	/* no haptics. */
+  if (srcfd < 0)
+    return NULL;
+  sinkfd = open (uinput_path, O_RDWR | O_NONBLOCK);
+  if (sinkfd < 0)
+    {
+      err = errno;
+      close (srcfd);
+      errno = err;
+      return NULL;
+    }
+  r = relay_open_fd (srcfd, sinkfd, flags);
+  if (!r)
+    {
+      err = errno;
+      close (srcfd);
+      close (sinkfd);
+      errno = err;
+    }
+  return r;
+}
+
+const struct relay_caps_s *
+relay_caps (const relay_t *r)
+{
+  return &(r->caps);
+}
+
+int
+relay_connect (relay_t *r, const char *name, const struct input_id *id)
+{
+  if (relay_create_device (r->sinkfd, &(r->caps),
+			   name ? name : r->caps.name,
+			   id ? id : &(r->caps.id)) < 0)
+    return -1;
+  r->connected = 1;
+  if (r->caps.ff_max > 0)
+    {
+      relay_ff_init (&(r->ff), r->srcfd, r->sinkfd);
+      r->has_ff = 1;
+    }
+  return 0;
+}
+
+int
+relay_fds (const relay_t *r, struct pollfd *fds, int nfds)
+{
+  int n = 0;
+
+  if (r->outbytes && (n < nfds))
+    {
+      /* uinput full: wait for room, not for more input. */
+      fds[n].fd = r->sinkfd;
+      fds[n].events = POLLOUT | (r->has_ff ? POLLIN : 0);
+      fds[n++].revents = 0;
+      return n;
+    }
+  if (n < nfds)
+    {
+      fds[n].fd = r->srcfd;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+  if (r->has_ff && (n < nfds))
+    {
+      fds[n].fd = r->sinkfd;
+      fds[n].events = POLLIN;
+      fds[n++].revents = 0;
+    }
+  return n;
+}
+
+void
+relay_set_frame_hook (relay_t *r,
+		      void (*fn) (void *ctx, const struct input_event *frame,
+				  int nev), void *ctx)
+{
+  r->hook = fn;
+  r->hook_ctx = ctx;
+}
+
+/* Hand one frame (or event) to the writer thread, or write it with a
+   single write(); a frame uinput does not take whole (EAGAIN) waits in
+   outbuf, in order, until relay_flush(). */
+static void
+relay_write_frame (relay_t *r, const struct input_event *frame, int nev)
+{
+  size_t want = nev * sizeof (*frame);
+  ssize_t res = 0;
+
+  if (r->writer)
+    {
+      if (relay_writer_push (r->writer, frame, nev) < 0)
+	{
+	  r->stats.lost += nev;
+	  return;
+	}
+    }
+  else
+    {
+      if (r->outbytes == 0)
+	{
+	  r->stats.writes++;
+	  res = write (r->sinkfd, frame, want);
+	  if ((res < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+	    return;
+	  if (res < 0)
+	    {
+	      r->stats.eagain++;
+	      res = 0;
+	    }
+	}
+      if ((size_t) res < want)
+	{
+	  /* all of it, so the hook sees it whole once the rest is out. */
+	  if (r->outbytes + want > sizeof (r->outbuf))
+	    {
+	      r->stats.lost += nev;
+	      return;
+	    }
+	  if (r->outbytes == 0)
+	    r->outsent = res;
+	  memcpy ((char *) r->outbuf + r->outbytes, frame, want);
+	  r->outbytes += want;
+	}
+    }
+  relay_state_track (&(r->state), frame, nev);
+  r->stats.events += nev;
+  if ((frame[nev - 1].type == EV_SYN) && (frame[nev - 1].code == SYN_REPORT))
+    r->stats.frames++;
+  if (r->hook && ((size_t) res == want))
+    r->hook (r->hook_ctx, frame, nev);
+}
+
+/* Write what waits in outbuf, as far as uinput takes it; the hook gets
+   each frame once all of it is out. */
+static void
+relay_flush (relay_t *r)
+{
+  const struct input_event *ev, *start = r->outbuf;
+  ssize_t res;
+  size_t done;
+
+  r->stats.writes++;
+  res = write (r->sinkfd, (char *) r->outbuf + r->outsent,
+	       r->outbytes - r->outsent);
+  if (res < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	{
+	  r->stats.eagain++;
+	  return;
+	}
+      r->stats.lost += (r->outbytes - r->outsent) / sizeof (*ev);
+      r->outbytes = r->outsent = 0;
+      return;
+    }
+  r->outsent += res;
+  for (ev = r->outbuf; (size_t) ((char *) (ev + 1) - (char *) r->outbuf)
+       <= r->outsent; ev++)
+    {
+      if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+	{
+	  if (r->hook)
+	    r->hook (r->hook_ctx, start, ev + 1 - start);
+	  start = ev + 1;
+	}
+    }
+  if (r->outsent == r->outbytes)
+    start = ev;			/* all out: a trailing piece too. */
+  done = (char *) start - (char *) r->outbuf;
+  r->outbytes -= done;
+  r->outsent -= done;
+  memmove (r->outbuf, start, r->outbytes);
+}
+
+/* Writer thread hook: the relay's, if set by then. */
+static void
+relay_writer_hook (void *ctx, const struct input_event *frame, int nev)
+{
+  relay_t *r = ctx;
+
+  if (r->hook)
+    r->hook (r->hook_ctx, frame, nev);
+}
+
+int
+relay_start_writer (relay_t *r, enum relay_backpressure_e policy)
+{
+  if (r->writer)
+    return 0;
+  r->writer = relay_writer_start (r->sinkfd, policy, relay_writer_hook, r,
+				  NULL);
+  return r->writer ? 0 : -1;
+}
+
+void
+relay_stop_writer (relay_t *r)
+{
+  if (!r->writer)
+    return;
+  relay_writer_stop (r->writer, &(r->stats.writer));
+  r->writer = NULL;
+}
+
+/* Relay what differs from the source's state (srcfd -1: release all);
+   returns 1 if a frame went out. */
+static int
+relay_resync (relay_t *r, int srcfd, const struct timeval *time)
+{
+  struct input_event frame[RELAY_STATE_MAXEV];
+  int nev;
+
+  nev = relay_state_diff (&(r->state), srcfd, time, frame);
+  if (nev <= 0)
+    return 0;
+  relay_write_frame (r, frame, nev);
+  return 1;
+}
+
+/* relay_split_frames() callbacks. */
+static void
+relay_split_frame (void *ctx, struct input_event *frame, int nev)
+{
+  relay_write_frame (ctx, frame, nev);
+}
+
+static int
+relay_split_resync (void *ctx, const struct timeval *time)
+{
+  relay_t *r = ctx;
+
+  return relay_resync (r, r->srcfd, time);
+}
+
+/* Whether 'fd' polled ready in 'fds'; with no poll results, assume so. */
+static int
+relay_ready (int fd, const struct pollfd *fds, int nfds)
+{
+  int i;
+
+  if (!fds)
+    return 1;
+  for (i = 0; i < nfds; i++)
+    {
+      if (fds[i].fd == fd)
+	return fds[i].revents != 0;
+    }
+  return 0;
+}
+
+int
+relay_step (relay_t *r, const struct pollfd *fds, int nfds)
+{
+  const int evsize = sizeof (struct input_event);
+  size_t want;
+  ssize_t res;
+  int nframes = 0;
+
+  /* Rumble first: it is rare, and the game waits on each upload. */
+  if (r->has_ff && relay_ready (r->sinkfd, fds, nfds))
+    relay_ff_handle (&(r->ff));
+  if (r->writer)
+    relay_writer_stats (r->writer, &(r->stats.writer));
+  if (r->outbytes && relay_ready (r->sinkfd, fds, nfds))
+    relay_flush (r);
+  if (r->outbytes || !relay_ready (r->srcfd, fds, nfds))
+    return 0;
+
+  for (;;)
+    {
+      want = sizeof (r->evbuf) - r->evbytes;
+      if ((r->flags & RELAY_PER_EVENT) && (want > evsize - r->evbytes % evsize))
+	want = evsize - r->evbytes % evsize;
+      res = read (r->srcfd, (char *) r->evbuf + r->evbytes, want);
+      r->stats.reads++;
+      if (res < 0)
+	{
+	  if ((errno == EAGAIN) || (errno == EINTR))
+	    return nframes;
+	  if (errno == ENODEV)
+	    {
+	      relay_resync (r, -1, NULL);	/* nothing stays held. */
+	      errno = ENODEV;
+	    }
+	  return -1;
+	}
+      if (res == 0)
+	{
+	  errno = EPIPE;
+	  return -1;
+	}
+
+      /* Relay complete frames (or events), keep the rest. */
+      r->evbytes += res;
+      nframes += relay_split_frames (&(r->split), r->evbuf, &(r->evbytes),
+				     RELAY_EVBUF_COUNT);
+      if (((size_t) res < want) || r->outbytes)
+	return nframes;		/* drained (spare the EAGAIN read), or
+				   uinput is full. */
+    }
+}
+
+const struct relay_stats_s *
+relay_stats (const relay_t *r)
+{
+  return &(r->stats);
+}
+
+void
+relay_destroy (relay_t *r)
+{
+  if (!r)
+    return;
+  relay_stop_writer (r);
+  if (r->has_ff)
+    relay_ff_release (&(r->ff));
+  if (r->connected)
+    relay_destroy_device (r->sinkfd);
+  close (r->srcfd);
+  close (r->sinkfd);
+  free (r);
+}
@@ -0,0 +1,388 @@
+/*
+    Steam Controller Xpad Relayer
+    Copyright (C) 2017  PhaethonH
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+/*
+librelay: mirror one event device onto a uinput device, from inside any
+event loop.  Shared by scxrelay and screlay; a launcher or game shim can
+link it (cc -c librelay.c) and run the relay in-process:
+
+    relay_t *r = relay_open ("/dev/input/event5", "/dev/uinput", 0);
+    relay_connect (r, "Xpad Relay", &id);
+    for (;;)
+      {
+	struct pollfd pfd[RELAY_MAX_FDS];
+	int n = relay_fds (r, pfd, RELAY_MAX_FDS);
+	poll (pfd, n, -1);              (or add them to your own loop)
+	if (relay_step (r, pfd, n) < 0)
+	  break;                        (errno ENODEV: unplugged)
+      }
+    relay_destroy (r);
+
+No call exits or keeps global state other than the log, and none blocks
+but relay_device_node(), which waits a bounded time for udev, and
+relay_writer_push() while its ring is full, if told to.  Link with
+-pthread for relay_log_start() and the writer thread.
+Functions returning int give -1 on failure with errno set.
+*/
+
+#ifndef LIBRELAY_H
+#define LIBRELAY_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+
+/** Logging **/
+/* Messages of level above this go to stderr. */
+extern int relay_logthreshold;
+
+int relay_vlogmsg (int loglevel, const char *fmt, va_list vp);
+int relay_logmsg (int loglevel, const char *fmt, ...);
+
+/* Log in the background: from here on relay_logmsg() only stores a
+   fixed-size record (timestamp, level, format, arguments) in a lock-free
+   ring, and a thread formats and writes it out.  Strings passed for %s are
+   copied, cut to 64 bytes per message; at most 8 conversions are kept.
+   Records arriving while the ring is full are dropped and counted.  Each
+   line a record starts is stamped with its time, "[seconds.microseconds] "
+   of CLOCK_MONOTONIC. */
+int relay_log_start (void);
+
+/* Write out what is pending, end the thread, and log synchronously again. */
+void relay_log_stop (void);
+
+/* Records dropped so far. */
+unsigned long long relay_log_dropped (void);
+
+
+/** Device capabilities **/
+/* Bytes in the capability bit vectors. */
+#define RELAY_NBV_EV (1 + EV_CNT/8)
+#define RELAY_NBV_ABS (1 + ABS_CNT/8)
+#define RELAY_NBV_KEY (1 + KEY_CNT/8)
+#define RELAY_NBV_FF (1 + FF_CNT/8)
+
+/* Force-feedback effects one virtual device holds at most. */
+#define RELAY_FF_MAX 64
+
+/* What an event device is and reports. */
+struct relay_caps_s
+{
+  struct input_id id;		/* bus, vendor, product, version. */
+  char name[UINPUT_MAX_NAME_SIZE];	/* device name; "" if none. */
+  char uniq[UINPUT_MAX_NAME_SIZE];	/* unique id (serial); "" if none. */
+  char have_ev[RELAY_NBV_EV];	/* bit vector of event types. */
+  char have_abs[RELAY_NBV_ABS];	/* bit vector of axes. */
+  char have_key[RELAY_NBV_KEY];	/* bit vector of keys/buttons. */
+  char have_ff[RELAY_NBV_FF];	/* bit vector of force-feedback effects. */
+  int ff_max;			/* effects the device holds at once. */
+  struct input_absinfo absinfo[ABS_CNT];	/* axis ranges, where have_abs. */
+};
+
+/* Call cb(idx, ctx) for each bit set in the 'nbytes' long bit vector. */
+void relay_walk_bits (const char *bv, int nbytes,
+		      void (*cb) (int idx, void *ctx), void *ctx);
+
+/* Identity of an event device: 'name' and 'uniq' hold
+   UINPUT_MAX_NAME_SIZE bytes; fields the device does not report stay
+   zeroed. */
+void relay_identify (int fd, struct input_id *id, char *name, char *uniq);
+
+/* Fill 'caps' from event device 'fd'. */
+int relay_query_caps (int fd, struct relay_caps_s *caps);
+
+/* Register 'caps' with uinput on 'uinputfd', under the given name and id,
+   and create the virtual device.  Force feedback is offered when the
+   source has it (see relay_ff_init()). */
+int relay_create_device (int uinputfd, const struct relay_caps_s *caps,
+			 const char *name, const struct input_id *id);
+
+/* Remove the virtual device created on 'uinputfd'. */
+int relay_destroy_device (int uinputfd);
+
+/* Put the event node of the device created on 'uinputfd' in 'path' (e.g.
+   "/dev/input/event17"), then wait up to 'timeout_ms' for udev to have
+   processed it, or without udev (no /run/udev) for the node to exist.
+   Fails with ETIMEDOUT, 'path' filled in, if that takes longer. */
+int relay_device_node (int uinputfd, char *path, size_t size,
+		       int timeout_ms);
+
+
+/** Force feedback **/
+/* Rumble sent to the virtual device goes back to the source.  Effects are
+   cached by their id on the virtual device, so they can be uploaded again
+   when the source is replugged. */
+struct relay_ff_s
+{
+  int srcfd;			/* where effects play; -1 while away. */
+  int uinputfd;			/* virtual device, non-blocking. */
+  struct ff_effect effect[RELAY_FF_MAX];	/* as uploaded, by virtual id. */
+  char cached[RELAY_FF_MAX];	/* effect[id] holds an upload. */
+  short src_id[RELAY_FF_MAX];	/* its id on the source; -1: none. */
+  unsigned long long requests;	/* uploads, erasures and plays handled. */
+};
+
+/* Start relaying force feedback of the device created on 'uinputfd'
+   (sets it non-blocking). */
+void relay_ff_init (struct relay_ff_s *ff, int srcfd, int uinputfd);
+
+/* Handle every request pending on the virtual device; returns how many.
+   Call when uinputfd is readable. */
+int relay_ff_handle (struct relay_ff_s *ff);
+
+/* A new source ('srcfd'), or none (-1): cached effects are uploaded to it,
+   so the game's effect ids stay valid. */
+void relay_ff_attach (struct relay_ff_s *ff, int srcfd);
+
+/* Stop and remove every effect on the source. */
+void relay_ff_release (struct relay_ff_s *ff);
+
+
+/** Input state **/
+/* Keys held and axis values as relayed, to repair the stream after the
+   kernel dropped events (SYN_DROPPED) or the source went away: the
+   virtual device then gets one frame with only what differs from the
+   source's actual state, so no button stays held. */
+struct relay_state_s
+{
+  char key[RELAY_NBV_KEY];	/* keys down. */
+  int abs[ABS_CNT];		/* axis values. */
+  int dropping;			/* SYN_DROPPED read: discard up to SYN_REPORT. */
+  /* of the source, from relay_state_init(). */
+  char have_key[RELAY_NBV_KEY];
+  char have_abs[RELAY_NBV_ABS];
+  int rest[ABS_CNT];		/* axis values with nothing touched. */
+};
+
+/* Most events in a relay_state_diff() frame. */
+#define RELAY_STATE_MAXEV (KEY_CNT + ABS_CNT + 1)
+
+/* Start from the state in 'caps' (axis values as read; no key down). */
+void relay_state_init (struct relay_state_s *st,
+		       const struct relay_caps_s *caps);
+
+/* Note 'nev' events as relayed. */
+void relay_state_track (struct relay_state_s *st,
+			const struct input_event *ev, int nev);
+
+/* Fill 'frame' (RELAY_STATE_MAXEV long) with the events that take the
+   relayed state to the source's current one, read from 'srcfd'
+   (EVIOCGKEY, EVIOCGABS), or with srcfd -1 to every key up and axis at
+   rest; then SYN_REPORT, all stamped 'time' (NULL: now, CLOCK_REALTIME).
+   Returns the number of events, 0 if nothing differs.  Track the frame
+   once relayed. */
+int relay_state_diff (const struct relay_state_s *st, int srcfd,
+		      const struct timeval *time, struct input_event *frame);
+
+
+/** Frame splitting **/
+/* What was read from a source, cut into complete frames (up to
+   SYN_REPORT) for the relay; a partial frame is carried over to the next
+   read.  After SYN_DROPPED, the events up to the next SYN_REPORT are
+   incomplete: they are discarded, and resync() relays what differs from
+   the source's actual state instead.  relay_step() runs on this, as does
+   any relay loop of its own. */
+struct relay_split_s
+{
+  /* A complete frame; with 'per_event', each event alone; or a piece of a
+     frame too large for the buffer (not ending in SYN_REPORT). */
+  void (*frame) (void *ctx, struct input_event *frame, int nev);
+  /* At the SYN_REPORT closing the frame broken by SYN_DROPPED, stamped
+     'time'; returns 1 if a frame went out. */
+  int (*resync) (void *ctx, const struct timeval *time);
+  /* Optional: several complete frames read at once (none dropped), handed
+     over together instead of one by one, e.g. to coalesce them. */
+  void (*batch) (void *ctx, struct input_event *frames, int nev);
+  void *ctx;
+  int per_event;		/* hand over events, not frames. */
+  struct relay_state_s *state;	/* 'dropping' kept here. */
+  unsigned long long *syn_dropped;	/* counted, or NULL. */
+};
+
+/* Hand the complete frames among the '*bytes' bytes in 'buf' ('count'
+   events long) to 'sp', and move what is left of them to the start of
+   'buf', '*bytes' updated.  Returns the number of frames relayed. */
+int relay_split_frames (const struct relay_split_s *sp,
+			struct input_event *buf, size_t *bytes, int count);
+
+
+/** Writer thread **/
+/* Frames handed from the relay loop to a thread that writes them out,
+   through a lock-free single-producer single-consumer ring, so a write
+   that blocks (or finds uinput full) never holds up reading the source,
+   whose kernel buffer would overflow meanwhile.  The writer takes every
+   queued frame at once and writes them with one write(). */
+
+/* Ring size, in frames and in events (powers of two). */
+#define RELAY_RING_FRAMES 256
+#define RELAY_RING_EVENTS 2048
+
+/* What relay_writer_push() does when the ring is full. */
+enum relay_backpressure_e
+{
+  RELAY_BP_BLOCK,		/* wait for room. */
+  RELAY_BP_COALESCE,		/* wait for room; the writer merges what is
+				   queued (see relay_coalesce()), so it
+				   catches up in one short write. */
+  RELAY_BP_DROP_OLDEST,		/* discard the oldest queued frames; keys and
+				   axes they changed are set again in the
+				   next frame, so none stays stale. */
+};
+
+/* Policy names, by enum relay_backpressure_e, then NULL. */
+extern const char *const relay_backpressure_names[];
+
+typedef struct relay_writer_s relay_writer_t;
+
+struct relay_writer_stats_s
+{
+  /* relay loop's side. */
+  unsigned long long frames;	/* pushed. */
+  unsigned long long dropped;	/* frames discarded (drop-oldest). */
+  unsigned long long blocked;	/* pushes that waited for room. */
+  unsigned long long occupancy_sum;	/* frames queued at each push. */
+  unsigned occupancy_max;	/* most frames queued at a push. */
+  unsigned occupancy;		/* frames queued now. */
+  /* writer thread's side. */
+  unsigned long long written;	/* frames written. */
+  unsigned long long coalesced;	/* events saved by merging frames. */
+  unsigned long long writes;	/* write(2) calls. */
+  unsigned long long eagain;	/* writes that found the sink full. */
+  unsigned long long errors;	/* failed writes (their frames are lost). */
+};
+
+/* Merge the 'nev' events of complete frames into as few frames as
+   possible, into 'out' (room for 2 * nev events): an axis keeps only its
+   latest value, relative motion is summed, and every other event (key
+   transitions above all) is kept in order; a second event for the same
+   key starts a new frame, so no press or release is lost to a consumer
+   that only looks at state at SYN_REPORT.  Returns the events in 'out'. */
+int relay_coalesce (const struct input_event *in, int nev,
+		    struct input_event *out);
+
+/* Start a thread writing frames to 'sinkfd' (blocking or not: EAGAIN waits
+   for POLLOUT), calling hook(ctx, frame, nev), if not NULL, from that
+   thread after each frame is written.  The thread is created with 'attr'
+   (its scheduling policy and CPU affinity, say), or NULL for the defaults,
+   which inherit the caller's.  Returns NULL on failure. */
+relay_writer_t *relay_writer_start (int sinkfd,
+				    enum relay_backpressure_e policy,
+				    void (*hook) (void *ctx,
+						  const struct input_event
+						  *frame, int nev), void *ctx,
+				    const pthread_attr_t *attr);
+
+/* Queue one frame (or piece of one), at most RELAY_RING_EVENTS -
+   RELAY_STATE_MAXEV events (else EMSGSIZE).  Call from one thread only;
+   blocks only under RELAY_BP_BLOCK and RELAY_BP_COALESCE, while the ring
+   is full. */
+int relay_writer_push (relay_writer_t *w, const struct input_event *frame,
+		       int nev);
+
+/* Counters so far; safe from any thread. */
+void relay_writer_stats (const relay_writer_t *w,
+			 struct relay_writer_stats_s *st);
+
+/* Write out what is queued, end the thread, leave its final counters in
+   'st' (unless NULL), and free 'w'. */
+void relay_writer_stop (relay_writer_t *w, struct relay_writer_stats_s *st);
+
+
+/** Embeddable relay **/
+typedef struct relay_s relay_t;
+
+/* relay_open() flags. */
+#define RELAY_PER_EVENT 0x01	/* one event per write, not whole frames. */
+
+/* Most fds relay_fds() reports: the source, and uinput for force
+   feedback. */
+#define RELAY_MAX_FDS 2
+
+/* Counters, for measuring syscalls per frame. */
+struct relay_stats_s
+{
+  unsigned long long reads;	/* read(2) calls on the source. */
+  unsigned long long writes;	/* write(2) calls on the sink. */
+  unsigned long long events;	/* input_event relayed. */
+  unsigned long long frames;	/* SYN_REPORT relayed. */
+  unsigned long long syn_dropped;	/* SYN_DROPPED recovered from. */
+  unsigned long long eagain;	/* writes that found uinput full. */
+  unsigned long long lost;	/* events that found no room to wait in. */
+  /* with relay_start_writer(): as of the last relay_step(), or as left by
+     relay_stop_writer(). */
+  struct relay_writer_stats_s writer;
+};
+
+/* Open the source event device and uinput; returns NULL on failure (then
+   see errno). */
+relay_t *relay_open (const char *event_path, const char *uinput_path,
+		     int flags);
+
+/* Relay between already open fds, which the relay then owns.  'sinkfd'
+   need not be uinput (e.g. a memfd for benchmarks); then skip
+   relay_connect(). */
+relay_t *relay_open_fd (int srcfd, int sinkfd, int flags);
+
+/* Capabilities of the source, as read at open. */
+const struct relay_caps_s *relay_caps (const relay_t *r);
+
+/* Create the virtual device; NULL 'name' or 'id' copies the source's. */
+int relay_connect (relay_t *r, const char *name, const struct input_id *id);
+
+/* Fill up to 'nfds' entries with the fds to wait on and their events;
+   returns how many. */
+int relay_fds (const relay_t *r, struct pollfd *fds, int nfds);
+
+/* Relay input, and force feedback back to the source, for the fds that
+   polled ready in 'fds' (as filled by relay_fds(); NULL tries them all),
+   without blocking.  After SYN_DROPPED, the lost events are replaced by a
+   resync frame (see relay_state_diff()).  While uinput is full (EAGAIN),
+   frames wait in the relay and the source is left unread until uinput
+   polls writable.  Returns the number of frames
+   written (0 if nothing was ready), or -1 with errno EPIPE once the source
+   is at end of file, ENODEV once unplugged (held keys are released
+   first). */
+int relay_step (relay_t *r, const struct pollfd *fds, int nfds);
+
+/* Call fn(ctx, frame, nev) after each frame (or event) is written (with a
+   writer thread, from that thread).  A frame that waited for uinput may be
+   passed from where the first write left it. */
+void relay_set_frame_hook (relay_t *r,
+			   void (*fn) (void *ctx,
+				       const struct input_event *frame,
+				       int nev), void *ctx);
+
+/* From here on, write from a second thread (see relay_writer_start());
+   call before relaying. */
+int relay_start_writer (relay_t *r, enum relay_backpressure_e policy);
+
+/* Write out what the thread holds and end it; frames are written by
+   relay_step() again. */
+void relay_stop_writer (relay_t *r);
+
+const struct relay_stats_s *relay_stats (const relay_t *r);
+
+/* Remove the virtual device, if connected, close the fds and free 'r'. */
+void relay_destroy (relay_t *r);
+
+#endif /* LIBRELAY_H */
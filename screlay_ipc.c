@@ -24,6 +24,8 @@ This program uses uinput (the same way Steam client itself does for Steam Contro
 
 In this case, Vendor:Product = f055:11fc.
 (0xf055 is the unofficial vendor-id for FOSS projects)
+
+Build: gcc -pthread -o screlay screlay_ipc.c librelay.c
 */
 
 #include <assert.h>
@@ -42,12 +44,18 @@ In this case, Vendor:Product = f055:11fc.
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <dirent.h>
 #include <signal.h>
 #include <wchar.h>
 
 #include <argp.h>
 
+#include "librelay.h"
+
 #include <locale.h>
 #include <libintl.h>
 #define _(String) String
@@ -62,29 +70,6 @@ In this case, Vendor:Product = f055:11fc.
 #define MODELREV 1
 
 
-int logthreshold = 0;
-
-int vlogmsg (int loglevel, const char * fmt, va_list vp)
-{
-  int retval = 0;
-  if (loglevel > logthreshold)
-    {
-      retval = vfprintf(stderr, fmt, vp);
-      fflush(stderr);
-    }
-  return retval;
-}
-
-int logmsg (int loglevel, const char * fmt, ...)
-{
-  va_list vp;
-  int retval = 0;
-  va_start(vp, fmt);
-  retval = vlogmsg(loglevel, fmt, vp);
-  va_end(vp);
-  return retval;
-}
-
 __inline__
 static
 void die_on_negative (int wrapped_call)
@@ -108,32 +93,68 @@ const int MY_VENDOR_ID = 0xf055;    /* "FOSS" */
 const int MY_PRODUCT_ID = 0x11fc;   /* Copy from Steam Controller Xpad */
 
 
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define NLONGS(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(bv, n) (((bv)[(n) / BITS_PER_LONG] >> ((n) % BITS_PER_LONG)) & 1)
+
+/* What sysfs tells about one event device. */
+struct screlay_devinfo_s {
+    char node[NAME_MAX+1];  /* "eventNN" */
+    int bustype, vendor, product, version;
+    char name[256];
+    char phys[256];
+    char uniq[256];
+    int is_virtual;         /* under /sys/devices/virtual (e.g. Steam's xpad). */
+    unsigned long ev[NLONGS(EV_CNT)];
+    unsigned long key[NLONGS(KEY_CNT)];
+    unsigned long abs[NLONGS(ABS_CNT)];
+};
+
+/* Every event device in the system. */
+struct screlay_index_s {
+    int count, alloc;
+    struct screlay_devinfo_s * dev;
+};
+
+/* Criteria for picking a relay source; each one left at its default
+   matches anything. */
+struct screlay_match_s {
+    int vendor, product;    /* -1: any */
+    const char * name;      /* substring of device name; NULL: any */
+    const char * phys;      /* substring of physical path; NULL: any */
+    int is_virtual;         /* 1: only virtual devices */
+    int joystick;           /* 1: only devices that look like joysticks */
+};
+
+
 /* State information for the relay. */
 struct screlay_s {
     int halt;
     int verbose;
-    int fd;          /* fd to talk to uinput. */
-    int srcfd;       /* file descriptor after opening srcpath. */
+    relay_t * relay; /* source device relayed onto uinput. */
 
-    /* Search by vendor-id and product-id */
+    /* Search the sysfs index: by vendor-id and product-id, and more. */
     int opt_scan;
-    int target_vendor;
-    int target_product;
+    int opt_list;
+    struct screlay_match_s match;
+    const char * sysroot;   /* "" or fake root for /sys. */
 
-    char src_model[255];    /* Human-readable device name of source. */
     char uinput_path[PATH_MAX];  /* path to uinput node. */
     char srcpath[PATH_MAX];  /* Path of Steam Controller's Xpad device. */
 
-    /* Input types to report as existing. */
-    char have_ev[1 + EV_CNT/8];
-    char have_abs[1 + ABS_CNT/8];
-    char have_key[1 + KEY_CNT/8];
+    /* RELAY_PER_EVENT: relay one event per write, not whole frames. */
+    int relay_flags;
+
+    /* Print relay counters (syscalls per frame) on exit. */
+    int opt_stats;
 
-    /* source device identification information. */
-    struct input_id idinfo;
+    /* --writer: write from a second thread, with this policy; -1 if not. */
+    int writer_policy;
 
-    /* UINPUT device descriptor. */
-    struct uinput_user_dev uidev;
+    /* Synthetic load benchmark (--synth). */
+    char * synth_spec;
+    long long * lat;  /* per-frame latency (ns), preallocated; NULL if off. */
+    int nlat, maxlat;
 };
 
 struct screlay_s _inst = { 0, }, *inst = &_inst;
@@ -143,289 +164,261 @@ void screlay_init ()
   memset(inst, 0, sizeof(struct screlay_s));
   inst->verbose = 1;
   strcpy(inst->uinput_path, DEFAULT_UINPUT_PATH);
-  inst->fd = -1;
-  inst->srcfd = -1;
-  inst->target_vendor = DEFAULT_TARGET_VENDOR_ID;
-  inst->target_product = DEFAULT_TARGET_PRODUCT_ID;
+  inst->match.vendor = DEFAULT_TARGET_VENDOR_ID;
+  inst->match.product = DEFAULT_TARGET_PRODUCT_ID;
+  inst->sysroot = "";
+  inst->writer_policy = -1;
 }
 
 void screlay_destroy ()
 {
-  if (inst->fd >= 0)
+  relay_destroy(inst->relay);
+  inst->relay = NULL;
+}
+
+/** Device discovery index, from sysfs.  No device node is opened. **/
+
+/* Read first line of <dir>/<file> into buf, without newline.
+   Returns 0 on success, -1 if unreadable (buf is then empty). */
+static
+int screlay_sysfs_read (const char * dir, const char * file, char * buf, int bufsize)
+{
+  char path[PATH_MAX];
+  FILE * fp;
+  char * nl;
+
+  buf[0] = 0;
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  fp = fopen(path, "r");
+  if (fp == NULL)
     {
-      close(inst->fd);
+      return -1;
     }
+  if (fgets(buf, bufsize, fp) == NULL)
+    {
+      buf[0] = 0;
+    }
+  fclose(fp);
+  nl = strchr(buf, '\n');
+  if (nl)
+    {
+      *nl = 0;
+    }
+  return 0;
 }
 
-/* Open event device. */
-int screlay_open (const char * sc_path)
+static
+int screlay_sysfs_hex (const char * dir, const char * file)
 {
-  int fd = -1;
-  int res;
+  char buf[32];
 
-  fd = open(sc_path, O_RDONLY);
-  if (fd < 0)
+  if (screlay_sysfs_read(dir, file, buf, sizeof(buf)) < 0)
     {
       return -1;
     }
+  return strtol(buf, NULL, 16);
+}
 
-  /* Get device name; might fail. */
-  res = ioctl(fd, EVIOCGNAME(sizeof(inst->src_model)), inst->src_model);
-  if (res < 0)
+/* Capability file: words of unsigned long in hex, most significant first. */
+static
+void screlay_sysfs_bits (const char * dir, const char * file, unsigned long * bv, int nlongs)
+{
+  char buf[1024];
+  char * words[64];
+  char * p;
+  int nwords = 0;
+  int i;
+
+  memset(bv, 0, nlongs * sizeof(*bv));
+  screlay_sysfs_read(dir, file, buf, sizeof(buf));
+  for (p = strtok(buf, " "); p && (nwords < 64); p = strtok(NULL, " "))
     {
-      inst->src_model[0] = 0;
+      words[nwords++] = p;
+    }
+  for (i = 0; (i < nwords) && (i < nlongs); i++)
+    {
+      bv[i] = strtoul(words[nwords - 1 - i], NULL, 16);
     }
-
-  return fd;
 }
 
-/* Determine if (opened) event device has appropriate USB ID. */
-int screlay_is_matched_usb_id (int fd)
+/* The heuristic of udev's ID_INPUT_JOYSTICK, roughly: X and Y axes, and
+   joystick or gamepad buttons. */
+static
+int screlay_devinfo_is_joystick (const struct screlay_devinfo_s * dev)
 {
-  int res;
+  int code;
 
-  res = ioctl(fd, EVIOCGID, &(inst->idinfo));
-  if (res == 0)
+  if (!TEST_BIT(dev->ev, EV_ABS) || !TEST_BIT(dev->abs, ABS_X) || !TEST_BIT(dev->abs, ABS_Y))
+    {
+      return 0;
+    }
+  for (code = BTN_JOYSTICK; code < BTN_DIGI; code++)
     {
-      if ((inst->idinfo.vendor == inst->target_vendor)
-	  && (inst->idinfo.product == inst->target_product))
+      if (TEST_BIT(dev->key, code))
 	{
 	  return 1;
 	}
     }
-
   return 0;
 }
 
-/* Find (first) Steam Controller Xpad device: first /dev/input/event* device
- which has specific USB ID (default 28de:11fc). */
-int screlay_scan ()
+/* Fill 'index' with every event device under <sysroot>/sys/class/input
+   (sysroot is "" for the running system, or a fake tree for testing).
+   Returns number of devices, or -1 on failure (then see errno). */
+int screlay_index_build (struct screlay_index_s * index, const char * sysroot)
 {
-  const char * basedir = "/dev/input";
-  char * scanpath = NULL;
-  int scanpathsize = 4096;
-  int res;
+  char classdir[PATH_MAX];
+  char devdir[PATH_MAX + NAME_MAX + 8];
+  char realdir[PATH_MAX];
+  struct screlay_devinfo_s * dev;
+  struct dirent * entry;
   DIR * dir;
-  struct dirent entry;
-  struct dirent * result;
-
-  scanpath = malloc(scanpathsize);
 
-  dir = opendir(basedir);
-  while (dir != NULL)
+  snprintf(classdir, sizeof(classdir), "%s/sys/class/input", sysroot);
+  dir = opendir(classdir);
+  if (dir == NULL)
     {
-      res = readdir_r(dir, &entry, &result);
-      // Assuming Linux kernel.
-      if (res == 0)
+      return -1;
+    }
+  index->count = 0;
+  while ((entry = readdir(dir)) != NULL)
+    {
+      /* Require 'event' prefix. */
+      if (0 != strncmp(entry->d_name, "event", 5))
+	continue;
+      if (index->count == index->alloc)
 	{
-	  if (result == NULL)
-	    {
-	      /* end of directory. */
-	      closedir(dir);
-	      dir = NULL;
-	    }
-	  else
-	    {
-	      /* valid entry, check for SteamControllerXpad-ness */
-	      int srcfd;
-	      /* Require 'event' prefix. */
-	      if (0 != strncmp(entry.d_name, "event", 5))
-		continue;
-	      snprintf(scanpath, scanpathsize, "%s/%s", basedir, entry.d_name);
-	      srcfd = screlay_open(scanpath);
-	      if (screlay_is_matched_usb_id(srcfd))
-		{
-		  snprintf(inst->srcpath, sizeof(inst->srcpath), "%s", scanpath);
-		  inst->srcfd = srcfd;
-		  closedir(dir);
-		  dir = NULL;
-		}
-	    }
+	  index->alloc = index->alloc ? 2 * index->alloc : 16;
+	  index->dev = realloc(index->dev, index->alloc * sizeof(*index->dev));
 	}
-      else
+      dev = index->dev + index->count++;
+      memset(dev, 0, sizeof(*dev));
+      snprintf(dev->node, sizeof(dev->node), "%s", entry->d_name);
+
+      /* eventNN/device is the inputMM directory holding id/, name, ... */
+      snprintf(devdir, sizeof(devdir), "%s/%s/device", classdir, entry->d_name);
+      dev->bustype = screlay_sysfs_hex(devdir, "id/bustype");
+      dev->vendor = screlay_sysfs_hex(devdir, "id/vendor");
+      dev->product = screlay_sysfs_hex(devdir, "id/product");
+      dev->version = screlay_sysfs_hex(devdir, "id/version");
+      screlay_sysfs_read(devdir, "name", dev->name, sizeof(dev->name));
+      screlay_sysfs_read(devdir, "phys", dev->phys, sizeof(dev->phys));
+      screlay_sysfs_read(devdir, "uniq", dev->uniq, sizeof(dev->uniq));
+      screlay_sysfs_bits(devdir, "capabilities/ev", dev->ev, NLONGS(EV_CNT));
+      screlay_sysfs_bits(devdir, "capabilities/key", dev->key, NLONGS(KEY_CNT));
+      screlay_sysfs_bits(devdir, "capabilities/abs", dev->abs, NLONGS(ABS_CNT));
+      if (realpath(devdir, realdir))
 	{
-	  closedir(dir);
-	  dir = NULL;
-	  perror(_("Scanning for event devices"));
-	  exit(EXIT_FAILURE);
+	  dev->is_virtual = (strstr(realdir, "/devices/virtual/") != NULL);
 	}
     }
+  closedir(dir);
 
-  free(scanpath);
-
-  return 0;
+  return index->count;
 }
 
-
-/* Set of callbacks applied to a bitvector. */
-#define SCRELAY_BV_CB(cbname) static int screlay_cb_##cbname (int idx)
-SCRELAY_BV_CB(ioc_set_evbit)
-{
-  die_on_negative( ioctl(inst->fd, UI_SET_EVBIT, idx) );
-  return 0;
-}
-SCRELAY_BV_CB(ioc_set_absbit)
-{
-  die_on_negative( ioctl(inst->fd, UI_SET_ABSBIT, idx) );
-  return 0;
-}
-SCRELAY_BV_CB(ioc_set_keybit)
+void screlay_index_free (struct screlay_index_s * index)
 {
-  die_on_negative( ioctl(inst->fd, UI_SET_KEYBIT, idx) );
-  return 0;
+  free(index->dev);
+  memset(index, 0, sizeof(*index));
 }
-SCRELAY_BV_CB(ioc_get_absinfo)
-{
-  struct input_absinfo absinfo;
 
-  ioctl(inst->srcfd, EVIOCGABS(idx), &absinfo);
-  inst->uidev.absmin[idx] = absinfo.minimum;
-  inst->uidev.absmax[idx] = absinfo.maximum;
-  inst->uidev.absfuzz[idx] = absinfo.fuzz;
-  inst->uidev.absflat[idx] = absinfo.flat;
-
-  return 0;
+int screlay_index_matches (const struct screlay_devinfo_s * dev, const struct screlay_match_s * match)
+{
+  if ((match->vendor >= 0) && (dev->vendor != match->vendor))
+    return 0;
+  if ((match->product >= 0) && (dev->product != match->product))
+    return 0;
+  if (match->name && !strstr(dev->name, match->name))
+    return 0;
+  if (match->phys && !strstr(dev->phys, match->phys))
+    return 0;
+  if (match->is_virtual && !dev->is_virtual)
+    return 0;
+  if (match->joystick && !screlay_devinfo_is_joystick(dev))
+    return 0;
+  return 1;
 }
 
-
-/* Walk a bitvector, calling 'cb' with argument of the bit index that is set. */
-void screlay_walk_bitvectoridx (char bitvector[], int vecbytes, int (*cb)(int))
+/* First device matching all criteria, in eventNN order; NULL if none. */
+const struct screlay_devinfo_s * screlay_index_find (const struct screlay_index_s * index, const struct screlay_match_s * match)
 {
-  int nbyte, nbit;
+  const struct screlay_devinfo_s * best = NULL;
+  int i;
 
-  for (nbyte = 0; nbyte < vecbytes; nbyte++)
+  for (i = 0; i < index->count; i++)
     {
-      for (nbit = 0; nbit < 8; nbit++)
+      if (!screlay_index_matches(index->dev + i, match))
+	continue;
+      /* readdir order is arbitrary: prefer lowest event number. */
+      if (!best || (atoi(index->dev[i].node + 5) < atoi(best->node + 5)))
 	{
-	  if (bitvector[nbyte] & (1 << nbit))
-	    {
-	      int idx = (nbyte * 8) + nbit;
-	      cb(idx);
-	    }
+	  best = index->dev + i;
 	}
     }
+  return best;
 }
 
-static
-void screlay_register_abilities_by_data ()
+void screlay_index_print (const struct screlay_index_s * index, const struct screlay_match_s * match)
 {
-  int res;
-
-  /* Bit-vector pattern.  These ioctls return a bitvector; positions
-   correponding to a binary 1 indicate a callback function to call for that
-   position (e.g. bit position 14 is set => call with 14). */
-  struct bitvector_scan_s {
-      int bvioc;  /* ioctl command returning bitvector. */
-      char * buf;  /* Start of bitvector to write. */
-      int (*cb)(int);  /* callback applied to bit positions that are set. */
-  } bitvector_scans[] = {
-	{ EVIOCGBIT(0, sizeof(inst->have_ev)), inst->have_ev, screlay_cb_ioc_set_evbit },
-	{ EVIOCGBIT(EV_ABS, sizeof(inst->have_abs)), inst->have_abs, screlay_cb_ioc_set_absbit },
-	{ EVIOCGBIT(EV_KEY, sizeof(inst->have_key)), inst->have_key, screlay_cb_ioc_set_keybit },
-	/* Extend for other input features as needed. */
-	{ 0, },
-  }, *iter;
-  for (iter = bitvector_scans; iter->cb; iter++)
-    {
-      if ( (res = ioctl(inst->srcfd, iter->bvioc, iter->buf)) > 0 )
-	  screlay_walk_bitvectoridx(iter->buf, res, iter->cb);
+  const struct screlay_devinfo_s * dev;
+  int i;
+
+  for (i = 0; i < index->count; i++)
+    {
+      dev = index->dev + i;
+      if (!screlay_index_matches(dev, match))
+	continue;
+      printf("/dev/input/%s\t%04x:%04x\t%s%s\t\"%s\"\t%s\n", dev->node, dev->vendor, dev->product, dev->is_virtual ? "virtual" : "-", screlay_devinfo_is_joystick(dev) ? ",joystick" : "", dev->name, dev->phys);
     }
 }
 
-static
-void screlay_register_abilities_by_code ()
+/* Find the relay source from the sysfs index, and open only that node.
+   Returns 0 on success, -1 if none matched. */
+int screlay_scan ()
 {
-  int datasize = (KEY_CNT+1)/8;
-  char * data = malloc(datasize);
-  int res;
+  struct screlay_index_s index = { 0, };
+  const struct screlay_devinfo_s * dev;
 
-  res = ioctl(inst->srcfd, EVIOCGBIT(0, datasize), data);
-  if (res > 0)
+  if (screlay_index_build(&index, inst->sysroot) < 0)
     {
-      screlay_walk_bitvectoridx(data, res, screlay_cb_ioc_set_evbit);
-      memcpy(inst->have_ev, data, res);
+      perror(_("Scanning for event devices"));
+      exit(EXIT_FAILURE);
     }
-
-  res = ioctl(inst->srcfd, EVIOCGBIT(EV_ABS, datasize), data);
-  if (res > 0)
+  dev = screlay_index_find(&index, &(inst->match));
+  if (dev)
     {
-      screlay_walk_bitvectoridx(data, res, screlay_cb_ioc_set_absbit);
-      memcpy(inst->have_abs, data, res);
+      snprintf(inst->srcpath, sizeof(inst->srcpath), "/dev/input/%s", dev->node);
     }
+  screlay_index_free(&index);
 
-  res = ioctl(inst->srcfd, EVIOCGBIT(EV_KEY, datasize), data);
-  if (res > 0)
-    {
-      screlay_walk_bitvectoridx(data, res, screlay_cb_ioc_set_keybit);
-      memcpy(inst->have_key, data, res);
-    }
-
-  free(data);
+  return dev ? 0 : -1;
 }
 
+
 /* Mimick "plugging in" the virtual device. */
 int screlay_connect ()
 {
-  int res;
+  struct input_id id = {
+      .bustype = BUS_VIRTUAL,
+      .vendor = MY_VENDOR_ID,
+      .product = MY_PRODUCT_ID,
+      .version = MODELREV,
+  };
 
-  if (inst->srcfd < 0)
+  if (inst->relay == NULL)
     {
       return -EBADF;
     }
 
-  /* Open uinput node. */
-  inst->fd = open(inst->uinput_path, O_WRONLY | O_NONBLOCK);
-  if (inst->fd < 0)
-    {
-      perror(_("Unable to open uinput device"));
-      exit(EXIT_FAILURE);
-    }
-
-  int codeidx;
-  int syscode;
-
-  int nbyte, nbit;
-  int nbev = sizeof(inst->have_ev);
-  int nbabs = sizeof(inst->have_abs);
-  int nbkey = sizeof(inst->have_key);
-
-  /* Register device abilities. */
-#if 1
-  screlay_register_abilities_by_data();
-#else
-  screlay_register_abilities_by_code();
-#endif //0
-
-  /* Prepare the UINPUT device descriptor. */
-  memset(&(inst->uidev), 0, sizeof(inst->uidev));
-  /* Fill in the fields. */
-  snprintf(inst->uidev.name, UINPUT_MAX_NAME_SIZE, "%s", MODELNAME);
-  inst->uidev.id.bustype = BUS_VIRTUAL;
-  inst->uidev.id.vendor = MY_VENDOR_ID;
-  inst->uidev.id.product = MY_PRODUCT_ID;
-  inst->uidev.id.version = MODELREV;
-  /* Copy absinfo from source (also goes into inst->uidev). */
-  screlay_walk_bitvectoridx(inst->have_abs, sizeof(inst->have_abs), screlay_cb_ioc_get_absinfo);
-
-  /* Write the device descriptor to the fd. */
-  die_on_negative( write(inst->fd, &(inst->uidev), sizeof(inst->uidev)) );
-
   /* Create ("connect") the relay device. */
-  die_on_negative( ioctl(inst->fd, UI_DEV_CREATE) );
+  die_on_negative( relay_connect(inst->relay, MODELNAME, &id) );
 
   /* Relay device now created. */
 
   return 0;
 }
 
-/* Mimick disconnecting ("unplugging") the relay device. */
-int screlay_disconnect ()
-{
-  int ret;
-  ret = ioctl(inst->fd, UI_DEV_DESTROY);
-  return ret;
-}
-
 int screlay_test_hang ()
 {
   int t = 0;
@@ -441,11 +434,23 @@ void on_sigint (int signum)
   inst->halt = 1;
 }
 
+/* Frame hook: kernel-style CLOCK_MONOTONIC timestamp to write() return. */
+static
+void screlay_note_latency (void * ctx, const struct input_event * frame, int nev)
+{
+  struct timespec now;
+
+  if ((frame[nev-1].type == EV_SYN) && (frame[nev-1].code == SYN_REPORT) && (inst->nlat < inst->maxlat))
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      inst->lat[inst->nlat++] = (now.tv_sec - (long long)frame[nev-1].time.tv_sec) * 1000000000LL + now.tv_nsec - frame[nev-1].time.tv_usec * 1000LL;
+    }
+}
+
 int screlay_mainloop ()
 {
-  int res;
-  struct input_event ev;
-  const int evsize = sizeof(struct input_event);
+  struct pollfd fds[RELAY_MAX_FDS];
+  int nfds;
 
   struct sigaction act = {
       .sa_handler = on_sigint,
@@ -457,30 +462,216 @@ int screlay_mainloop ()
   inst->halt = 0;
   while (! inst->halt)
     {
-      res = read(inst->srcfd, &ev, evsize);
-      if (res == evsize)
+      nfds = relay_fds(inst->relay, fds, RELAY_MAX_FDS);
+      if ((poll(fds, nfds, -1) < 0) && (errno != EINTR))
 	{
-	  write(inst->fd, &ev, evsize);
+	  perror(_("Waiting on source device file"));
+	  inst->halt = 1;
 	}
-      else if (res == 0)
+      else if (relay_step(inst->relay, fds, nfds) < 0)
 	{
+	  if (errno != EPIPE)
+	    {
+	      perror(_("Reading from source device file"));
+	    }
 	  // file closed.
 	  inst->halt = 1;
 	}
-      else if (res < 0)
+    }
+  return 0;
+}
+
+void screlay_print_stats ()
+{
+  const struct relay_stats_s * st = relay_stats(inst->relay);
+
+  relay_logmsg(1, _("%llu events, %llu frames; %llu read, %llu write\n"), st->events, st->frames, st->reads, st->writes);
+  if (st->eagain || st->lost)
+    {
+      relay_logmsg(1, _("%llu writes found uinput full, %llu events lost\n"), st->eagain, st->lost);
+    }
+  if (inst->writer_policy >= 0)
+    {
+      relay_logmsg(1, _("writer thread (%s): %llu frames written in %llu writes (%llu EAGAIN, %llu failed), %llu coalesced\n"), relay_backpressure_names[inst->writer_policy], st->writer.written, st->writer.writes, st->writer.eagain, st->writer.errors, st->writer.coalesced);
+      relay_logmsg(1, _("ring: %.2f frames queued per push (max %u of %d), %llu pushes waited, %llu frames dropped\n"), st->writer.frames ? (double)st->writer.occupancy_sum / st->writer.frames : 0.0, st->writer.occupancy_max, RELAY_RING_FRAMES, st->writer.blocked, st->writer.dropped);
+    }
+  if (st->frames)
+    {
+      relay_logmsg(1, _("%.2f syscalls/frame\n"), (double)(st->reads + st->writes + st->writer.writes) / st->frames);
+    }
+}
+
+
+
+
+/* Synthetic load benchmark: feed generated frames through a pipe into
+ screlay_mainloop(), with an in-memory file (memfd) standing in for uinput. */
+struct synth_s {
+    int rate;     /* frames per second. */
+    int frames;   /* total frames. */
+    int axes;     /* EV_ABS per frame (0-8). */
+    int buttons;  /* EV_KEY per frame (0-16). */
+    int burst;    /* frames written back-to-back. */
+};
+
+/* Parse "rate=1000,frames=10000,axes=4,buttons=1,burst=1". */
+static
+int screlay_synth_parse (struct synth_s * synth, char * spec)
+{
+  char * item, * save = NULL, * eq;
+
+  synth->rate = 1000;
+  synth->frames = 10000;
+  synth->axes = 4;
+  synth->buttons = 1;
+  synth->burst = 1;
+  for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+      if (!(eq = strchr(item, '=')))
+	return -1;
+      *eq++ = 0;
+      if (!strcmp(item, "rate")) synth->rate = atoi(eq);
+      else if (!strcmp(item, "frames")) synth->frames = atoi(eq);
+      else if (!strcmp(item, "axes")) synth->axes = atoi(eq);
+      else if (!strcmp(item, "buttons")) synth->buttons = atoi(eq);
+      else if (!strcmp(item, "burst")) synth->burst = atoi(eq);
+      else return -1;
+    }
+  if ((synth->rate < 1) || (synth->burst < 1) || (synth->frames < 0)
+      || (synth->axes < 0) || (synth->axes > 8)
+      || (synth->buttons < 0) || (synth->buttons > 16))
+    return -1;
+  return 0;
+}
+
+/* Write synthetic frames at the given rate, stamped like the kernel would. */
+static
+void screlay_synth_feed (int fd, const struct synth_s * synth)
+{
+  const int axis_codes[] = { ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ, ABS_HAT0X, ABS_HAT0Y };
+  struct input_event frame[8 + 16 + 1];
+  struct timespec next, now;
+  long long period_ns = 1000000000LL / synth->rate;
+  int n, i, f;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (f = 0; f < synth->frames; f++)
+    {
+      if ((f % synth->burst) == 0)
 	{
-	  perror(_("Reading from source device file"));
-	  inst->halt = 1;
+	  next.tv_nsec += period_ns * synth->burst;
+	  next.tv_sec += next.tv_nsec / 1000000000LL;
+	  next.tv_nsec %= 1000000000LL;
+	  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 	}
-      else
+      memset(frame, 0, sizeof(frame));
+      n = 0;
+      for (i = 0; i < synth->axes; i++, n++)
 	{
-	  // partial read.
-	  fprintf(stderr, _("ERROR: Partial read %d from source device file\n"), res);
-	  inst->halt = 1;
+	  frame[n].type = EV_ABS;
+	  frame[n].code = axis_codes[i];
+	  frame[n].value = ((f * (i + 1) * 97) & 0xffff) - 32768;
 	}
+      for (i = 0; i < synth->buttons; i++, n++)
+	{
+	  frame[n].type = EV_KEY;
+	  frame[n].code = BTN_SOUTH + i;
+	  frame[n].value = (f + i) & 1;
+	}
+      frame[n].type = EV_SYN;
+      frame[n++].code = SYN_REPORT;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      for (i = 0; i < n; i++)
+	{
+	  frame[i].time.tv_sec = now.tv_sec;
+	  frame[i].time.tv_usec = now.tv_nsec / 1000;
+	}
+      if (write(fd, frame, n * sizeof(frame[0])) < 0)
+	return;
     }
 }
 
+static
+int cmp_longlong (const void * a, const void * b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+int screlay_bench_synth ()
+{
+  struct synth_s synth;
+  struct timespec t0, t1;
+  struct rusage ru0, ru1;
+  const struct relay_stats_s * st;
+  double elapsed, cpu;
+  int pfd[2], sinkfd;
+  pid_t pid;
+
+  if (screlay_synth_parse(&synth, inst->synth_spec) < 0)
+    {
+      fprintf(stderr, _("ERROR: bad --synth specification\n"));
+      return EXIT_FAILURE;
+    }
+  relay_logmsg(1, _("Synthetic load: %d frames at %d Hz, burst %d, %d axes + %d buttons per frame\n"), synth.frames, synth.rate, synth.burst, synth.axes, synth.buttons);
+
+  die_on_negative( pipe(pfd) );
+  pid = fork();
+  die_on_negative(pid);
+  if (pid == 0)
+    {
+      close(pfd[0]);
+      screlay_synth_feed(pfd[1], &synth);
+      _exit(EXIT_SUCCESS);
+    }
+  close(pfd[1]);
+
+  sinkfd = syscall(__NR_memfd_create, "screlay-sink", 0);
+  die_on_negative(sinkfd);
+  inst->relay = relay_open_fd(pfd[0], sinkfd, inst->relay_flags);
+  if (inst->relay == NULL)
+    {
+      perror(_("Opening relay"));
+      return EXIT_FAILURE;
+    }
+  inst->lat = malloc(((size_t)synth.frames + 1) * sizeof(long long));
+  inst->maxlat = inst->lat ? synth.frames : 0;
+  if (inst->lat == NULL)
+    relay_logmsg(1, _("No memory for %d latency samples; not measuring latency\n"), synth.frames);
+  relay_set_frame_hook(inst->relay, screlay_note_latency, NULL);
+  if (inst->writer_policy >= 0)
+    die_on_negative( relay_start_writer(inst->relay, inst->writer_policy) );
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  getrusage(RUSAGE_SELF, &ru0);
+  screlay_mainloop();
+  relay_stop_writer(inst->relay);
+  getrusage(RUSAGE_SELF, &ru1);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  waitpid(pid, NULL, 0);
+
+  elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec)
+      + ((ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)) / 1e6;
+  st = relay_stats(inst->relay);
+  relay_logmsg(1, _("== screlay: %llu frames in %.3f s, %.0f events/s, %.0f frames/s, %.2f us CPU/frame\n"), st->frames, elapsed, st->events / elapsed, st->frames / elapsed, cpu * 1e6 / (st->frames ? st->frames : 1));
+  screlay_print_stats();
+  if (inst->nlat)
+    {
+      qsort(inst->lat, inst->nlat, sizeof(long long), cmp_longlong);
+      relay_logmsg(1, _("latency us p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n"),
+	     inst->lat[inst->nlat / 2] / 1e3,
+	     inst->lat[(int)(inst->nlat * 0.99)] / 1e3,
+	     inst->lat[(int)(inst->nlat * 0.999)] / 1e3,
+	     inst->lat[inst->nlat - 1] / 1e3);
+    }
+
+  free(inst->lat);
+  inst->lat = NULL;
+  screlay_destroy();
+  return EXIT_SUCCESS;
+}
+
 
 
 
@@ -497,8 +688,18 @@ static char args_doc[] = N_("");
 static struct argp_option options[] = {
       { "auto", 'a', 0, 0, N_("Auto-scan for relay source") },
       { "device", 'd', N_("PATH"), 0, N_("Explicit device path (no scan, no id check)") },
-      { "usbid", 'u', N_("USB_ID"), 0, N_("Scan to match USB ID for relay source [28de:11fc]") },
+      { "usbid", 'u', N_("USB_ID"), 0, N_("Scan to match USB ID for relay source [28de:11fc]; '*' for any") },
+      { "name", 'n', N_("TEXT"), 0, N_("Scan to match device name containing TEXT") },
+      { "phys", 'p', N_("TEXT"), 0, N_("Scan to match physical path containing TEXT") },
+      { "virtual", 'V', 0, 0, N_("Scan to match only virtual devices (like Steam's xpad)") },
+      { "joystick", 'j', 0, 0, N_("Scan to match only joystick-like devices") },
+      { "list", 'l', 0, 0, N_("List matching devices from sysfs and exit") },
+      { "sysroot", 'R', N_("DIR"), 0, N_("Read sysfs under DIR instead of / (for testing)") },
       { "quiet", 'q', 0, 0, N_("Verbose output") },
+      { "per-event", '1', 0, 0, N_("Relay one event per read/write instead of whole frames") },
+      { "stats", 's', 0, 0, N_("Print relay counters (syscalls per frame) on exit") },
+      { "writer", 'W', N_("POLICY"), 0, N_("Write to uinput from a second thread, so reads never wait on it; when its queue is full: block, coalesce (merge what waits) or drop-oldest") },
+      { "synth", 'S', N_("SPEC"), 0, N_("Benchmark the relay loop on generated load, no device needed; SPEC is rate=HZ,frames=N,axes=N,buttons=N,burst=N") },
       { 0 },
 };
 
@@ -520,13 +721,61 @@ screlay_parse_opt (int key, char *arg, struct argp_state *state)
     case 'q':
       inst->verbose = 0;
       break;
+    case '1':
+      inst->relay_flags |= RELAY_PER_EVENT;
+      break;
+    case 's':
+      inst->opt_stats = 1;
+      break;
+    case 'S':
+      inst->synth_spec = arg;
+      break;
+    case 'W':
+      for (i = 0; relay_backpressure_names[i]; i++)
+	{
+	  if (0 == strcmp(arg, relay_backpressure_names[i]))
+	    break;
+	}
+      if (! relay_backpressure_names[i])
+	argp_error(state, _("unknown --writer policy: %s"), arg);
+      inst->writer_policy = i;
+      break;
     case 'u':
-      i = strtol(arg, &p, 16);
-      inst->target_vendor = i;
-      i = strtol(p+1, NULL, 16);
-      inst->target_product = i;
+      if (0 == strcmp(arg, "*"))
+	{
+	  inst->match.vendor = inst->match.product = -1;
+	}
+      else
+	{
+	  i = strtol(arg, &p, 16);
+	  inst->match.vendor = i;
+	  i = strtol(p+1, NULL, 16);
+	  inst->match.product = i;
+	}
+      inst->opt_scan = 1;
+      break;
+    case 'n':
+      inst->match.name = arg;
+      inst->opt_scan = 1;
+      break;
+    case 'p':
+      inst->match.phys = arg;
+      inst->opt_scan = 1;
+      break;
+    case 'V':
+      inst->match.is_virtual = 1;
+      inst->opt_scan = 1;
+      break;
+    case 'j':
+      inst->match.joystick = 1;
       inst->opt_scan = 1;
       break;
+    case 'l':
+      inst->opt_list = 1;
+      break;
+    case 'R':
+      inst->sysroot = arg;
+      break;
     }
   return 0;
 }
@@ -552,31 +801,66 @@ int main (int argc, char ** argv)
 
   argp_parse(&argp, argc, argv, 0, 0, inst);
 
-  if (inst->opt_scan)
+  if (inst->synth_spec)
     {
-      /* Auto-scan for xpad. */
-      screlay_scan();
+      /* Benchmark; no source device, no uinput. */
+      return screlay_bench_synth();
     }
-  else if (inst->srcpath[0])
+
+  if (inst->opt_list)
     {
-      /* Explicit xpad. */
-      inst->srcfd = screlay_open(inst->srcpath);
+      /* Show the index; no device is opened. */
+      struct screlay_index_s index = { 0, };
+      if (screlay_index_build(&index, inst->sysroot) < 0)
+	{
+	  perror(_("Scanning for event devices"));
+	  exit(EXIT_FAILURE);
+	}
+      screlay_index_print(&index, &(inst->match));
+      screlay_index_free(&index);
+      return EXIT_SUCCESS;
     }
-  else
+
+  if (inst->opt_scan)
+    {
+      /* Auto-scan for xpad. */
+      if (screlay_scan() < 0)
+	{
+	  fprintf(stderr, _("ERROR: No matching relay source\n"));
+	  exit(EXIT_FAILURE);
+	}
+    }
+  else if (! inst->srcpath[0])
     {
       /* Show usage. */
       argp_help(&argp, stdout, ARGP_HELP_USAGE, argv[0]);
       screlay_destroy();
       exit(EXIT_FAILURE);
     }
-  logmsg(1, _("Using relay source %s: [%04x:%04x] \"%s\"\n"), inst->srcpath, inst->idinfo.vendor, inst->idinfo.product, inst->src_model);
-  if (inst->srcfd >= 0)
+  /* Open the xpad (explicit or scanned) and uinput. */
+  inst->relay = relay_open(inst->srcpath, inst->uinput_path, inst->relay_flags);
+  if (inst->relay == NULL)
+    {
+      perror(inst->srcpath);
+      exit(EXIT_FAILURE);
+    }
+  relay_logmsg(1, _("Using relay source %s: [%04x:%04x] \"%s\"\n"), inst->srcpath, relay_caps(inst->relay)->id.vendor, relay_caps(inst->relay)->id.product, relay_caps(inst->relay)->name);
+  screlay_connect();
+  if ((inst->writer_policy >= 0) && (relay_start_writer(inst->relay, inst->writer_policy) < 0))
     {
-      screlay_connect();
-      screlay_mainloop();
+      perror(_("Starting writer thread"));
+      inst->writer_policy = -1;
     }
+  if (relay_log_start() < 0)
+    perror(_("Starting log thread"));
+  screlay_mainloop();
+  relay_stop_writer(inst->relay);
+  relay_log_stop();
 
-  screlay_disconnect();
+  if (inst->opt_stats)
+    {
+      screlay_print_stats();
+    }
   screlay_destroy();
 
   puts(_("Done."));
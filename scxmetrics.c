@@ -0,0 +1,223 @@
+/* gcc -o scxmetrics scxmetrics.c */
+/*
+   Steam Controller Xpad Minimalist Relayer
+   Copyright (C) 2017  PhaethonH <PhaethonH@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+/*
+Purpose: print the counters a running scxrelay publishes with --metrics.
+
+Usage:
+$ scxmetrics [-w SECONDS] FILE
+
+The file is mapped once and read with plain loads; the relay is not
+disturbed.  With -w, print again every SECONDS, with rates since the
+previous print, until interrupted.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scxmetrics.h"
+
+/* i18n preparations. */
+#define _(String) String
+
+/* Value at or below which 'fraction' of the histogram's frames fall. */
+static double
+scxmetrics_percentile (const struct scxmetrics_relay_s *m, double fraction)
+{
+  unsigned long long rank = fraction * m->latency_count, seen = 0;
+  int i;
+
+  for (i = 0; i < SCXHIST_BUCKETS; i++)
+    {
+      seen += m->latency[i];
+      if (seen > rank)
+	return (scxhist_bucket_top (i) < m->latency_max)
+	  ? scxhist_bucket_top (i) : m->latency_max;
+    }
+  return m->latency_max;
+}
+
+static void
+scxmetrics_print (const struct scxmetrics_s *cur,
+		  const struct scxmetrics_s *prev, double interval)
+{
+  const struct scxmetrics_relay_s *m;
+  unsigned long long frames = 0;
+  struct timespec now;
+  unsigned i;
+
+  for (i = 0; i < cur->nrelays; i++)
+    frames += cur->relay[i].frames;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  printf (_("pid %d, %s, updated %.1f s ago: %llu syscalls"),
+	  cur->pid, cur->backend ? "io_uring" : "epoll",
+	  (now.tv_sec * 1e9 + now.tv_nsec - cur->updated_ns) / 1e9,
+	  (unsigned long long) cur->syscalls);
+  if (frames)
+    printf (_(" (%.2f/frame)"), (double) cur->syscalls / frames);
+  printf (_(", %llu wakeups (%llu idle)\n"),
+	  (unsigned long long) cur->polls,
+	  (unsigned long long) cur->idle_wakeups);
+
+  for (i = 0; i < cur->nrelays; i++)
+    {
+      m = cur->relay + i;
+      printf (_("%s: %s\n"), m->event_path,
+	      m->relaying ? _("relaying") : _("waiting for replug"));
+      printf (_("  %llu events, %llu frames"),
+	      (unsigned long long) m->events, (unsigned long long) m->frames);
+      if (prev)
+	printf (_(" (%.0f frames/s)"),
+		(m->frames - prev->relay[i].frames) / interval);
+      printf (_("; %llu bytes read, %llu written\n"),
+	      (unsigned long long) m->bytes_read,
+	      (unsigned long long) m->bytes_written);
+      printf (_("  %llu reads (%llu partial), %llu writes (%llu failed, %llu EAGAIN)\n"),
+	      (unsigned long long) m->reads,
+	      (unsigned long long) m->partial_reads,
+	      (unsigned long long) m->writes,
+	      (unsigned long long) m->write_errors,
+	      (unsigned long long) m->write_eagain);
+      printf (_("  %llu reconnects, %llu SYN_DROPPED, %llu force-feedback requests\n"),
+	      (unsigned long long) m->reconnects,
+	      (unsigned long long) m->syn_dropped,
+	      (unsigned long long) m->ff_requests);
+      if (m->dropped || m->coalesced || m->absorbed)
+	printf (_("  %llu dropped, %llu coalesced, %llu absorbed by --rate\n"),
+		(unsigned long long) m->dropped,
+		(unsigned long long) m->coalesced,
+		(unsigned long long) m->absorbed);
+      if (m->ring_pushes)
+	printf (_("  writer ring: %llu now, %.2f mean, %llu max queued; %llu waits, %llu dropped, %llu events coalesced\n"),
+		(unsigned long long) m->ring_occupancy,
+		(double) m->ring_occupancy_sum / m->ring_pushes,
+		(unsigned long long) m->ring_occupancy_max,
+		(unsigned long long) m->ring_blocked,
+		(unsigned long long) m->ring_dropped,
+		(unsigned long long) m->ring_coalesced);
+      if (m->latency_count)
+	printf (_("  latency us p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n"),
+		scxmetrics_percentile (m, 0.50) / 1e3,
+		scxmetrics_percentile (m, 0.99) / 1e3,
+		scxmetrics_percentile (m, 0.999) / 1e3,
+		m->latency_max / 1e3);
+    }
+  fflush (stdout);
+}
+
+void
+usage (int argc, char **argv)
+{
+  fprintf (stdout, "Usage: %s [-w SECONDS] FILE\n\
+\n\
+Print the counters published by scxrelay --metrics=FILE.\n\
+  -w SECONDS   print again every SECONDS, with rates.\n\
+", argv[0]);
+}
+
+int
+main (int argc, char **argv)
+{
+  const struct scxmetrics_s *page;
+  struct scxmetrics_s cur, prev;
+  double interval = 0;
+  struct timespec ts;
+  struct stat st;
+  int opt, fd, first = 1;
+
+  while ((opt = getopt (argc, argv, "w:h")) != -1)
+    {
+      switch (opt)
+	{
+	case 'w':
+	  interval = atof (optarg);
+	  if (interval <= 0)
+	    {
+	      usage (argc, argv);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	default:
+	  usage (argc, argv);
+	  return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+  if (optind + 1 != argc)
+    {
+      usage (argc, argv);
+      return EXIT_FAILURE;
+    }
+
+  fd = open (argv[optind], O_RDONLY);
+  if (fd < 0)
+    {
+      perror (argv[optind]);
+      return EXIT_FAILURE;
+    }
+  if ((fstat (fd, &st) < 0) || (st.st_size < (off_t) sizeof (*page)))
+    {
+      fprintf (stderr, _("%s: not a metrics page\n"), argv[optind]);
+      return EXIT_FAILURE;
+    }
+  page = mmap (NULL, sizeof (*page), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (page == MAP_FAILED)
+    {
+      perror (argv[optind]);
+      return EXIT_FAILURE;
+    }
+  if (memcmp (page->magic, SCXMETRICS_MAGIC, sizeof (page->magic))
+      || (page->version != SCXMETRICS_VERSION)
+      || (page->relay_size != sizeof (page->relay[0]))
+      || (page->hist_buckets != SCXHIST_BUCKETS)
+      || (page->nrelays > SCXMETRICS_MAX_RELAYS))
+    {
+      fprintf (stderr, _("%s: not a version %d metrics page\n"),
+	       argv[optind], SCXMETRICS_VERSION);
+      return EXIT_FAILURE;
+    }
+
+  ts.tv_sec = interval;
+  ts.tv_nsec = (interval - ts.tv_sec) * 1e9;
+  for (;;)
+    {
+      if (scxmetrics_snapshot (page, &cur) < 0)
+	{
+	  fprintf (stderr, _("%s: relay stopped while updating\n"),
+		   argv[optind]);
+	  return EXIT_FAILURE;
+	}
+      scxmetrics_print (&cur, first ? NULL : &prev, interval);
+      if (interval <= 0)
+	break;
+      prev = cur;
+      first = 0;
+      nanosleep (&ts, NULL);
+      printf ("\n");
+    }
+
+  return EXIT_SUCCESS;
+}
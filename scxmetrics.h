@@ -0,0 +1,134 @@
+/*
+   Steam Controller Xpad Minimalist Relayer
+   Copyright (C) 2017  PhaethonH <PhaethonH@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+/*
+Metrics page (scxrelay --metrics=FILE): the relay's counters in a file that
+a front-end or monitoring agent maps and reads, with no RPC and no syscall
+against the relay.  One writer (the relay's event loop, after each wakeup)
+and any number of readers, kept consistent by a sequence lock: the writer
+makes 'seq' odd, updates, and makes it even again; a reader copies the page
+and retries while 'seq' was odd or changed (scxmetrics_snapshot()).
+
+Host byte order.  Readers check magic, version, relay_size and
+hist_buckets before trusting the rest; a new layout gets a new version.
+*/
+
+#ifndef SCXMETRICS_H
+#define SCXMETRICS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Latency histogram, log-bucketed (HDR-style): each power of two is split
+   into SCXHIST_SUB linear sub-buckets, for ~6% resolution at any scale. */
+#define SCXHIST_SUB_BITS 4
+#define SCXHIST_SUB (1 << SCXHIST_SUB_BITS)
+#define SCXHIST_MAX_BITS 40	/* values clamp at 2^40 ns (~18 minutes). */
+#define SCXHIST_BUCKETS ((SCXHIST_MAX_BITS - SCXHIST_SUB_BITS + 1) * SCXHIST_SUB)
+
+/* Largest value counted in bucket 'idx'. */
+static inline unsigned long long
+scxhist_bucket_top (int idx)
+{
+  int shift = idx / SCXHIST_SUB - 1;
+
+  if (shift < 0)
+    return idx;
+  return ((unsigned long long) (SCXHIST_SUB + idx % SCXHIST_SUB + 1) << shift) - 1;
+}
+
+#define SCXMETRICS_MAGIC "SCXMTR\n"
+#define SCXMETRICS_VERSION 2
+#define SCXMETRICS_MAX_RELAYS 8
+
+/* Counters of one relay, since startup. */
+struct scxmetrics_relay_s
+{
+  char event_path[256];		/* source device, as last opened. */
+  uint32_t relaying;		/* 1, or 0 while the source is unplugged. */
+  uint32_t reserved;
+  uint64_t events;		/* input_event relayed. */
+  uint64_t frames;		/* SYN_REPORT relayed. */
+  uint64_t bytes_read;		/* from the source. */
+  uint64_t bytes_written;	/* to uinput. */
+  uint64_t reads;		/* read(2) calls (io_uring: read SQEs). */
+  uint64_t writes;		/* write(2) calls (io_uring: write SQEs). */
+  uint64_t partial_reads;	/* reads that ended inside a frame. */
+  uint64_t write_errors;	/* failed writes, EAGAIN aside. */
+  uint64_t write_eagain;	/* frames lost to a full uinput. */
+  uint64_t reconnects;		/* source replugged and re-attached. */
+  uint64_t syn_dropped;		/* SYN_DROPPED: the kernel buffer overran. */
+  uint64_t ff_requests;		/* force-feedback requests handled. */
+  uint64_t dropped;		/* events dropped by --drop in userspace. */
+  uint64_t coalesced;		/* events saved by --coalesce. */
+  uint64_t absorbed;		/* frames folded into --rate ticks. */
+  /* --writer: the ring of frames between the loop and the writer thread. */
+  uint64_t ring_pushes;		/* frames queued. */
+  uint64_t ring_occupancy;	/* frames queued now. */
+  uint64_t ring_occupancy_max;	/* most frames queued at a push. */
+  uint64_t ring_occupancy_sum;	/* frames queued at each push, for the mean. */
+  uint64_t ring_blocked;	/* pushes that waited for room. */
+  uint64_t ring_dropped;	/* frames discarded (drop-oldest). */
+  uint64_t ring_coalesced;	/* events saved by the writer (coalesce). */
+  uint64_t latency_count;	/* frames in the histogram (with --latency). */
+  uint64_t latency_max;		/* ns. */
+  uint64_t latency[SCXHIST_BUCKETS];	/* frames per bucket. */
+};
+
+struct scxmetrics_s
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t relay_size;		/* sizeof (struct scxmetrics_relay_s). */
+  uint32_t nrelays;
+  uint32_t hist_sub_bits;	/* SCXHIST_SUB_BITS. */
+  uint32_t hist_buckets;	/* SCXHIST_BUCKETS. */
+  int32_t pid;			/* of the relay. */
+  uint32_t backend;		/* 0 epoll, 1 io_uring. */
+  uint32_t reserved;
+  uint64_t seq;			/* sequence lock; odd while updating. */
+  uint64_t updated_ns;		/* CLOCK_MONOTONIC of the last update. */
+  uint64_t syscalls;		/* made by the event loop, all relays. */
+  uint64_t polls;		/* epoll_wait(2)/io_uring_enter(2) calls. */
+  uint64_t idle_wakeups;	/* wakeups that relayed nothing. */
+  struct scxmetrics_relay_s relay[SCXMETRICS_MAX_RELAYS];
+};
+
+/* Copy a consistent view of the mapped 'page' into 'copy'.  Returns -1 if
+   the page stays mid-update (the relay died while writing it), else 0. */
+static inline int
+scxmetrics_snapshot (const struct scxmetrics_s *page,
+		     struct scxmetrics_s *copy)
+{
+  uint64_t seq;
+  long tries;
+
+  for (tries = 0; tries < 10000000; tries++)
+    {
+      seq = __atomic_load_n (&(page->seq), __ATOMIC_ACQUIRE);
+      if (seq & 1)
+	continue;		/* being updated, for well under a us. */
+      memcpy (copy, page, sizeof (*copy));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&(page->seq), __ATOMIC_RELAXED) == seq)
+	return 0;
+    }
+  return -1;
+}
+
+#endif /* SCXMETRICS_H */
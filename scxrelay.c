@@ -1,4 +1,4 @@
-/* gcc -o scxrelay scxrelay.c */
+/* gcc -pthread -o scxrelay scxrelay.c librelay.c */
 /*
    Steam Controller Xpad Minimalist Relayer
    Copyright (C) 2017  PhaethonH <PhaethonH@gmail.com>
@@ -30,7 +30,8 @@ VendorID, resulted in an xpad device usable in ETS2.
 
 
 Usage (command-line shell):
-$ scxrelay /dev/input/eventNN [/dev/uinput]
+$ scxrelay [OPTIONS] /dev/input/eventNN [/dev/uinput]
+$ scxrelay [OPTIONS] -m /dev/input/eventNN [/dev/input/eventMM ...]
 
 First argument is the Steam Controller's xpad device from which to copy.
 
@@ -38,18 +39,29 @@ Second argument is optional, an explicit path to the uinput device through
 which the program creates a new virtual event device and repeats the xpad
 events.  If not specified, defaults to "/dev/uinput".
 
-Use Control-C to terminate.
+With -m, every argument is a source device with its own virtual device,
+all relayed by one process; with --merge they feed one virtual device.
+Use -U to name the uinput device in these forms.
+
+Use Control-C to terminate.  "scxrelay --help" lists the options: event
+loop backends, transforms, output rate, recording and replay, metrics,
+and benchmarks.
+
+Each read drains the source, and each complete frame (events up to and
+including SYN_REPORT) goes out with a single write.  The relay sleeps
+until an fd is ready, re-attaches to a replugged source, repairs the
+stream after SYN_DROPPED, and relays force feedback back to the source.
 
 
 Usage (no-shell, programmatic POSIX interface):
 Open fd 3 for read-write on the Steam Controller xpad device.
 Open fd 4 for read-write on the uinput device.
 fd 0,1,2 are not significant, and may be closed.
-Terminate with SIGINT.
+Terminate with SIGINT, SIGTERM or SIGHUP.
 
 
 Halt conditions:
-Receive SIGINT.
+Receive SIGINT, SIGTERM or SIGHUP.
 Failure to read from xpad device (e.g. on Steam Controller disconnect).
 Faiulre to write to uinput device.
 
@@ -59,18 +71,41 @@ I expect an external program ("front-end") to enhance user experience.
 The assumed environment is SteamOS.
  */
 
+#define _GNU_SOURCE		/* sched_setaffinity(2), CPU_SET(3). */
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
 #include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <linux/input.h>
+#include <linux/io_uring.h>
 #include <linux/uinput.h>
-#include <poll.h>
+
+#include "librelay.h"
+#include "scxmetrics.h"	/* also the latency histogram's buckets. */
 
 #define PACKAGE "scxrelay"
 #define VERSION "0.01"
@@ -87,410 +122,4869 @@ const int SCXRELAY_PRODUCTID = 0x11fc;	/* Steam Controller xpad. */
 #ifndef PATH_MAX
 #define PATH_MAX 4096		/* SteamOS */
 #endif
+#define SCXRELAY_EVBUF_COUNT 256	/* input_event slots in the read buffer. */
+/* input_event slots in a sink's io_uring write buffer: a read's worth,
+   and a resync frame. */
+#define SCXRELAY_WRBUF_COUNT (SCXRELAY_EVBUF_COUNT + RELAY_STATE_MAXEV)
+#define SCXRELAY_MAX_RELAYS 8	/* source devices handled by one process. */
+#define SCXRELAY_MAX_SINKS 4	/* virtual devices per source (--identity). */
+/* Most operations other than writes in flight on the io_uring: a read per
+   source, a poll per virtual device (rumble), and the signalfd, inotify
+   and timerfd polls. */
+#define SCXRELAY_URING_ASIDE \
+  (SCXRELAY_MAX_RELAYS * (1 + SCXRELAY_MAX_SINKS) + 3)
+/* Longest frame relayed at once: a resync, or frames coalesced from evbuf. */
+#define SCXRELAY_FRAME_MAX (2 * SCXRELAY_EVBUF_COUNT + RELAY_STATE_MAXEV)
+/* --merge: frames of one wakeup, queued to go out in timestamp order. */
+#define SCXRELAY_MERGE_EVENTS (SCXRELAY_MAX_RELAYS * SCXRELAY_EVBUF_COUNT \
+			       + SCXRELAY_FRAME_MAX)
+#define SCXRELAY_MERGE_FRAMES 512
+#define SCXRELAY_URING_ENTRIES 256	/* io_uring submission queue size. */
+#define SCXSINK_RING 4096	/* events a ring sink keeps. */
+#define SCXRELAY_READY_TIMEOUT 2000	/* ms to wait for udev before readiness. */
 
 /* Recovery from failure states. */
 enum scxstate_e {
     SCXSTATE_INIT,    /* starting up; nothing in progress yet. */
     SCXSTATE_STEADY,  /* the steady state. */
     SCXSTATE_FAILED,  /* read failed; attempt recovery (re-open). */
-
-    SCXSTATE_HALT,    /* terminate process. */
 };
 
+/* Event loop implementations. */
+enum scxbackend_e {
+    SCXBACKEND_EPOLL, /* readiness via epoll_wait, then read/write. */
+    SCXBACKEND_URING, /* reads kept posted in io_uring, writes as SQEs. */
+    SCXBACKEND_AUTO,  /* io_uring if available, else epoll. */
+};
 
-/** Logging **/
-int logthreshold = 0;
 
-int
-vlogmsg (int loglevel, const char *fmt, va_list vp)
+/* Naïve handling of failed system calls: exit immediately with failure. */
+static void
+die_on_negative (int wrapped_call)
 {
-  int retval = 0;
-  if (loglevel > logthreshold)
+  if (wrapped_call < 0)
     {
-      retval = vfprintf (stderr, fmt, vp);
-      fflush (stderr);
+      perror (_("ERROR"));
+      exit (EXIT_FAILURE);
     }
-  return retval;
 }
 
-int
-logmsg (int loglevel, const char *fmt, ...)
+
+/* Recording file (--record, --replay): this header, then raw struct
+   input_event records in read order, up to end of file.  Host byte order;
+   readers check event_size and skip header_size bytes to the first event. */
+#define SCXREC_MAGIC "SCXREC\n"
+#define SCXREC_VERSION 1
+struct scxrec_header_s
 {
-  va_list vp;
-  int retval = 0;
-  va_start (vp, fmt);
-  retval = vlogmsg (loglevel, fmt, vp);
-  va_end (vp);
-  return retval;
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;		/* offset of the first event record. */
+  uint32_t event_size;		/* sizeof (struct input_event) when recorded. */
+  uint32_t reserved;
+  struct input_id id;		/* identity of the source device. */
+  char name[UINPUT_MAX_NAME_SIZE];	/* name of the source device. */
+  unsigned char have_ev[8];	/* EV_* bits. */
+  unsigned char have_abs[8];	/* ABS_* bits. */
+  unsigned char have_key[96];	/* KEY_* bits. */
+  struct input_absinfo absinfo[64];	/* per ABS_* code. */
+};
+
+
+/** Latency histogram **/
+
+struct scxhist_s
+{
+  unsigned long long count;
+  unsigned long long max;	/* exact, in ns. */
+  unsigned long long buckets[SCXHIST_BUCKETS];
+};
+
+static int
+scxhist_bucket (unsigned long long ns)
+{
+  int msb, shift;
+
+  if (ns >= (1ULL << SCXHIST_MAX_BITS))
+    ns = (1ULL << SCXHIST_MAX_BITS) - 1;
+  if (ns < SCXHIST_SUB)
+    return ns;
+  msb = 63 - __builtin_clzll (ns);
+  shift = msb - SCXHIST_SUB_BITS;
+  return (shift + 1) * SCXHIST_SUB + (int) ((ns >> shift) - SCXHIST_SUB);
 }
 
-/* Naïve handling of failed system calls: exit immediately with failure. */
 static void
-die_on_negative (int wrapped_call)
+scxhist_record (struct scxhist_s *h, long long ns)
 {
-  if (wrapped_call < 0)
+  if (ns < 0)
+    ns = 0;			/* clocks disagree (e.g. recorded stream). */
+  h->buckets[scxhist_bucket (ns)]++;
+  h->count++;
+  if ((unsigned long long) ns > h->max)
+    h->max = ns;
+}
+
+/* Value at or below which 'fraction' of the samples fall. */
+static unsigned long long
+scxhist_percentile (const struct scxhist_s *h, double fraction)
+{
+  unsigned long long rank = fraction * h->count, seen = 0;
+  int i;
+
+  for (i = 0; i < SCXHIST_BUCKETS; i++)
     {
-      perror (_("ERROR"));
-      exit (EXIT_FAILURE);
+      seen += h->buckets[i];
+      if (seen > rank)
+	return (scxhist_bucket_top (i) < h->max) ? scxhist_bucket_top (i) : h->max;
+    }
+  return h->max;
+}
+
+static void
+scxhist_print (const struct scxhist_s *h, const char *label)
+{
+  if (!h->count)
+    {
+      relay_logmsg (1, _("%s: no frames\n"), label);
+      return;
     }
+  relay_logmsg (1, _("%s: %llu frames, latency us p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n"),
+		label, h->count,
+		scxhist_percentile (h, 0.50) / 1e3, scxhist_percentile (h, 0.99) / 1e3,
+		scxhist_percentile (h, 0.999) / 1e3, h->max / 1e3);
+}
+
+static void scxclock_now (clockid_t clk, struct timespec *ts);
+
+/* Nanoseconds from an event's timestamp until now (both CLOCK_MONOTONIC). */
+static long long
+scxhist_since (const struct input_event *ev)
+{
+  struct timespec now;
+
+  scxclock_now (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - (long long) ev->time.tv_sec) * 1000000000LL
+    + now.tv_nsec - ev->time.tv_usec * 1000LL;
 }
 
 
 /** Run-time state **/
+/* What a virtual device claims to be (--identity). */
+struct scxrelay_identity_s
+{
+  struct input_id id;		/* bus, vendor, product, version. */
+  char name[UINPUT_MAX_NAME_SIZE];
+  int own_rules;		/* transform= given: 'rules' instead of --transform. */
+  struct scxxform_rules_s *rules;	/* its transform, or NULL for none. */
+};
+
+struct scxrelay_s;
+struct scxrelay_sink_s;
+
+/* Source backend: how a relay's input is opened and read (evdev, pipe,
+   memory).  The event loop waits on srcfd, so a memory source, having
+   none, is driven by its owner calling scxrelay_copy_frames(). */
+struct scxsource_ops_s
+{
+  const char *name;
+  /* Open the source if need be and set its capabilities.
+     Returns 0 on success, -1 on failure (then see errno). */
+  int (*open) (struct scxrelay_s *inst);
+  /* read(2)-style. */
+  ssize_t (*read) (struct scxrelay_s *inst, void *buf, size_t len);
+};
+
+/* Sink backend (--sink): how a virtual device is created and written
+   (uinput, file, ring, null).  Sinks without an fd are written in place,
+   with no syscall, whatever the event loop backend. */
+struct scxsink_ops_s
+{
+  const char *name;
+  int device;			/* an input device: has a node, takes force feedback. */
+  /* Open 'path' if need be and create the device from sink->caps.
+     Returns 0 on success, -1 on failure (then see errno). */
+  int (*create) (struct scxrelay_sink_s *sink, const char *path);
+  /* write(2)-style. */
+  int (*write) (struct scxrelay_sink_s *sink, const struct input_event *frame,
+		int nev);
+  /* Returns 0 on success, -1 on failure (then see errno). */
+  int (*destroy) (struct scxrelay_sink_s *sink);
+};
+
+/* One virtual device a source is mirrored onto; one per --identity. */
+struct scxrelay_sink_s
+{
+  struct scxrelay_s *relay;	/* the source it belongs to. */
+  const struct scxrelay_identity_s *identity;
+  const struct scxsink_ops_s *ops;
+  int uinputfd;			/* fd of uinput (or file); -1 for none. */
+  struct input_event *ring;	/* ring sink: the last SCXSINK_RING events. */
+  unsigned long long sunk;	/* events taken by a ring or null sink. */
+  struct relay_caps_s caps;	/* as advertised: after its transform. */
+  struct scxxform_s *xform;	/* transform tables, or NULL. */
+  /* io_uring: frames of the last read, while their writes are in flight;
+     room for a resync frame too. */
+  struct input_event wrbuf[SCXRELAY_WRBUF_COUNT];
+  int wrcount;			/* events held in wrbuf. */
+  /* io_uring: SYN_REPORT of each in-flight write, in completion order;
+     a write holds at least one event, so never more than wrbuf. */
+  struct input_event *wrsyn[SCXRELAY_WRBUF_COUNT];
+  int wrsyn_head, wrsyn_count;
+  relay_writer_t *writer;	/* --writer thread, while the loop runs. */
+  struct relay_writer_stats_s writer_stats;	/* as it left them. */
+  /* --latency with --writer: frames its thread wrote (the last device's);
+     only that thread updates it, with writer_seq odd meanwhile. */
+  struct scxhist_s writer_latency;
+  unsigned writer_seq;
+  /* Force feedback from this device back to the source. */
+  int has_ff;
+  struct relay_ff_s ff;
+};
+
+/* One relay: a source event device mirrored onto its virtual devices. */
 struct scxrelay_s
 {
-  enum scxstate_e state;	/* Controls main loop behavior; HALT to stop. */
+  enum scxstate_e state;	/* Recovery state of this relay. */
+  const struct scxsource_ops_s *source;
   int srcfd;			/* fd of Steam Controller virtual xpad device; -1 for none. */
-  int uinputfd;			/* fd of uinput; -1 for none. */
+  const char *mem;		/* memory source: input not read yet, */
+  size_t mem_len;		/* and its length in bytes. */
   /* bit vectors */
-#define NBV_EV (1 + EV_CNT/8)
-#define NBV_ABS (1 + ABS_CNT/8)
-#define NBV_KEY (1 + KEY_CNT/8)
-  char have_ev[NBV_EV];		/* bit vector of event types supported by srcfd.  */
-  char have_abs[NBV_ABS];	/* bit vector of axes supported by srcfd. */
-  char have_key[NBV_KEY];	/* bit vector of keys/buttons, srcfd. */
-  struct uinput_user_dev uidev;	/* New virtual device info, for uinput. */
+#define NBV_EV RELAY_NBV_EV
+#define NBV_ABS RELAY_NBV_ABS
+#define NBV_KEY RELAY_NBV_KEY
+  struct relay_caps_s caps;	/* identity, features and axis ranges of srcfd. */
   char event_path[PATH_MAX];	/* Path name used to open srcfd. */
-  char uinput_path[PATH_MAX];	/* Path name used to open uinputfd. */
-  int filter_sysbutton;
+  char uinput_path[PATH_MAX];	/* Path name used to open each uinputfd. */
+  int drop_user;		/* --drop filtered here: no EVIOCSMASK on srcfd. */
+  struct scxxform_s *map;	/* --map of this source, compiled, or NULL. */
+  struct scxrelay_s *out;	/* whose virtual devices its frames go to: its
+				   own, or with --merge the first source's. */
+  int feeds_ff;			/* srcfd plays the force feedback of out's
+				   virtual devices. */
+  struct scxresample_s *resample;	/* --rate state snapshot, or NULL. */
+  int notify_wd;		/* inotify watch on the device directory, or -1. */
+  long long replug_ns;		/* CLOCK_REALTIME of the re-attached node, until
+				   its first frame is relayed; else 0. */
+
+  FILE *record;			/* --record: source events appended here. */
+  /* --replay: mapped recording; srcfd is a pipe fed by a child process. */
+  const char *replay;
+  size_t replay_len;
+  pid_t replay_pid;
+
+  /* Frame batching: events read but not yet terminated by SYN_REPORT. */
+  struct input_event evbuf[SCXRELAY_EVBUF_COUNT];
+  size_t evbytes;		/* bytes held in evbuf. */
+  struct relay_split_s split;	/* cuts evbuf into frames (librelay). */
+
+  struct scxhist_s latency;	/* kernel timestamp to the return of the last
+				   sink's write; with --writer, filled by
+				   that sink's thread. */
+
+  /* Virtual devices, in --identity order. */
+  int nsinks;
+  struct scxrelay_sink_s sinks[SCXRELAY_MAX_SINKS];
+
+  /* Keys and axes of srcfd as relayed (before --drop and --transform),
+     to resync after SYN_DROPPED and release all when srcfd is lost. */
+  struct relay_state_s relayed;
+
+  /* Counters, for measuring syscalls per frame. */
+  struct scxrelay_stats_s {
+    unsigned long long reads;	/* read(2) calls on srcfd. */
+    unsigned long long writes;	/* write(2) calls on every uinputfd. */
+    unsigned long long events;	/* input_event written, all sinks. */
+    unsigned long long frames;	/* SYN_REPORT relayed. */
+    unsigned long long dropped;	/* input_event dropped by --drop, in userspace. */
+    unsigned long long coalesced;	/* input_event saved by --coalesce. */
+    unsigned long long absorbed;	/* frames folded into --rate snapshots. */
+    unsigned long long bytes;	/* read from srcfd. */
+    unsigned long long partial;	/* reads that ended inside a frame. */
+    unsigned long long write_errors;	/* failed writes to a uinputfd. */
+    unsigned long long write_eagain;	/* frames lost to a full uinput. */
+    unsigned long long write_waits;	/* io_uring: waits for a sink's
+					   writes, its wrbuf being full. */
+    unsigned long long reconnects;	/* source re-attached after a replug. */
+    unsigned long long syn_dropped;	/* SYN_DROPPED read from srcfd. */
+  } stats;
 };
 
 typedef struct scxrelay_s scxrelay_t;
 
-scxrelay_t _inst = { 0, },		/* Global single instantiation of run-time state. */
- *inst = &_inst;		/* and pointer to instance. */
-
+/* Minimal io_uring plumbing over the raw syscalls (no liburing needed). */
+struct scxrelay_uring_s
+{
+  int fd;			/* -1 when not in use. */
+  int sqpoll;			/* kernel thread polls the submission queue. */
+  void *sq_ring, *cq_ring;	/* mmap'd rings (may be the same mapping). */
+  size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned sq_entries;
+  unsigned sq_pending;		/* SQEs filled but not yet submitted. */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned writes_inflight;	/* write SQEs without a completion yet. */
+  struct io_uring_sqe *link;	/* last write, linked to whatever follows. */
+  /* Completions reaped while waiting for a full wrbuf to drain, other than
+     writes: for the loop to handle next. */
+  struct io_uring_cqe aside[SCXRELAY_URING_ASIDE];
+  unsigned naside, aside_next;
+};
 
-/** Events Relay **/
+/* --merge: a frame waiting for the end of the wakeup, in loop->mergebuf. */
+struct scxrelay_merged_s
+{
+  scxrelay_t *inst;		/* source it came from. */
+  int start, nev;
+};
 
-void
-scxrelay_init ()
+/* Process-wide state: options, and the relays sharing one event loop. */
+struct scxrelay_loop_s
 {
-  memset (inst, 0, sizeof (*inst));
-  inst->srcfd = -1;
-  inst->uinputfd = -1;
-  snprintf (inst->uinput_path, sizeof (inst->uinput_path), "/dev/uinput");
-}
+  int halt;			/* set to terminate process. */
+  enum scxbackend_e backend;	/* event loop implementation in use. */
+  int epfd;			/* epoll instance watching every srcfd. */
+  struct scxrelay_uring_s uring;	/* io_uring backend. */
+  /* backend write path for one frame; returns write(2)-style result. */
+  int (*write_frame) (struct scxrelay_sink_s *sink, struct input_event *frame,
+		      int nev);
+  int per_event;		/* relay one event per syscall (no batching). */
+  int sqpoll;			/* request SQPOLL from the io_uring backend. */
+  int show_stats;		/* print counters on exit. */
+  struct timespec launch;	/* main() entry, for the startup time. */
+  int ready_fd;			/* --notify-fd: device nodes go here, or -1. */
+  int latency;			/* track relay latency per frame. */
+  int replay_fast;		/* replay without original timing. */
+  int coalesce;			/* merge frames waiting together in evbuf. */
+  int writer;			/* --writer: a thread per relay writes. */
+  enum relay_backpressure_e backpressure;	/* its full-ring policy. */
+  struct scxxform_rules_s *xform_rules;	/* --transform FILE, or NULL. */
+  const struct scxsink_ops_s *sink_ops;	/* --sink: kind of virtual device. */
+  /* --identity: the virtual devices of every source; one by default. */
+  int nidentities;
+  struct scxrelay_identity_s identities[SCXRELAY_MAX_SINKS];
+  /* --map: per source argument, rules applied before anything else. */
+  struct scxxform_rules_s *map_rules[SCXRELAY_MAX_RELAYS];
+  int merge;			/* --merge: every source feeds relays[0]'s
+				   virtual devices. */
+  struct scxrelay_merged_s merged[SCXRELAY_MERGE_FRAMES];
+  int nmerged;
+  struct input_event mergebuf[SCXRELAY_MERGE_EVENTS];
+  int mergecount;		/* events held in mergebuf. */
+  int rate;			/* --rate: output frames per second, or 0. */
+  int timerfd;			/* --rate tick, armed while output is pending. */
+  int timer_armed;
+  struct timespec tick_origin;	/* ticks fall on origin + k * period. */
+  /* Virtual clock: when set, the relay's time is vclock_ns (on the scale of
+     CLOCK_MONOTONIC) and --rate ticks fire from scxclock_advance(), not
+     from the kernel; for runs that come out the same every time. */
+  int vclock;
+  long long vclock_ns;
+  long long tick_next_ns;	/* next virtual tick, while armed. */
+  int rt_prio;			/* --rt: SCHED_FIFO priority, or 0. */
+  int cpu;			/* --cpu: core to pin to, or -1. */
+  cpu_set_t writer_cpus;	/* with --cpu, where --writer threads run: the
+				   cores allowed before, but that one. */
+  int mlock;			/* --mlock: lock and prefault memory. */
+  /* /proc/thread-self/schedstat over the loop: time spent runnable but
+     not running (wakeup-to-run delay), and number of times run. */
+  unsigned long long sched_delay, sched_runs;
+  const char *record_path;	/* --record FILE. */
+  const char *devdir;		/* --devdir: where replugged sources appear. */
+  /* --drop: events never relayed; bit set = dropped. */
+  int ndrop;
+  unsigned char drop_type[NBV_EV];
+  unsigned char drop_code[EV_CNT][NBV_KEY];
+  int sigfd;			/* signalfd: SIGINT, SIGTERM, SIGHUP, SIGUSR1. */
+  int notifyfd;			/* inotify on directories of failed sources. */
+  unsigned long long polls;	/* epoll_wait(2)/io_uring_enter(2) calls. */
+  unsigned long long idle_wakeups;	/* blocking waits that relayed nothing,
+					   but the one ending the loop. */
+  const char *metrics_path;	/* --metrics FILE, or NULL. */
+  struct scxmetrics_s *metrics;	/* its mapping, once published. */
+  int nrelays;
+  scxrelay_t relays[SCXRELAY_MAX_RELAYS];
+};
+
+struct scxrelay_loop_s _loop = { 0, },	/* Global single event loop, */
+ *loop = &_loop;		/* and pointer to it. */
 
-/* Tell uinput of supported input features (copied from source event device) */
+/* What time it is on 'clk': the virtual clock's, when in use. */
 static void
-scxrelay_register_features_by_code ()
+scxclock_now (clockid_t clk, struct timespec *ts)
 {
-  int res;
-  int nbyte, nbit, idx;
-
-  /* Convoluted syntax to allow simple curly braces after FOREACH_SET_BIT()
-     Abuses shortcut evaluation and side effect of assignment-as-expression.
-   */
-#define FOREACH_SET_BIT(idxvar, bv, bytecount) \
-  for (nbyte = 0, idxvar = 0; nbyte < bytecount; nbyte++) \
-  for (nbit = 0; nbit < 8; nbit++, idxvar++) \
-  if ((bv)[nbyte] & (1 << nbit))
-
-  /* Query source device for supported events (bitvector). */
-  res = ioctl (inst->srcfd, EVIOCGBIT (0, NBV_EV), inst->have_ev);
-  if (res > 0)
+  if (!loop->vclock)
     {
-      /* Traverse bit vector and replicate features. */
-      FOREACH_SET_BIT (idx, inst->have_ev, res)
-      {
-	die_on_negative (ioctl (inst->uinputfd, UI_SET_EVBIT, idx));
-      }
+      clock_gettime (clk, ts);
+      return;
     }
+  ts->tv_sec = loop->vclock_ns / 1000000000LL;
+  ts->tv_nsec = loop->vclock_ns % 1000000000LL;
+}
 
-  /* Query (bitvector) - axes */
-  res = ioctl (inst->srcfd, EVIOCGBIT (EV_ABS, NBV_ABS), inst->have_abs);
-  if (res > 0)
-    {
-      /* Traverse and replicate. */
-      FOREACH_SET_BIT (idx, inst->have_abs, res)
-      {
-	die_on_negative (ioctl (inst->uinputfd, UI_SET_ABSBIT, idx));
-      }
-    }
 
-  /* Query (bitvector) - buttons */
-  res = ioctl (inst->srcfd, EVIOCGBIT (EV_KEY, NBV_KEY), inst->have_key);
-  if (res > 0)
+/** Input transform (--transform) **/
+
+/* Rules as read from the configuration file; compiled per source, since
+   axis tables depend on its absinfo. */
+struct scxxform_rules_s
+{
+  short axis_dst[ABS_CNT];	/* remap; -1 drops the axis. */
+  short key_dst[KEY_CNT];	/* remap; -1 drops the key/button. */
+  char shaped[ABS_CNT];		/* any of the below set for the axis. */
+  char invert[ABS_CNT];
+  double deadzone[ABS_CNT];	/* fraction of half the range, around center. */
+  double expo[ABS_CNT];		/* 0 linear .. 1 cubic response. */
+  double scale[ABS_CNT];
+};
+
+/* Per-axis lookup: value = lut[(clamp (value) - min) >> shift]. */
+struct scxxform_axis_s
+{
+  short dst;
+  unsigned char shift;		/* keeps tables at most 64K entries. */
+  int min, max;
+  int *lut;			/* NULL: value passes unchanged. */
+};
+
+/* Compiled transform: a table index per event. */
+struct scxxform_s
+{
+  short key_dst[KEY_CNT];
+  struct scxxform_axis_s axis[ABS_CNT];
+};
+
+/* Code from a name like ABS_X or BTN_SOUTH (common gamepad codes only),
+   or a number.  Returns -1 if neither. */
+static int
+scxxform_code (const char *name, int ncodes)
+{
+  static const struct { const char *name; int code; } names[] = {
+    { "ABS_X", ABS_X }, { "ABS_Y", ABS_Y }, { "ABS_Z", ABS_Z },
+    { "ABS_RX", ABS_RX }, { "ABS_RY", ABS_RY }, { "ABS_RZ", ABS_RZ },
+    { "ABS_HAT0X", ABS_HAT0X }, { "ABS_HAT0Y", ABS_HAT0Y },
+    { "ABS_GAS", ABS_GAS }, { "ABS_BRAKE", ABS_BRAKE },
+    { "BTN_SOUTH", BTN_SOUTH }, { "BTN_EAST", BTN_EAST },
+    { "BTN_NORTH", BTN_NORTH }, { "BTN_WEST", BTN_WEST },
+    { "BTN_TL", BTN_TL }, { "BTN_TR", BTN_TR },
+    { "BTN_TL2", BTN_TL2 }, { "BTN_TR2", BTN_TR2 },
+    { "BTN_SELECT", BTN_SELECT }, { "BTN_START", BTN_START },
+    { "BTN_MODE", BTN_MODE },
+    { "BTN_THUMBL", BTN_THUMBL }, { "BTN_THUMBR", BTN_THUMBR },
+    { "BTN_DPAD_UP", BTN_DPAD_UP }, { "BTN_DPAD_DOWN", BTN_DPAD_DOWN },
+    { "BTN_DPAD_LEFT", BTN_DPAD_LEFT }, { "BTN_DPAD_RIGHT", BTN_DPAD_RIGHT },
+  };
+  char *end;
+  long code;
+  unsigned i;
+
+  for (i = 0; i < sizeof (names) / sizeof (names[0]); i++)
     {
-      /* Traverse and replicate. */
-      FOREACH_SET_BIT (idx, inst->have_key, res)
-      {
-	die_on_negative (ioctl (inst->uinputfd, UI_SET_KEYBIT, idx));
-      }
+      if (!strcasecmp (name, names[i].name))
+	return (names[i].code < ncodes) ? names[i].code : -1;
     }
+  code = strtol (name, &end, 0);
+  if (*end || (code < 0) || (code >= ncodes))
+    return -1;
+  return code;
 }
 
-/* Mimick "plugging in" the virtual device.
-   Returns 0 on success, -1 on failure (then see errno). */
-int
-scxrelay_connect ()
+/* Read a transform configuration: one rule per line, '#' comments.
+     axis SRC DST|none      button SRC DST|none
+     deadzone AXIS FRACTION (of half the range, e.g. 0.1)
+     expo AXIS K            (0 linear .. 1 cubic)
+     invert AXIS            scale AXIS FACTOR
+   Returns the rules, or NULL after reporting the offending line (or the
+   error). */
+struct scxxform_rules_s *
+scxxform_load (const char *path)
 {
-  int res;
-  struct input_absinfo absinfo;
-  int nbyte, nbit, idx;
+  struct scxxform_rules_s *rules;
+  char line[256], verb[32], a[64], b[64];
+  FILE *fp;
+  int axis_line[ABS_CNT] = { 0, };	/* rule that moved each axis. */
+  int lineno = 0, n, src, dst, i;
+  double num;
 
-  /* Open the source event device. */
-  if (inst->srcfd < 0)
+  fp = fopen (path, "r");
+  if (!fp)
     {
-      inst->srcfd = open (inst->event_path, O_RDWR);
+      perror (_(path));
+      return NULL;
     }
-  if (inst->srcfd < 0)
+  rules = calloc (1, sizeof (*rules));
+  if (!rules)
     {
-      /* Open read-write failed.  Try read-only (no haptic feedback). */
-      inst->srcfd = open (inst->event_path, O_RDONLY);
+      perror (_(path));
+      fclose (fp);
+      return NULL;
     }
-  if (inst->srcfd < 0)
+  for (i = 0; i < ABS_CNT; i++)
     {
-      /* Cannot open at all. */
-      perror (_(inst->event_path));
-      return -1;
+      rules->axis_dst[i] = i;
+      rules->scale[i] = 1.0;
     }
+  for (i = 0; i < KEY_CNT; i++)
+    rules->key_dst[i] = i;
 
-  /* Open the uinput device. */
-  if (inst->uinputfd < 0)
+  while (fgets (line, sizeof (line), fp))
     {
-      inst->uinputfd = open (inst->uinput_path, O_RDWR);
+      lineno++;
+      if (strchr (line, '#'))
+	*strchr (line, '#') = 0;
+      n = sscanf (line, "%31s %63s %63s", verb, a, b);
+      if (n <= 0)
+	continue;
+      src = (n >= 2) ? scxxform_code (a, !strcmp (verb, "button")
+				      ? KEY_CNT : ABS_CNT) : -1;
+      if (src < 0)
+	goto bad;
+      if (!strcmp (verb, "axis") || !strcmp (verb, "button"))
+	{
+	  if (n != 3)
+	    goto bad;
+	  dst = !strcmp (b, "none") ? -1 : scxxform_code (b, (verb[0] == 'a')
+							 ? ABS_CNT : KEY_CNT);
+	  if ((dst < 0) && strcmp (b, "none"))
+	    goto bad;
+	  if (verb[0] == 'a')
+	    {
+	      rules->axis_dst[src] = dst;
+	      axis_line[src] = lineno;
+	    }
+	  else
+	    rules->key_dst[src] = dst;
+	  continue;
+	}
+      if (!strcmp (verb, "invert") && (n == 2))
+	{
+	  rules->invert[src] = rules->shaped[src] = 1;
+	  continue;
+	}
+      if ((n != 3) || (sscanf (b, "%lf", &num) != 1))
+	goto bad;
+      if (!strcmp (verb, "deadzone") && (num >= 0) && (num < 1))
+	rules->deadzone[src] = num;
+      else if (!strcmp (verb, "expo") && (num >= 0) && (num <= 1))
+	rules->expo[src] = num;
+      else if (!strcmp (verb, "scale"))
+	rules->scale[src] = num;
+      else
+	goto bad;
+      rules->shaped[src] = 1;
     }
-  if (inst->uinputfd < 0)
+  fclose (fp);
+
+  /* An axis takes one source axis; a second would overwrite its range. */
+  for (src = 0; src < ABS_CNT; src++)
     {
-      perror (_(inst->uinput_path));
-      return -1;
+      for (i = src + 1; i < ABS_CNT; i++)
+	{
+	  if ((rules->axis_dst[src] < 0)
+	      || (rules->axis_dst[i] != rules->axis_dst[src]))
+	    continue;
+	  relay_logmsg (1, _("%s:%d: axes %d and %d both map to axis %d\n"),
+			path, (axis_line[i] > axis_line[src])
+			? axis_line[i] : axis_line[src],
+			src, i, rules->axis_dst[src]);
+	  free (rules);
+	  return NULL;
+	}
     }
+  return rules;
 
-  /* Register input device features. */
-  scxrelay_register_features_by_code ();
-
-  /* Prepare the UINPUT device descriptor. */
-  memset (&(inst->uidev), 0, sizeof (inst->uidev));
-  snprintf (inst->uidev.name, UINPUT_MAX_NAME_SIZE, "%s", SCXRELAY_MODELNAME);
-  inst->uidev.id.bustype = BUS_VIRTUAL;
-  inst->uidev.id.vendor = SCXRELAY_VENDORID;
-  inst->uidev.id.product = SCXRELAY_PRODUCTID;
-  inst->uidev.id.version = SCXRELAY_MODELREV;
-  /* Copy absinfo from source (also goes into uidev). */
-  FOREACH_SET_BIT (idx, inst->have_abs, NBV_EV)
-  {
-    if (inst->have_abs[nbyte] & (1 << nbit))
-      {
-	idx = (nbyte * 8) + nbit;
-	die_on_negative (ioctl (inst->srcfd, EVIOCGABS (idx), &absinfo));
-	inst->uidev.absmin[idx] = absinfo.minimum;
-	inst->uidev.absmax[idx] = absinfo.maximum;
-	inst->uidev.absfuzz[idx] = absinfo.fuzz;
-	inst->uidev.absflat[idx] = absinfo.flat;
-      }
-  }
-
-  /* Write the device descriptor to the fd. */
-  die_on_negative (write
-		   (inst->uinputfd, &(inst->uidev), sizeof (inst->uidev)));
-
-  /* Create ("connect") the relay device. */
-  die_on_negative (ioctl (inst->uinputfd, UI_DEV_CREATE));
-
-  /* Relay device now created. */
-
-  return 0;
+bad:
+  relay_logmsg (1, _("%s:%d: bad transform rule\n"), path, lineno);
+  fclose (fp);
+  free (rules);
+  return NULL;
 }
 
-/* Mimick disconnecting ("unplugging") the relay device.
-   Returns 0 on success, -1 on error (then see errno).  */
-int
-scxrelay_disconnect ()
+/* Response of an axis, on values normalized to -1..1 around the center. */
+static double
+scxxform_shape (const struct scxxform_rules_s *rules, int code, double x)
 {
-  int ret;
-  ret = ioctl (inst->uinputfd, UI_DEV_DESTROY);
-  return ret;
-}
+  double mag;
 
-/* Signal handler for SIGINT (Control-C), primary means of ending program. */
-static void
-on_sigint (int signum)
-{
-  inst->state = SCXSTATE_HALT;
+  if (rules->invert[code])
+    x = -x;
+  mag = (x < 0) ? -x : x;
+  if (mag <= rules->deadzone[code])
+    return 0;
+  mag = (mag - rules->deadzone[code]) / (1 - rules->deadzone[code]);
+  mag = (1 - rules->expo[code]) * mag + rules->expo[code] * mag * mag * mag;
+  mag *= rules->scale[code];
+  if (mag > 1)
+    mag = 1;
+  return (x < 0) ? -mag : mag;
 }
 
-/* Copy one instance of input_event from source device to destination device
-   (the relay) */
-void
-scxrelay_copy_event ()
+static void scxxform_free (struct scxxform_s *xf);
+
+/* Compile the rules against the source's absinfo into lookup tables, and
+   set 'caps' to the source capabilities 'src' as transformed (so the
+   virtual device advertises remapped codes).  Call before the virtual
+   device is created.  Returns the tables, for scxxform_free(), or NULL
+   when out of memory. */
+static struct scxxform_s *
+scxxform_compile (const struct relay_caps_s *src, struct relay_caps_s *caps,
+		  const struct scxxform_rules_s *rules)
 {
-  int res;
-  struct input_event ev;
-  const int evsize = sizeof (struct input_event);
+  struct scxxform_s *xf;
+  struct scxxform_axis_s *ax;
+  const struct input_absinfo *absinfo = src->absinfo;
+  const char *have_abs = src->have_abs, *have_key = src->have_key;
+  double center, half, x;
+  long long range, rounded;
+  int code, dst, i, n;
 
-  res = read (inst->srcfd, &ev, evsize);
-  if (res == evsize)
-    {
-      /* steady state: copy event to relay device. */
-      if (inst->filter_sysbutton)
-        {
-	  /* system ("Home", "Guide", "Steam", ...) button ignored. */
-	  if ((ev.type == EV_KEY) && (ev.code == 10))
-	    return;
-        }
-      die_on_negative( write (inst->uinputfd, &ev, evsize));
-    }
-  else if (res == 0)
+  xf = calloc (1, sizeof (*xf));
+  if (!xf)
+    return NULL;
+  *caps = *src;
+  memset (caps->have_abs, 0, sizeof (caps->have_abs));
+  memset (caps->have_key, 0, sizeof (caps->have_key));
+
+  for (code = 0; code < KEY_CNT; code++)
     {
-      /* source closed/disappeared. */
-      inst->state = SCXSTATE_HALT;
+      dst = rules->key_dst[code];
+      xf->key_dst[code] = dst;
+      if ((dst >= 0) && (have_key[code / 8] & (1 << (code % 8))))
+	caps->have_key[dst / 8] |= 1 << (dst % 8);
     }
-  else if (res < 0)
+
+  for (code = 0; code < ABS_CNT; code++)
     {
-      if (errno != EINTR)
+      ax = xf->axis + code;
+      dst = rules->axis_dst[code];
+      ax->dst = dst;
+      if (!(have_abs[code / 8] & (1 << (code % 8))) || (dst < 0))
+	continue;
+      caps->have_abs[dst / 8] |= 1 << (dst % 8);
+      caps->absinfo[dst] = absinfo[code];
+      if (!rules->shaped[code] || (absinfo[code].maximum <= absinfo[code].minimum))
+	continue;
+
+      ax->min = absinfo[code].minimum;
+      ax->max = absinfo[code].maximum;
+      range = (long long) ax->max - ax->min;
+      while ((range >> ax->shift) >= 65536)
+	ax->shift++;
+      n = (range >> ax->shift) + 1;
+      ax->lut = malloc (n * sizeof (*ax->lut));
+      if (!ax->lut)
 	{
-	  /* stay silent for SIGINT. */
-	  perror (_("Reading from source device file"));
+	  scxxform_free (xf);
+	  return NULL;
+	}
+      center = (ax->min + (double) ax->max) / 2;
+      half = (ax->max - (double) ax->min) / 2;
+      for (i = 0; i < n; i++)
+	{
+	  /* middle of the bucket of values sharing this entry. */
+	  x = ax->min + ((long long) i << ax->shift)
+	    + ((1LL << ax->shift) - 1) / 2.0;
+	  x = center + half * scxxform_shape (rules, code, (x - center) / half);
+	  rounded = (long long) (x + 0.5);
+	  if (rounded > x + 0.5)
+	    rounded--;		/* floor, for negative values. */
+	  ax->lut[i] = (int) rounded;
+	  if (ax->lut[i] < ax->min)
+	    ax->lut[i] = ax->min;
+	  if (ax->lut[i] > ax->max)
+	    ax->lut[i] = ax->max;
 	}
-      inst->state = SCXSTATE_HALT;
     }
-  else
+  return xf;
+}
+
+static void
+scxxform_free (struct scxxform_s *xf)
+{
+  int i;
+
+  if (!xf)
+    return;
+  for (i = 0; i < ABS_CNT; i++)
+    free (xf->axis[i].lut);
+  free (xf);
+}
+
+/* Transform 'nev' events in place; returns how many are left (removed ones
+   close up).  Per event: a code lookup, and a table lookup for shaped axes. */
+static int
+scxxform_apply (const struct scxxform_s *xf, struct input_event *ev, int nev)
+{
+  const struct scxxform_axis_s *ax;
+  struct input_event *e;
+  int i, n = 0, v, dst;
+
+  for (i = 0, e = ev; i < nev; i++, e++)
     {
-      /* partial read. */
-      logmsg (1, _("Partial read %d from source device file.\n"), res);
-      inst->state = SCXSTATE_HALT;
+      dst = e->code;
+      if ((e->type == EV_ABS) && (e->code < ABS_CNT))
+	{
+	  ax = xf->axis + e->code;
+	  if (ax->lut)
+	    {
+	      v = e->value;
+	      v = (v < ax->min) ? ax->min : (v > ax->max) ? ax->max : v;
+	      e->value = ax->lut[((unsigned) v - (unsigned) ax->min)
+				 >> ax->shift];
+	    }
+	  dst = ax->dst;
+	}
+      else if ((e->type == EV_KEY) && (e->code < KEY_CNT))
+	{
+	  dst = xf->key_dst[e->code];
+	}
+      e->code = dst;
+      if (n != i)
+	ev[n] = *e;
+      n += (dst >= 0);
     }
+  return n;
 }
 
-/* Main loop, intended to be terminated with SIGINT (Control-C).
-   Returns shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE).
- */
+
+/** Virtual device identities (--identity) **/
+
+/* The identity used without --identity. */
+static void
+scxrelay_identity_default (struct scxrelay_identity_s *ident)
+{
+  memset (ident, 0, sizeof (*ident));
+  ident->id.bustype = BUS_VIRTUAL;
+  ident->id.vendor = SCXRELAY_VENDORID;
+  ident->id.product = SCXRELAY_PRODUCTID;
+  ident->id.version = SCXRELAY_MODELREV;
+  snprintf (ident->name, sizeof (ident->name), "%s", SCXRELAY_MODELNAME);
+}
+
+/* Add a virtual device to every source:
+     VENDOR:PRODUCT[,bus=BUS][,version=N][,transform=FILE|none][,name=NAME]
+   VENDOR and PRODUCT in hex, as lsusb shows them; BUS is usb, bluetooth,
+   virtual (the default) or a number; NAME takes the rest of the spec, so
+   it may hold commas.  Without transform=, --transform applies.
+   Returns 0 on success, -1 on a malformed spec or too many devices. */
 int
-scxrelay_mainloop ()
+scxrelay_identity_parse (const char *spec)
 {
-  int res;
+  static const struct { const char *name; int bus; } buses[] = {
+    { "usb", BUS_USB }, { "bluetooth", BUS_BLUETOOTH },
+    { "virtual", BUS_VIRTUAL },
+  };
+  struct scxrelay_identity_s *ident;
+  const char *item, *next;
+  char value[PATH_MAX], *end;
+  unsigned long num;
+  size_t len;
+  unsigned i;
 
-  /* Trap SIGINT; allow interrupting syscall (poll(2)), to terminate program. */
-  struct sigaction act;
-  act.sa_handler = on_sigint;
-  sigemptyset (&(act.sa_mask));
-  act.sa_flags = SA_NODEFER | SA_RESETHAND;
-  sigaction (SIGINT, &act, NULL);
+  if (loop->nidentities == SCXRELAY_MAX_SINKS)
+    return -1;
+  ident = loop->identities + loop->nidentities;
+  scxrelay_identity_default (ident);
 
-  inst->state = SCXSTATE_STEADY;
-  /* main loop */
-  while (inst->state != SCXSTATE_HALT)
+  num = strtoul (spec, &end, 16);
+  if ((end == spec) || (*end != ':') || (num > 0xffff))
+    return -1;
+  ident->id.vendor = num;
+  item = end + 1;
+  num = strtoul (item, &end, 16);
+  if ((end == item) || (*end && (*end != ',')) || (num > 0xffff))
+    return -1;
+  ident->id.product = num;
+
+  for (item = end; *item; item = next)
     {
-      /* Build array of pollfd in program stack (use heap in future?). */
-      switch (inst->state)
+      item++;			/* past ','. */
+      if (!strncmp (item, "name=", 5))
 	{
-	case SCXSTATE_INIT:
-	  /* TODO: move initialization to here? */
+	  snprintf (ident->name, sizeof (ident->name), "%s", item + 5);
 	  break;
-	case SCXSTATE_STEADY:
+	}
+      next = strchr (item, ',');
+      if (!next)
+	next = item + strlen (item);
+      len = next - item;
+      if (!memchr (item, '=', len) || (len >= sizeof (value)))
+	return -1;
+      memcpy (value, item, len);
+      value[len] = 0;
+      if (!strncmp (value, "bus=", 4))
+	{
+	  for (i = 0; i < sizeof (buses) / sizeof (buses[0]); i++)
 	    {
-	      struct pollfd fds[] = {
-		    { inst->srcfd, POLLIN, 0 },
-	      };
-	      struct pollfd *fdsiter = fds + 0;
-	      int nfds = sizeof (fds) / sizeof (fds[0]);
-
-	      res = poll (fds, nfds, 100);    /* SIGINT mostly happens here. */
-
-	      if (res > 0)
-		{
-		  for (fdsiter = fds + 0; fdsiter < fds + nfds; fdsiter++)
-		    {
-		      if (fdsiter->fd == inst->srcfd)
-			{
-			  if (fdsiter->revents & POLLIN)
-			    {
-			      scxrelay_copy_event ();
-			    }
-			  if (fdsiter->revents & POLLERR)
-			    {
-			      /* error in polling; presumably disconnect. */
-			      printf("Error in fd %d\n", fdsiter->fd);
-			      close (inst->srcfd);
-			      inst->state = SCXSTATE_FAILED;
-			    }
-			}
-		    }
-		}
+	      if (!strcmp (value + 4, buses[i].name))
+		break;
 	    }
-	  break;
-	case SCXSTATE_FAILED:
-	  /* keep trying to re-open event_path. */
-	  if (inst->event_path[0])
+	  if (i < sizeof (buses) / sizeof (buses[0]))
+	    num = buses[i].bus;
+	  else
 	    {
-	      inst->srcfd = open (inst->event_path, O_RDWR);
-	      if (inst->srcfd < 0)
-		{
-		  usleep(100000);  /* retry after 0.1s */
-		}
-	      else
-		{
-		  printf("Recovered as fd %d\n", inst->srcfd);
-		  inst->state = SCXSTATE_STEADY;
-		}
+	      num = strtoul (value + 4, &end, 0);
+	      if ((end == value + 4) || *end || (num > 0xffff))
+		return -1;
 	    }
-	  else
+	  ident->id.bustype = num;
+	}
+      else if (!strncmp (value, "version=", 8))
+	{
+	  num = strtoul (value + 8, &end, 0);
+	  if ((end == value + 8) || *end || (num > 0xffff))
+	    return -1;
+	  ident->id.version = num;
+	}
+      else if (!strncmp (value, "transform=", 10))
+	{
+	  ident->own_rules = 1;
+	  if (strcmp (value + 10, "none"))
 	    {
-	      usleep(200000);  /* no recovery, but process remains alive for
-				  sake of wrapper script. */
+	      ident->rules = scxxform_load (value + 10);
+	      if (!ident->rules)
+		return -1;
 	    }
-	  break;
-	default:
-	  break;
 	}
+      else
+	return -1;
     }
-
-  /* loop cleanup */
-
+  loop->nidentities++;
   return 0;
 }
 
-/* Runs after resolving event_device and uinput_device (options).
-   Return shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE).  */
-int
-scxrelay_main ()
+
+/** Sources and sinks **/
+
+/* evdev: an event device node (or fd 3, passed by a wrapper); queried for
+   its capabilities. */
+static int
+scxsource_evdev_open (scxrelay_t *inst)
 {
-  if (scxrelay_connect () == 0)
+  if (inst->srcfd < 0)
     {
-      scxrelay_mainloop ();
-      scxrelay_disconnect ();
-      fputs ("", stdout);
+      inst->srcfd = open (inst->event_path, O_RDWR);
     }
-  else
+  if (inst->srcfd < 0)
+    {
+      /* Open read-write failed.  Try read-only (no haptic feedback). */
+      inst->srcfd = open (inst->event_path, O_RDONLY);
+    }
+  if (inst->srcfd < 0)
     {
+      /* Cannot open at all. */
       return -1;
     }
+  die_on_negative (relay_query_caps (inst->srcfd, &(inst->caps)));
+  return 0;
+}
 
+/* pipe, memory: set up by their owner (--replay, the benchmarks), which
+   brings the capabilities too, from a recording's header or a generator. */
+static int
+scxsource_given_open (scxrelay_t *inst)
+{
+  (void) inst;
   return 0;
 }
 
+static ssize_t
+scxsource_fd_read (scxrelay_t *inst, void *buf, size_t len)
+{
+  return read (inst->srcfd, buf, len);
+}
 
-/** Command-line interface **/
+/* memory: input_event records already in memory, read without a syscall.
+   Once they are all read it looks like an empty non-blocking fd. */
+static ssize_t
+scxsource_memory_read (scxrelay_t *inst, void *buf, size_t len)
+{
+  if (!inst->mem_len)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  if (len > inst->mem_len)
+    len = inst->mem_len;
+  memcpy (buf, inst->mem, len);
+  inst->mem += len;
+  inst->mem_len -= len;
+  return len;
+}
 
-/* Show usage information. */
-void
-usage (int argc, char **argv)
+static const struct scxsource_ops_s scxsource_evdev = {
+  "evdev", scxsource_evdev_open, scxsource_fd_read,
+};
+static const struct scxsource_ops_s scxsource_pipe = {
+  "pipe", scxsource_given_open, scxsource_fd_read,
+};
+static const struct scxsource_ops_s scxsource_memory = {
+  "memory", scxsource_given_open, scxsource_memory_read,
+};
+
+/* uinput: a virtual input device, what the game sees. */
+static int
+scxsink_uinput_create (struct scxrelay_sink_s *sink, const char *path)
 {
-  fprintf (stdout, "Usage: %s source_event_device [UINPUT_PATH]\n\
-\n\
-Minimalist Steam Controller xpad relay device.\n\
-May omit 'source_event_device' if fd 3 is opened for read-write on event device.\n\
-If fd 4 is opened, it is treated as read-write fd for uinput device.\n\
-Terminate the program by sending signal SIGINT (press Control-C).\n\
-", argv[0]);
+  if (sink->uinputfd < 0)
+    {
+      sink->uinputfd = open (path, O_RDWR);
+    }
+  if (sink->uinputfd < 0)
+    return -1;
+
+  /* Register input device features and create ("connect") the device. */
+  die_on_negative (relay_create_device (sink->uinputfd, &(sink->caps),
+					sink->identity->name,
+					&(sink->identity->id)));
+  return 0;
 }
 
 static int
-is_fd_open (int probe_fd)
+scxsink_fd_write (struct scxrelay_sink_s *sink,
+		  const struct input_event *frame, int nev)
 {
-  int res = fcntl (probe_fd, F_GETFD);
-  return (res == 0);
+  return write (sink->uinputfd, frame, nev * sizeof (*frame));
 }
 
-int
-main (int argc, char **argv)
+static int
+scxsink_uinput_destroy (struct scxrelay_sink_s *sink)
 {
-  int errcode = EXIT_SUCCESS;
-  int res;
+  return relay_destroy_device (sink->uinputfd);
+}
+
+/* file: raw input_event records appended to the file (or the memfd of
+   --bench) at the uinput path; devices sharing it get whole frames each. */
+static int
+scxsink_file_create (struct scxrelay_sink_s *sink, const char *path)
+{
+  if (sink->uinputfd < 0)
+    {
+      sink->uinputfd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+  return (sink->uinputfd < 0) ? -1 : 0;
+}
+
+/* ring, null: in memory, no syscall; for tests, and for measuring the relay
+   without the kernel's share. */
+static int
+scxsink_none_destroy (struct scxrelay_sink_s *sink)
+{
+  (void) sink;
+  return 0;
+}
+
+static int
+scxsink_ring_create (struct scxrelay_sink_s *sink, const char *path)
+{
+  (void) path;
+  if (!sink->ring)
+    sink->ring = calloc (SCXSINK_RING, sizeof (*sink->ring));
+  return sink->ring ? 0 : -1;
+}
+
+/* Keep the last SCXSINK_RING events. */
+static int
+scxsink_ring_write (struct scxrelay_sink_s *sink,
+		    const struct input_event *frame, int nev)
+{
+  int i;
+
+  for (i = 0; i < nev; i++)
+    sink->ring[(sink->sunk + i) % SCXSINK_RING] = frame[i];
+  sink->sunk += nev;
+  return nev * sizeof (*frame);
+}
+
+static int
+scxsink_ring_destroy (struct scxrelay_sink_s *sink)
+{
+  free (sink->ring);
+  sink->ring = NULL;
+  return 0;
+}
+
+static int
+scxsink_null_create (struct scxrelay_sink_s *sink, const char *path)
+{
+  (void) sink;
+  (void) path;
+  return 0;
+}
+
+static int
+scxsink_null_write (struct scxrelay_sink_s *sink,
+		    const struct input_event *frame, int nev)
+{
+  sink->sunk += nev;
+  return nev * sizeof (*frame);
+}
+
+static const struct scxsink_ops_s scxsink_uinput = {
+  "uinput", 1, scxsink_uinput_create, scxsink_fd_write, scxsink_uinput_destroy,
+};
+static const struct scxsink_ops_s scxsink_file = {
+  "file", 0, scxsink_file_create, scxsink_fd_write, scxsink_none_destroy,
+};
+static const struct scxsink_ops_s scxsink_ring = {
+  "ring", 0, scxsink_ring_create, scxsink_ring_write, scxsink_ring_destroy,
+};
+static const struct scxsink_ops_s scxsink_null = {
+  "null", 0, scxsink_null_create, scxsink_null_write, scxsink_none_destroy,
+};
+static const struct scxsink_ops_s *scxsinks[] = {
+  &scxsink_uinput, &scxsink_file, &scxsink_ring, &scxsink_null, NULL,
+};
+
+
+/** Events Relay **/
+
+static void scxrelay_split_frame (void *ctx, struct input_event *frame,
+				  int nev);
+static int scxrelay_split_resync (void *ctx, const struct timeval *time);
+static void scxrelay_split_batch (void *ctx, struct input_event *frames,
+				  int nev);
+
+void
+scxrelay_init (scxrelay_t *inst)
+{
+  int i;
+
+  memset (inst, 0, sizeof (*inst));
+  inst->source = &scxsource_evdev;
+  inst->srcfd = -1;
+  inst->notify_wd = -1;
+  inst->out = inst;
+  snprintf (inst->uinput_path, sizeof (inst->uinput_path), "/dev/uinput");
+  inst->nsinks = loop->nidentities;
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      inst->sinks[i].relay = inst;
+      inst->sinks[i].identity = loop->identities + i;
+      inst->sinks[i].ops = loop->sink_ops ? loop->sink_ops : &scxsink_uinput;
+      inst->sinks[i].uinputfd = -1;
+    }
+  inst->split.frame = scxrelay_split_frame;
+  inst->split.resync = scxrelay_split_resync;
+  inst->split.batch = loop->coalesce ? scxrelay_split_batch : NULL;
+  inst->split.ctx = inst;
+  inst->split.state = &(inst->relayed);
+  inst->split.syn_dropped = &(inst->stats.syn_dropped);
+}
+
+/* Capabilities of each virtual device of 'inst': 'caps' (the source's, or
+   the merged sources'), through the device's transform, compiled here
+   against those axis ranges.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_sinks_setup (scxrelay_t *inst, const struct relay_caps_s *caps)
+{
+  const struct scxxform_rules_s *rules;
+  struct scxrelay_sink_s *sink;
+  int i;
+
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      sink = inst->sinks + i;
+      rules = sink->identity->own_rules
+	? sink->identity->rules : loop->xform_rules;
+      scxxform_free (sink->xform);
+      sink->xform = NULL;
+      if (!rules)
+	sink->caps = *caps;
+      else if (!(sink->xform = scxxform_compile (caps, &(sink->caps), rules)))
+	return -1;
+    }
+  return 0;
+}
+
+/* Compile the --map of 'inst' against its source's capabilities, and set
+   'caps' to them as the map makes them.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_map_caps (scxrelay_t *inst, struct relay_caps_s *caps)
+{
+  const struct scxxform_rules_s *rules;
+
+  rules = loop->map_rules[inst - loop->relays];	/* by argument order. */
+  scxxform_free (inst->map);
+  inst->map = NULL;
+  if (!rules)
+    *caps = inst->caps;
+  else if (!(inst->map = scxxform_compile (&(inst->caps), caps, rules)))
+    return -1;
+  return 0;
+}
+
+/* Open the source of 'inst' and set 'caps' to its capabilities as its
+   --map makes them.  Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_open_source (scxrelay_t *inst, struct relay_caps_s *caps)
+{
+  if (inst->source->open (inst) < 0)
+    {
+      /* Cannot open at all. */
+      perror (_(inst->event_path));
+      return -1;
+    }
+  relay_state_init (&(inst->relayed), &(inst->caps));	/* source's codes. */
+  if (scxrelay_map_caps (inst, caps) < 0)
+    {
+      perror (_(inst->event_path));
+      return -1;
+    }
+  return 0;
+}
+
+/* Create the virtual devices of 'inst' with the capabilities 'caps'; their
+   force feedback plays on the source of 'ffsrc' (NULL: none).
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_create_sinks (scxrelay_t *inst, const struct relay_caps_s *caps,
+		       scxrelay_t *ffsrc)
+{
+  struct scxrelay_sink_s *sink;
+  int i;
+
+  if (scxrelay_sinks_setup (inst, caps) < 0)
+    {
+      perror (_(inst->uinput_path));
+      return -1;
+    }
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      sink = inst->sinks + i;
+      if (sink->ops->create (sink, inst->uinput_path) < 0)
+	{
+	  perror (_(inst->uinput_path));
+	  return -1;
+	}
+      if (ffsrc && sink->ops->device)
+	{
+	  /* Rumble requests make uinputfd readable. */
+	  relay_ff_init (&(sink->ff), ffsrc->srcfd, sink->uinputfd);
+	  sink->has_ff = 1;
+	}
+    }
+  if (ffsrc)
+    ffsrc->feeds_ff = 1;
+  return 0;
+}
+
+/* Mimick "plugging in" the virtual devices.
+   Returns 0 on success, -1 on failure (then see errno). */
+int
+scxrelay_connect (scxrelay_t *inst)
+{
+  struct relay_caps_s caps;
+
+  if (scxrelay_open_source (inst, &caps) < 0)
+    return -1;
+  return scxrelay_create_sinks (inst, &caps, (caps.ff_max > 0) ? inst : NULL);
+}
+
+/* --merge: set 'merged' to the union of the capabilities of every
+   (opened) source, each as its --map makes them.  An axis or key that
+   several sources report is created once, with the first one's range; the
+   overlap is reported, for --map to move it elsewhere.  Force feedback
+   plays on the first source that has it, set in 'ffsrc' (or NULL).
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_merge_caps (struct relay_caps_s *merged_caps, scxrelay_t **ffsrc)
+{
+  struct relay_caps_s merged, caps;
+  scxrelay_t *inst;
+  int i, code, nabs, nkey;
+
+  *ffsrc = NULL;
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      inst = loop->relays + i;
+      if (scxrelay_map_caps (inst, &caps) < 0)
+	return -1;
+      if (i == 0)
+	{
+	  merged = caps;
+	  memset (merged.have_ev, 0, sizeof (merged.have_ev));
+	  memset (merged.have_abs, 0, sizeof (merged.have_abs));
+	  memset (merged.have_key, 0, sizeof (merged.have_key));
+	  memset (merged.have_ff, 0, sizeof (merged.have_ff));
+	  merged.ff_max = 0;
+	}
+      for (code = 0; code < NBV_EV; code++)
+	merged.have_ev[code] |= caps.have_ev[code];
+      nabs = nkey = 0;
+      for (code = 0; code < ABS_CNT; code++)
+	{
+	  if (!(caps.have_abs[code / 8] & (1 << (code % 8))))
+	    continue;
+	  if (merged.have_abs[code / 8] & (1 << (code % 8)))
+	    {
+	      nabs++;
+	      continue;
+	    }
+	  merged.have_abs[code / 8] |= 1 << (code % 8);
+	  merged.absinfo[code] = caps.absinfo[code];
+	}
+      for (code = 0; code < NBV_KEY; code++)
+	{
+	  nkey += __builtin_popcount (merged.have_key[code]
+				      & caps.have_key[code] & 0xff);
+	  merged.have_key[code] |= caps.have_key[code];
+	}
+      if (nabs || nkey)
+	relay_logmsg (1, _("%s: %d axes and %d keys also come from an earlier source; see --map.\n"),
+		      inst->event_path, nabs, nkey);
+      if (!*ffsrc && (caps.ff_max > 0))
+	{
+	  *ffsrc = inst;
+	  memcpy (merged.have_ff, caps.have_ff, sizeof (merged.have_ff));
+	  merged.ff_max = caps.ff_max;
+	}
+    }
+  if (!*ffsrc)
+    merged.have_ev[EV_FF / 8] &= ~(1 << (EV_FF % 8));
+  *merged_caps = merged;
+  return 0;
+}
+
+/* --merge: open every source, and create one set of virtual devices with
+   the union of their capabilities.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_merge_connect ()
+{
+  struct relay_caps_s merged;
+  scxrelay_t *ffsrc;
+  int i;
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      if (scxrelay_open_source (loop->relays + i, &merged) < 0)
+	return -1;
+    }
+  if (scxrelay_merge_caps (&merged, &ffsrc) < 0)
+    return -1;
+  return scxrelay_create_sinks (loop->relays, &merged, ffsrc);
+}
+
+/* Mimick disconnecting ("unplugging") the relay devices.
+   Returns 0 on success, -1 on error (then see errno).  */
+int
+scxrelay_disconnect (scxrelay_t *inst)
+{
+  struct scxrelay_sink_s *sink;
+  int i, ret = 0;
+
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      sink = inst->sinks + i;
+      if (sink->has_ff)
+	relay_ff_release (&(sink->ff));
+      sink->has_ff = 0;
+      if (sink->ops->destroy (sink) < 0)
+	ret = -1;
+    }
+  return ret;
+}
+
+/* Force-feedback requests the virtual devices of 'inst' have handled. */
+static unsigned long long
+scxrelay_ff_requests (const scxrelay_t *inst)
+{
+  unsigned long long requests = 0;
+  int i;
+
+  for (i = 0; i < inst->nsinks; i++)
+    requests += inst->sinks[i].ff.requests;
+  return requests;
+}
+
+/* Latency histogram of 'inst' in 'h': the loop's samples, and those of its
+   writer threads, each copied whole (again while its thread updates it). */
+static void
+scxrelay_latency (const scxrelay_t *inst, struct scxhist_s *h)
+{
+  const struct scxrelay_sink_s *sink;
+  struct scxhist_s w;
+  unsigned seq;
+  int i, b;
+
+  *h = inst->latency;
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      sink = inst->sinks + i;
+      if (!__atomic_load_n (&(sink->writer_seq), __ATOMIC_ACQUIRE))
+	continue;		/* never recorded. */
+      do
+	{
+	  seq = __atomic_load_n (&(sink->writer_seq), __ATOMIC_ACQUIRE);
+	  memcpy (&w, &(sink->writer_latency), sizeof (w));
+	  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+	}
+      while ((seq & 1)
+	     || (seq != __atomic_load_n (&(sink->writer_seq), __ATOMIC_RELAXED)));
+      h->count += w.count;
+      if (w.max > h->max)
+	h->max = w.max;
+      for (b = 0; b < SCXHIST_BUCKETS; b++)
+	h->buckets[b] += w.buckets[b];
+    }
+}
+
+/* Print each relay's latency histogram. */
+void
+scxrelay_print_latency ()
+{
+  struct scxhist_s h;
+  int i;
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      scxrelay_latency (loop->relays + i, &h);
+      scxhist_print (&h, loop->relays[i].event_path);
+    }
+}
+
+/** Event filter (--drop) **/
+
+/* Number of codes of an event type that may be dropped; 0 if none. */
+static int
+scxdrop_code_count (int type)
+{
+  switch (type)
+    {
+    case EV_KEY: return KEY_CNT;
+    case EV_REL: return REL_CNT;
+    case EV_ABS: return ABS_CNT;
+    case EV_MSC: return MSC_CNT;
+    case EV_SW: return SW_CNT;
+    case EV_LED: return LED_CNT;
+    case EV_SND: return SND_CNT;
+    case EV_FF: return FF_CNT;
+    }
+  return 0;
+}
+
+/* Add "TYPE:CODE[,TYPE:CODE...]" to the dropped events.  TYPE is a number
+   or key, rel, abs, msc, sw, led, snd, ff; CODE is a number, or '*' for
+   every event of TYPE.  Returns 0 on success, -1 on a malformed spec. */
+int
+scxdrop_parse (const char *spec)
+{
+  static const char *const names[EV_CNT] = {
+    [EV_KEY] = "key", [EV_REL] = "rel", [EV_ABS] = "abs", [EV_MSC] = "msc",
+    [EV_SW] = "sw", [EV_LED] = "led", [EV_SND] = "snd", [EV_FF] = "ff",
+  };
+  char buf[256], *item, *codestr, *end;
+  long type, code;
+
+  snprintf (buf, sizeof (buf), "%s", spec);
+  for (item = strtok (buf, ","); item; item = strtok (NULL, ","))
+    {
+      codestr = strchr (item, ':');
+      if (!codestr)
+	return -1;
+      *codestr++ = 0;
+      for (type = 0; type < EV_CNT; type++)
+	{
+	  if (names[type] && !strcasecmp (item, names[type]))
+	    break;
+	}
+      if (type == EV_CNT)
+	{
+	  type = strtol (item, &end, 0);
+	  if (*end || (type < 0) || (type >= EV_CNT))
+	    return -1;
+	}
+      if (!scxdrop_code_count (type))
+	{
+	  /* EV_SYN in particular: frames end in SYN_REPORT. */
+	  return -1;
+	}
+      if (!strcmp (codestr, "*"))
+	{
+	  loop->drop_type[type / 8] |= 1 << (type % 8);
+	}
+      else
+	{
+	  code = strtol (codestr, &end, 0);
+	  if (*end || (code < 0) || (code >= scxdrop_code_count (type)))
+	    return -1;
+	  loop->drop_code[type][code / 8] |= 1 << (code % 8);
+	}
+      loop->ndrop++;
+    }
+  return 0;
+}
+
+/* Userspace filter: whether 'ev' is to be dropped. */
+static int
+scxrelay_dropped (const struct input_event *ev)
+{
+  if (ev->type >= EV_CNT)
+    return 0;
+  if (loop->drop_type[ev->type / 8] & (1 << (ev->type % 8)))
+    return 1;
+  return (ev->code < KEY_CNT)
+    && (loop->drop_code[ev->type][ev->code / 8] & (1 << (ev->code % 8)));
+}
+
+/* Have the kernel drop the --drop events for this source (EVIOCSMASK,
+   Linux 4.4), so they are neither copied nor wake the relay.  Sources
+   without it (older kernels, pipes, replays) filter in userspace. */
+static void
+scxrelay_apply_drop (scxrelay_t *inst)
+{
+  unsigned char mask[NBV_KEY];
+  struct input_mask imask;
+  int type, i, ok = 1;
+
+  inst->drop_user = 0;
+  if (!loop->ndrop)
+    return;
+
+  /* mask bit set = delivered. */
+  for (type = 0; type < EV_CNT; type++)
+    {
+      if (type == 0)
+	{
+	  /* type 0 masks whole event types. */
+	  for (i = 0; i < NBV_EV; i++)
+	    mask[i] = ~loop->drop_type[i];
+	  imask.codes_size = NBV_EV;
+	}
+      else if (scxdrop_code_count (type))
+	{
+	  for (i = 0; i < NBV_KEY; i++)
+	    mask[i] = ~loop->drop_code[type][i];
+	  imask.codes_size = (scxdrop_code_count (type) + 7) / 8;
+	}
+      else
+	continue;
+      for (i = 0; i < (int) imask.codes_size; i++)
+	{
+	  if (mask[i] != 0xff)
+	    break;
+	}
+      if (i == (int) imask.codes_size)
+	continue;		/* nothing dropped of this type. */
+      imask.type = type;
+      imask.codes_ptr = (uintptr_t) mask;
+      if (ioctl (inst->srcfd, EVIOCSMASK, &imask) < 0)
+	{
+	  ok = 0;
+	  break;
+	}
+    }
+  inst->drop_user = !ok;
+}
+
+/* First frame from a re-attached source: tell how long after the node
+   appeared (was created, or made accessible by udev) it was relayed. */
+static void
+scxrelay_report_replug (scxrelay_t *inst)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  relay_logmsg (1, _("%s: first frame %lld us after the node appeared\n"),
+		inst->event_path,
+		(now.tv_sec * 1000000000LL + now.tv_nsec - inst->replug_ns) / 1000);
+  inst->replug_ns = 0;
+}
+
+/* Source read failed: an unplugged device (ENODEV) is recovered by
+   re-opening, anything else terminates the process. */
+static void
+scxrelay_read_failed (scxrelay_t *inst, int err)
+{
+  if (err == ENODEV)
+    {
+      inst->state = SCXSTATE_FAILED;
+    }
+  else
+    {
+      if (err != EINTR)
+	{
+	  /* stay silent for SIGINT. */
+	  relay_logmsg (1, _("Reading from source device file: %s\n"),
+			strerror (err));
+	}
+      loop->halt = 1;
+    }
+}
+
+static void scxrelay_metrics_publish (void);
+static int scxrelay_resync (scxrelay_t *inst, int srcfd,
+			    const struct timeval *time);
+static int scxrelay_epoll_write_frame (struct scxrelay_sink_s *sink,
+				       struct input_event *frame, int nev);
+
+/* Check the write(2)-style result of relaying a frame.  A full uinput
+   (EAGAIN) loses the frame, which is counted; any other failure terminates
+   the process.  Returns 0 if the frame went out, -1 if not. */
+static int
+scxrelay_check_write (scxrelay_t *inst, int res)
+{
+  int err = errno;
+
+  if (res >= 0)
+    return 0;
+  if ((err == EAGAIN) || (err == EWOULDBLOCK))
+    {
+      inst->stats.write_eagain++;
+      return -1;
+    }
+  inst->stats.write_errors++;
+  scxrelay_metrics_publish ();	/* for a monitor to see why. */
+  errno = err;
+  die_on_negative (res);
+  return -1;
+}
+
+/* Whether 'sink' is the last virtual device of its source: the one whose
+   write ends the relaying of a frame, for --latency. */
+static int
+scxrelay_sink_last (const struct scxrelay_sink_s *sink)
+{
+  return sink == sink->relay->sinks + sink->relay->nsinks - 1;
+}
+
+/* Write 'nev' events of 'inst' (after --drop and --map) to every virtual
+   device it feeds with 'write_frame', each through its own transform.
+   'frame' may be transformed in place.
+   Returns how many devices it went out to. */
+static int
+scxrelay_fan_out (scxrelay_t *inst, struct input_event *frame, int nev,
+		  int (*write_frame) (struct scxrelay_sink_s *sink,
+				      struct input_event *frame, int nev))
+{
+  struct input_event copy[SCXRELAY_FRAME_MAX];
+  struct scxrelay_sink_s *sink;
+  struct input_event *out;
+  int i, n, sent = 0;
+
+  for (i = 0; i < inst->out->nsinks; i++)
+    {
+      sink = inst->out->sinks + i;
+      out = frame;
+      n = nev;
+      if (sink->xform)
+	{
+	  if (!scxrelay_sink_last (sink))
+	    {
+	      /* the next devices need the frame as it came. */
+	      memcpy (copy, frame, nev * sizeof (*frame));
+	      out = copy;
+	    }
+	  n = scxxform_apply (sink->xform, out, nev);
+	  if ((n == 0) || ((n == 1) && (n < nev)))
+	    continue;		/* nothing left (but SYN_REPORT). */
+	}
+      if (scxrelay_check_write (inst, write_frame (sink, out, n)) < 0)
+	continue;
+      inst->stats.events += n;
+      sent++;
+    }
+  return sent;
+}
+
+/* Count the 'got' bytes just read to the end of evbuf, and append them to
+   the --record file as they came. */
+static void
+scxrelay_record (scxrelay_t *inst, size_t got)
+{
+  inst->stats.bytes += got;
+  if (inst->record)
+    fwrite ((char *) inst->evbuf + inst->evbytes, 1, got, inst->record);
+}
+
+/* relay_split_frames() callback with --per-event: one event, with one
+   write(2) per device; latency as for frames. */
+static void
+scxrelay_split_event (void *ctx, struct input_event *ev, int nev)
+{
+  scxrelay_t *inst = ctx;
+
+  relay_state_track (&(inst->relayed), ev, nev);
+  if (inst->drop_user && scxrelay_dropped (ev))
+    {
+      inst->stats.dropped++;
+      return;
+    }
+  if (inst->map && !scxxform_apply (inst->map, ev, nev))
+    return;
+  if (!scxrelay_fan_out (inst, ev, nev, scxrelay_epoll_write_frame))
+    return;
+  if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+    {
+      inst->stats.frames++;
+      if (inst->replug_ns)
+	scxrelay_report_replug (inst);
+    }
+}
+
+/* Copy one instance of input_event from source device to destination device
+   (the relay) */
+void
+scxrelay_copy_event (scxrelay_t *inst)
+{
+  struct relay_split_s sp;
+  int res;
+  const int evsize = sizeof (struct input_event);
+
+  res = inst->source->read (inst, inst->evbuf, evsize);
+  inst->stats.reads += (inst->srcfd >= 0);	/* syscalls only. */
+  if (res == evsize)
+    {
+      /* steady state: copy event to relay device. */
+      sp = inst->split;
+      sp.frame = scxrelay_split_event;
+      sp.batch = NULL;
+      sp.per_event = 1;
+      scxrelay_record (inst, res);
+      inst->evbytes = res;
+      relay_split_frames (&sp, inst->evbuf, &(inst->evbytes),
+			  SCXRELAY_EVBUF_COUNT);
+    }
+  else if (res == 0)
+    {
+      /* source closed/disappeared. */
+      loop->halt = 1;
+    }
+  else if (res < 0)
+    {
+      scxrelay_read_failed (inst, errno);
+    }
+  else
+    {
+      /* partial read. */
+      scxrelay_record (inst, res);
+      inst->stats.partial++;
+      relay_logmsg (1, _("Partial read %d from source device file.\n"), res);
+      loop->halt = 1;
+    }
+}
+
+/* Backend write path (epoll): one write() per frame and device; in place
+   for a sink without fd. */
+static int
+scxrelay_epoll_write_frame (struct scxrelay_sink_s *sink,
+			    struct input_event *frame, int nev)
+{
+  scxrelay_t *inst = sink->relay;
+  int res;
+
+  inst->stats.writes += (sink->uinputfd >= 0);	/* syscalls only. */
+  res = sink->ops->write (sink, frame, nev);
+  if (loop->latency && scxrelay_sink_last (sink)
+      && (frame[nev - 1].type == EV_SYN) && (frame[nev - 1].code == SYN_REPORT))
+    {
+      scxhist_record (&(inst->latency), scxhist_since (frame + nev - 1));
+    }
+  return res;
+}
+
+/** Writer thread (--writer) **/
+
+/* Runs in the writer thread, after each frame is written: the last
+   device's thread records latency in its own histogram, which the loop
+   takes through scxrelay_latency() for SIGUSR1 and --metrics. */
+static void
+scxrelay_writer_wrote (void *ctx, const struct input_event *frame, int nev)
+{
+  struct scxrelay_sink_s *sink = ctx;
+  unsigned seq = sink->writer_seq;
+
+  if (!loop->latency || !scxrelay_sink_last (sink)
+      || (frame[nev - 1].type != EV_SYN) || (frame[nev - 1].code != SYN_REPORT))
+    return;
+  __atomic_store_n (&(sink->writer_seq), seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  scxhist_record (&(sink->writer_latency), scxhist_since (frame + nev - 1));
+  __atomic_store_n (&(sink->writer_seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Backend write path (epoll, --writer): queue the frame for the thread. */
+static int
+scxrelay_writer_write_frame (struct scxrelay_sink_s *sink,
+			     struct input_event *frame, int nev)
+{
+  if (!sink->writer)
+    return scxrelay_epoll_write_frame (sink, frame, nev);	/* no fd. */
+  if (relay_writer_push (sink->writer, frame, nev) < 0)
+    return -1;
+  return nev * sizeof (*frame);
+}
+
+/* Start a writer thread for every virtual device with an fd.  The loop
+   has its --rt policy and --cpu core by then, which threads would not get
+   (SCHED_RESET_ON_FORK) or should not share: each writer is created
+   SCHED_FIFO at the --rt priority, on the cores the relay had before --cpu
+   but the loop's, so that it writes while the loop reads.  When the
+   policy cannot be had, writers run under the default one. */
+static void
+scxrelay_writers_start ()
+{
+  struct scxrelay_sink_s *sink;
+  struct sched_param param = { 0, };
+  pthread_attr_t attr;
+  int i, j;
+
+  pthread_attr_init (&attr);
+  if (loop->rt_prio)
+    {
+      param.sched_priority = loop->rt_prio;
+      pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+      pthread_attr_setschedparam (&attr, &param);
+    }
+  if (loop->cpu >= 0)
+    pthread_attr_setaffinity_np (&attr, sizeof (loop->writer_cpus),
+				 &(loop->writer_cpus));
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  sink = loop->relays[i].sinks + j;
+	  if (sink->uinputfd < 0)
+	    continue;
+	  sink->writer = relay_writer_start (sink->uinputfd, loop->backpressure,
+					     scxrelay_writer_wrote, sink,
+					     &attr);
+	  if (!sink->writer && loop->rt_prio && (errno == EPERM))
+	    {
+	      relay_logmsg (1, _("--writer: %s; writer threads run under the default policy\n"),
+			    strerror (errno));
+	      pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+	      sink->writer = relay_writer_start (sink->uinputfd,
+						 loop->backpressure,
+						 scxrelay_writer_wrote, sink,
+						 &attr);
+	    }
+	  if (!sink->writer)
+	    die_on_negative (-1);
+	}
+    }
+  pthread_attr_destroy (&attr);
+  loop->write_frame = scxrelay_writer_write_frame;
+}
+
+/* Counters of the relay's writer threads, running or ended (zero if
+   none), summed over its virtual devices. */
+static void
+scxrelay_writer_counters (const scxrelay_t *inst,
+			  struct relay_writer_stats_s *ws)
+{
+  struct relay_writer_stats_s one;
+  const struct scxrelay_sink_s *sink;
+  int i;
+
+  memset (ws, 0, sizeof (*ws));
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      sink = inst->sinks + i;
+      if (sink->writer)
+	relay_writer_stats (sink->writer, &one);
+      else
+	one = sink->writer_stats;
+      ws->frames += one.frames;
+      ws->dropped += one.dropped;
+      ws->blocked += one.blocked;
+      ws->occupancy_sum += one.occupancy_sum;
+      if (one.occupancy_max > ws->occupancy_max)
+	ws->occupancy_max = one.occupancy_max;
+      ws->occupancy += one.occupancy;
+      ws->written += one.written;
+      ws->coalesced += one.coalesced;
+      ws->writes += one.writes;
+      ws->eagain += one.eagain;
+      ws->errors += one.errors;
+    }
+}
+
+/* Write out what the threads hold and end them, keeping their counters. */
+static void
+scxrelay_writers_stop ()
+{
+  struct scxrelay_sink_s *sink;
+  int i, j;
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  sink = loop->relays[i].sinks + j;
+	  if (!sink->writer)
+	    continue;
+	  relay_writer_stop (sink->writer, &(sink->writer_stats));
+	  sink->writer = NULL;
+	}
+    }
+}
+
+/* Write path of --rate ticks: a tick is its own wakeup, so plain write(2),
+   whatever the backend (but through the writer thread, which owns uinputfd
+   then). */
+static int
+scxrelay_tick_write_frame (struct scxrelay_sink_s *sink,
+			   struct input_event *frame, int nev)
+{
+  if (sink->writer)
+    return scxrelay_writer_write_frame (sink, frame, nev);
+  return scxrelay_epoll_write_frame (sink, frame, nev);
+}
+
+/** Fan-in (--merge) **/
+
+/* Write a frame of 'inst' (after --drop and --map) to the virtual devices
+   it feeds, counting it if complete. */
+static void
+scxrelay_deliver (scxrelay_t *inst, struct input_event *frame, int nev)
+{
+  if (scxrelay_fan_out (inst, frame, nev, loop->write_frame)
+      && (frame[nev - 1].type == EV_SYN) && (frame[nev - 1].code == SYN_REPORT))
+    inst->stats.frames++;
+}
+
+/* Whether 'a' happened after 'b'. */
+static int
+scxrelay_later (const struct timeval *a, const struct timeval *b)
+{
+  return (a->tv_sec > b->tv_sec)
+    || ((a->tv_sec == b->tv_sec) && (a->tv_usec > b->tv_usec));
+}
+
+/* --merge: deliver the queued frames oldest first, by the timestamp of
+   their last event (SYN_REPORT); a source's frames keep their order.  The
+   sources are read at the same wakeup, so their frames interleave as they
+   happened; a frame read later is not held back for an older one that
+   might still come, which would add latency to every frame. */
+static void
+scxrelay_merge_flush ()
+{
+  struct scxrelay_merged_s m;
+  const struct input_event *mev;
+  int i, j;
+
+  for (i = 1; i < loop->nmerged; i++)
+    {
+      /* insertion sort: stable, and linear on frames mostly in order. */
+      m = loop->merged[i];
+      mev = loop->mergebuf + m.start + m.nev - 1;
+      for (j = i; j > 0; j--)
+	{
+	  const struct scxrelay_merged_s *prev = loop->merged + j - 1;
+
+	  if (!scxrelay_later (&(loop->mergebuf[prev->start + prev->nev - 1].time),
+			       &(mev->time)))
+	    break;
+	  loop->merged[j] = *prev;
+	}
+      loop->merged[j] = m;
+    }
+  for (i = 0; i < loop->nmerged; i++)
+    {
+      m = loop->merged[i];
+      scxrelay_deliver (m.inst, loop->mergebuf + m.start, m.nev);
+    }
+  loop->nmerged = 0;
+  loop->mergecount = 0;
+}
+
+/* Send a frame of 'inst' (after --drop and --map) on; with --merge, it
+   waits for the end of the wakeup, to go out in order with the frames
+   read from the other sources. */
+static void
+scxrelay_emit (scxrelay_t *inst, struct input_event *frame, int nev)
+{
+  struct scxrelay_merged_s *m;
+
+  if (!loop->merge)
+    {
+      scxrelay_deliver (inst, frame, nev);
+      return;
+    }
+  if ((loop->nmerged == SCXRELAY_MERGE_FRAMES)
+      || (loop->mergecount + nev > SCXRELAY_MERGE_EVENTS))
+    scxrelay_merge_flush ();	/* full: what is queued is in order. */
+  m = loop->merged + loop->nmerged++;
+  m->inst = inst;
+  m->start = loop->mergecount;
+  m->nev = nev;
+  memcpy (loop->mergebuf + m->start, frame, nev * sizeof (*frame));
+  loop->mergecount += nev;
+}
+
+/** Fixed-rate output (--rate) **/
+
+/* Latest state of a source, sent once per tick as a frame holding only
+   what changed since the previous one.  Axes keep their latest value and
+   relative motion is summed; key transitions are queued, and each tick
+   sends at most one per key, so a tap shorter than a tick still reaches
+   the game.  Other event types are not resampled and are dropped. */
+struct scxresample_s
+{
+  int abs[ABS_CNT];		/* latest value. */
+  int abs_sent[ABS_CNT];
+  char abs_dirty[ABS_CNT];
+  unsigned char abs_list[ABS_CNT];	/* codes with abs_dirty set. */
+  int nabs;
+  int rel[REL_CNT];		/* motion since the last tick. */
+  int nrel;			/* non-zero entries of rel. */
+  struct input_event keyq[SCXRELAY_EVBUF_COUNT];	/* pending transitions. */
+  int nkeyq;
+  struct timeval time;		/* timestamp of the latest source frame. */
+};
+
+/* Arm the periodic tick, on the fixed phase set at loop start. */
+static void
+scxrelay_arm_tick ()
+{
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+  struct timespec now;
+  long long period = 1000000000LL / loop->rate, since, next;
+
+  if (loop->timer_armed)
+    return;
+  scxclock_now (CLOCK_MONOTONIC, &now);
+  since = (now.tv_sec - loop->tick_origin.tv_sec) * 1000000000LL
+    + (now.tv_nsec - loop->tick_origin.tv_nsec);
+  next = (since / period + 1) * period + loop->tick_origin.tv_nsec;
+  loop->timer_armed = 1;
+  if (loop->vclock)
+    {
+      /* scxclock_advance() fires it. */
+      loop->tick_next_ns = loop->tick_origin.tv_sec * 1000000000LL + next;
+      return;
+    }
+  its.it_value.tv_sec = loop->tick_origin.tv_sec + next / 1000000000LL;
+  its.it_value.tv_nsec = next % 1000000000LL;
+  its.it_interval.tv_nsec = period % 1000000000LL;
+  its.it_interval.tv_sec = period / 1000000000LL;
+  die_on_negative (timerfd_settime (loop->timerfd, TFD_TIMER_ABSTIME, &its,
+				    NULL));
+}
+
+/* Send what changed since the last tick as one frame.
+   Returns 1 if something is still pending (more key transitions). */
+static int
+scxrelay_tick (scxrelay_t *inst)
+{
+  struct scxresample_s *rs = inst->resample;
+  struct input_event frame[ABS_CNT + REL_CNT + SCXRELAY_EVBUF_COUNT + 1];
+  int n = 0, i, j, k, code;
+
+  for (i = 0; i < rs->nabs; i++)
+    {
+      code = rs->abs_list[i];
+      rs->abs_dirty[code] = 0;
+      if (rs->abs[code] == rs->abs_sent[code])
+	continue;
+      frame[n].type = EV_ABS;
+      frame[n].code = code;
+      frame[n++].value = rs->abs_sent[code] = rs->abs[code];
+    }
+  rs->nabs = 0;
+  for (code = 0; rs->nrel && (code < REL_CNT); code++)
+    {
+      if (!rs->rel[code])
+	continue;
+      frame[n].type = EV_REL;
+      frame[n].code = code;
+      frame[n++].value = rs->rel[code];
+      rs->rel[code] = 0;
+      rs->nrel--;
+    }
+  /* first pending transition of each key; later ones wait a tick. */
+  for (i = k = 0; i < rs->nkeyq; i++)
+    {
+      for (j = n - 1; (j >= 0) && (frame[j].type == EV_KEY); j--)
+	{
+	  if (frame[j].code == rs->keyq[i].code)
+	    break;
+	}
+      if ((j >= 0) && (frame[j].type == EV_KEY))
+	rs->keyq[k++] = rs->keyq[i];
+      else
+	frame[n++] = rs->keyq[i];
+    }
+  rs->nkeyq = k;
+  if (n == 0)
+    return 0;
+
+  frame[n].type = EV_SYN;
+  frame[n].code = SYN_REPORT;
+  frame[n++].value = 0;
+  for (i = 0; i < n; i++)
+    frame[i].time = rs->time;
+  if (scxrelay_fan_out (inst, frame, n, scxrelay_tick_write_frame))
+    inst->stats.frames++;
+  return rs->nkeyq > 0;
+}
+
+/* Tick every relay; stop the timer once nothing is pending, so an idle
+   relay does not wake up at the output rate. */
+static void
+scxrelay_tick_all ()
+{
+  int i, pending = 0;
+
+  scxrelay_merge_flush ();	/* frames read before the tick go first. */
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      if (loop->relays[i].resample)
+	pending |= scxrelay_tick (loop->relays + i);
+    }
+  if (!pending)
+    {
+      struct itimerspec off = { { 0, 0 }, { 0, 0 } };
+      if (!loop->vclock)
+	timerfd_settime (loop->timerfd, 0, &off, NULL);
+      loop->timer_armed = 0;
+    }
+}
+
+/* Timer expired. */
+static void
+scxrelay_handle_tick ()
+{
+  uint64_t expirations;
+
+  if (read (loop->timerfd, &expirations, sizeof (expirations)) < 0)
+    return;
+  scxrelay_tick_all ();
+}
+
+/* Move the virtual clock on to 'ns', firing the --rate ticks due by then,
+   each at its own time. */
+static void
+scxclock_advance (long long ns)
+{
+  while (loop->rate && loop->timer_armed && (loop->tick_next_ns <= ns))
+    {
+      loop->vclock_ns = loop->tick_next_ns;
+      loop->tick_next_ns += 1000000000LL / loop->rate;
+      scxrelay_tick_all ();
+    }
+  loop->vclock_ns = ns;
+}
+
+/* Fold a source frame into the snapshot, instead of relaying it. */
+static void
+scxrelay_absorb_frame (scxrelay_t *inst, const struct input_event *frame,
+		       int nev)
+{
+  struct scxresample_s *rs = inst->resample;
+  const struct input_event *ev;
+
+  for (ev = frame; ev < frame + nev; ev++)
+    {
+      if ((ev->type == EV_ABS) && (ev->code < ABS_CNT))
+	{
+	  rs->abs[ev->code] = ev->value;
+	  if (!rs->abs_dirty[ev->code])
+	    {
+	      rs->abs_dirty[ev->code] = 1;
+	      rs->abs_list[rs->nabs++] = ev->code;
+	    }
+	}
+      else if ((ev->type == EV_REL) && (ev->code < REL_CNT))
+	{
+	  rs->nrel += !rs->rel[ev->code];
+	  rs->rel[ev->code] += ev->value;
+	  rs->nrel -= !rs->rel[ev->code];
+	}
+      else if ((ev->type == EV_KEY) && (ev->value != 2))
+	{
+	  /* autorepeat (2) is the consumer's business. */
+	  if (rs->nkeyq == SCXRELAY_EVBUF_COUNT)
+	    scxrelay_tick (inst);	/* full: send early, lose nothing. */
+	  rs->keyq[rs->nkeyq++] = *ev;
+	}
+    }
+  rs->time = frame[nev - 1].time;
+  inst->stats.absorbed++;
+  scxrelay_arm_tick ();
+}
+
+/* Start resampling 'inst'; the first tick sends every axis.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_resample_init (scxrelay_t *inst)
+{
+  int i;
+
+  inst->resample = calloc (1, sizeof (*inst->resample));
+  if (!inst->resample)
+    return -1;
+  for (i = 0; i < ABS_CNT; i++)
+    inst->resample->abs_sent[i] = INT_MIN;
+  return 0;
+}
+
+/* --drop in userspace: remove the filtered events from the 'nev' of
+   'frame', in place.  Returns how many are left. */
+static int
+scxrelay_drop_filter (scxrelay_t *inst, struct input_event *frame, int nev)
+{
+  int i, n = 0;
+
+  if (!inst->drop_user)
+    return nev;
+  for (i = 0; i < nev; i++)
+    {
+      if (scxrelay_dropped (frame + i))
+	continue;
+      frame[n++] = frame[i];
+    }
+  inst->stats.dropped += nev - n;
+  return n;
+}
+
+/* Relay one complete frame (ending in SYN_REPORT) to each relay device with
+   a single write, after dropping filtered events and applying the source's
+   --map.  --rate snapshots the mapped codes; each device's transform
+   applies as the tick goes out. */
+static void
+scxrelay_relay_frame (scxrelay_t *inst, struct input_event *frame, int nev)
+{
+  int n;
+
+  relay_state_track (&(inst->relayed), frame, nev);
+  if (inst->replug_ns)
+    scxrelay_report_replug (inst);
+  n = scxrelay_drop_filter (inst, frame, nev);
+  if (inst->map)
+    n = scxxform_apply (inst->map, frame, n);
+  if ((n == 1) && (n < nev))
+    {
+      /* nothing left but SYN_REPORT. */
+      return;
+    }
+  if (inst->resample)
+    {
+      scxrelay_absorb_frame (inst, frame, n);
+      return;
+    }
+
+  scxrelay_emit (inst, frame, n);
+}
+
+/* Bring the virtual device to the state of 'srcfd' (-1: nothing held, the
+   source being lost) with one frame of what differs, stamped 'time' or
+   now.  Returns 1 if there was such a frame. */
+static int
+scxrelay_resync (scxrelay_t *inst, int srcfd, const struct timeval *time)
+{
+  struct input_event frame[RELAY_STATE_MAXEV];
+  struct timespec now;
+  struct timeval tv;
+  int nev;
+
+  if (!time)
+    {
+      /* the source's clock. */
+      scxclock_now (loop->latency ? CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+      tv.tv_sec = now.tv_sec;
+      tv.tv_usec = now.tv_nsec / 1000;
+      time = &tv;
+    }
+  nev = relay_state_diff (&(inst->relayed), srcfd, time, frame);
+  if (nev <= 0)
+    return 0;
+  scxrelay_relay_frame (inst, frame, nev);
+  return 1;
+}
+
+/* --coalesce: relay the 'nev' events of several complete frames that were
+   read together as few frames as possible (see relay_coalesce()). */
+static void
+scxrelay_coalesce (scxrelay_t *inst, const struct input_event *in, int nev)
+{
+  struct input_event out[2 * SCXRELAY_EVBUF_COUNT];
+  int nout, start, i;
+
+  nout = relay_coalesce (in, nev, out);
+  for (start = i = 0; i < nout; i++)
+    {
+      if ((out[i].type == EV_SYN) && (out[i].code == SYN_REPORT))
+	{
+	  scxrelay_relay_frame (inst, out + start, i + 1 - start);
+	  start = i + 1;
+	}
+    }
+  inst->stats.coalesced += nev - nout;
+}
+
+/* relay_split_frames() callbacks: a frame, or a piece of one larger than
+   the whole buffer, which cannot be kept atomic. */
+static void
+scxrelay_split_frame (void *ctx, struct input_event *frame, int nev)
+{
+  scxrelay_t *inst = ctx;
+  int n;
+
+  if ((frame[nev - 1].type == EV_SYN) && (frame[nev - 1].code == SYN_REPORT))
+    {
+      scxrelay_relay_frame (inst, frame, nev);
+      return;
+    }
+  relay_logmsg (1, _("Frame exceeds %d events, relaying in pieces.\n"),
+		SCXRELAY_EVBUF_COUNT);
+  relay_state_track (&(inst->relayed), frame, nev);
+  n = scxrelay_drop_filter (inst, frame, nev);
+  if (inst->map)
+    n = scxxform_apply (inst->map, frame, n);
+  if (n > 0)
+    scxrelay_emit (inst, frame, n);
+}
+
+static int
+scxrelay_split_resync (void *ctx, const struct timeval *time)
+{
+  scxrelay_t *inst = ctx;
+
+  return scxrelay_resync (inst, inst->srcfd, time);
+}
+
+static void
+scxrelay_split_batch (void *ctx, struct input_event *frames, int nev)
+{
+  scxrelay_coalesce (ctx, frames, nev);
+}
+
+/* Take 'got' more bytes read into evbuf, recording them as they came,
+   then relay every complete frame held there.  A trailing incomplete frame
+   is kept for the next read, so the relay device never sees half a
+   frame. */
+static void
+scxrelay_split_frames (scxrelay_t *inst, size_t got)
+{
+  scxrelay_record (inst, got);
+  inst->evbytes += got;
+  relay_split_frames (&(inst->split), inst->evbuf, &(inst->evbytes),
+		      SCXRELAY_EVBUF_COUNT);
+  if (inst->evbytes)
+    inst->stats.partial++;	/* kept for the next read. */
+}
+
+/* Drain the (non-blocking) source device with one large read, then relay
+   every complete frame in the buffer. */
+void
+scxrelay_copy_frames (scxrelay_t *inst)
+{
+  int res;
+  size_t room = sizeof (inst->evbuf) - inst->evbytes;
+
+  res = inst->source->read (inst, (char *) inst->evbuf + inst->evbytes, room);
+  inst->stats.reads += (inst->srcfd >= 0);	/* syscalls only. */
+  if (res > 0)
+    scxrelay_split_frames (inst, res);
+  else if (res == 0)
+    {
+      /* source closed/disappeared. */
+      loop->halt = 1;
+    }
+  else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+    {
+      /* spurious wakeup; nothing pending. */
+    }
+  else
+    {
+      scxrelay_read_failed (inst, errno);
+    }
+}
+
+static void scxrelay_uring_post_read (scxrelay_t *inst);
+
+/* Report counters collected by the relay paths. */
+void
+scxrelay_print_stats ()
+{
+  struct scxrelay_stats_s total = { 0, };
+  const struct scxrelay_stats_s *st;
+  struct relay_writer_stats_s ws;
+  unsigned long long syscalls, rumble = 0;
+  int i;
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      st = &(loop->relays[i].stats);
+      relay_logmsg (1, _("%s: %llu events, %llu frames; %llu read, %llu write\n"),
+		    loop->relays[i].event_path,
+		    st->events, st->frames, st->reads, st->writes);
+      total.events += st->events;
+      total.frames += st->frames;
+      total.reads += st->reads;
+      total.writes += st->writes;
+      scxrelay_writer_counters (loop->relays + i, &ws);
+      if (ws.frames)
+	{
+	  relay_logmsg (1, _("%s: writer thread (%s): %llu frames in %llu writes (%llu EAGAIN, %llu failed), %llu coalesced\n"),
+			loop->relays[i].event_path,
+			relay_backpressure_names[loop->backpressure],
+			ws.written, ws.writes, ws.eagain, ws.errors,
+			ws.coalesced);
+	  relay_logmsg (1, _("%s: ring %.2f frames queued per push (max %u of %d), %llu pushes waited, %llu frames dropped\n"),
+			loop->relays[i].event_path,
+			(double) ws.occupancy_sum / ws.frames,
+			ws.occupancy_max, RELAY_RING_FRAMES, ws.blocked,
+			ws.dropped);
+	}
+      total.writes += ws.writes;
+      total.dropped += st->dropped;
+      total.coalesced += st->coalesced;
+      total.absorbed += st->absorbed;
+      total.write_waits += st->write_waits;
+      rumble += scxrelay_ff_requests (loop->relays + i);
+    }
+  if (loop->coalesce)
+    relay_logmsg (1, _("%llu events saved by coalescing\n"), total.coalesced);
+  if (loop->rate)
+    relay_logmsg (1, _("%llu source frames resampled into %llu at %d Hz\n"),
+		  total.absorbed, total.frames, loop->rate);
+  if (loop->sched_runs)
+    relay_logmsg (1, _("scheduling (%s): %.1f us run delay per wakeup, %llu wakeups\n"),
+		  (sched_getscheduler (0) & ~SCHED_RESET_ON_FORK) == SCHED_FIFO
+		  ? "SCHED_FIFO" : "default",
+		  loop->sched_delay / 1e3 / loop->sched_runs, loop->sched_runs);
+  if (rumble)
+    relay_logmsg (1, _("%llu force-feedback requests relayed to the source\n"),
+		  rumble);
+  if (total.dropped)
+    relay_logmsg (1, _("%llu events dropped in userspace (no EVIOCSMASK)\n"),
+		  total.dropped);
+  if (total.write_waits)
+    relay_logmsg (1, _("%llu waits for io_uring writes to free a write buffer\n"),
+		  total.write_waits);
+  if (loop->backend == SCXBACKEND_URING)
+    {
+      /* reads and writes are SQEs; only io_uring_enter(2) is a syscall. */
+      syscalls = loop->polls;
+      relay_logmsg (1, _("%llu io_uring_enter for %llu frames, %llu idle wakeups\n"),
+		    loop->polls, total.frames, loop->idle_wakeups);
+    }
+  else
+    {
+      syscalls = loop->polls + total.reads + total.writes;
+      relay_logmsg (1, _("%llu wakeups for %llu frames, %llu idle\n"),
+		    loop->polls, total.frames, loop->idle_wakeups);
+    }
+  if (total.frames && (loop->backend == SCXBACKEND_URING))
+    {
+      relay_logmsg (1, _("%.2f syscalls/frame (%.2f read, %.2f write SQEs/frame)\n"),
+		    (double) syscalls / total.frames,
+		    (double) total.reads / total.frames,
+		    (double) total.writes / total.frames);
+    }
+  else if (total.frames)
+    {
+      relay_logmsg (1, _("%.2f syscalls/frame (%.2f wait, %.2f read, %.2f write)\n"),
+		    (double) syscalls / total.frames,
+		    (double) loop->polls / total.frames,
+		    (double) total.reads / total.frames,
+		    (double) total.writes / total.frames);
+    }
+}
+
+/** Metrics page (--metrics) **/
+
+/* Create the metrics page at loop->metrics_path (see scxmetrics.h): written
+   aside and renamed, so readers never see it half set up.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_metrics_open ()
+{
+  char tmp[PATH_MAX];
+  struct scxmetrics_s *page;
+  int fd;
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", loop->metrics_path);
+  fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, sizeof (*page)) < 0)
+    {
+      close (fd);
+      unlink (tmp);
+      return -1;
+    }
+  page = mmap (NULL, sizeof (*page), PROT_READ | PROT_WRITE, MAP_SHARED,
+	       fd, 0);
+  close (fd);
+  if (page == MAP_FAILED)
+    {
+      unlink (tmp);
+      return -1;
+    }
+  memcpy (page->magic, SCXMETRICS_MAGIC, sizeof (page->magic));
+  page->version = SCXMETRICS_VERSION;
+  page->relay_size = sizeof (page->relay[0]);
+  page->nrelays = loop->nrelays;
+  page->hist_sub_bits = SCXHIST_SUB_BITS;
+  page->hist_buckets = SCXHIST_BUCKETS;
+  page->pid = getpid ();
+  page->backend = (loop->backend == SCXBACKEND_URING);
+  loop->metrics = page;
+  scxrelay_metrics_publish ();
+  if (rename (tmp, loop->metrics_path) < 0)
+    {
+      munmap (page, sizeof (*page));
+      loop->metrics = NULL;
+      unlink (tmp);
+      return -1;
+    }
+  return 0;
+}
+
+/* Copy the counters of every relay to the metrics page, if any.  Called
+   once per wakeup of the event loop, so the page lags by at most one;
+   the histogram is copied only while --latency fills it. */
+static void
+scxrelay_metrics_publish ()
+{
+  struct scxmetrics_s *page = loop->metrics;
+  struct scxmetrics_relay_s *m;
+  struct relay_writer_stats_s ws;
+  struct scxhist_s h;
+  const scxrelay_t *inst;
+  struct timespec now;
+  uint64_t seq;
+  size_t len;
+  int i;
+
+  if (!page)
+    return;
+  seq = page->seq;
+  __atomic_store_n (&(page->seq), seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  page->updated_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  page->polls = loop->polls;
+  page->idle_wakeups = loop->idle_wakeups;
+  page->syscalls = loop->polls;
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      inst = loop->relays + i;
+      m = page->relay + i;
+      scxrelay_writer_counters (inst, &ws);
+      if (loop->backend != SCXBACKEND_URING)
+	page->syscalls += inst->stats.reads + inst->stats.writes + ws.writes;
+      if (strncmp (m->event_path, inst->event_path,
+		   sizeof (m->event_path) - 1))
+	{
+	  len = strnlen (inst->event_path, sizeof (m->event_path) - 1);
+	  memcpy (m->event_path, inst->event_path, len);
+	  m->event_path[len] = 0;
+	}
+      m->relaying = (inst->state != SCXSTATE_FAILED);
+      m->events = inst->stats.events;
+      m->frames = inst->stats.frames;
+      m->bytes_read = inst->stats.bytes;
+      m->bytes_written = inst->stats.events * sizeof (struct input_event);
+      m->reads = inst->stats.reads;
+      m->writes = inst->stats.writes + ws.writes;
+      m->partial_reads = inst->stats.partial;
+      m->write_errors = inst->stats.write_errors + ws.errors;
+      m->write_eagain = inst->stats.write_eagain;
+      m->reconnects = inst->stats.reconnects;
+      m->syn_dropped = inst->stats.syn_dropped;
+      m->ff_requests = scxrelay_ff_requests (inst);
+      m->dropped = inst->stats.dropped;
+      m->coalesced = inst->stats.coalesced;
+      m->absorbed = inst->stats.absorbed;
+      m->ring_pushes = ws.frames;
+      m->ring_occupancy = ws.occupancy;
+      m->ring_occupancy_max = ws.occupancy_max;
+      m->ring_occupancy_sum = ws.occupancy_sum;
+      m->ring_blocked = ws.blocked;
+      m->ring_dropped = ws.dropped;
+      m->ring_coalesced = ws.coalesced;
+      if (loop->latency)
+	scxrelay_latency (inst, &h);
+      if (loop->latency && (m->latency_count != h.count))
+	{
+	  m->latency_count = h.count;
+	  m->latency_max = h.max;
+	  memcpy (m->latency, h.buckets, sizeof (m->latency));
+	}
+    }
+
+  __atomic_store_n (&(page->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Take the page down at exit; readers holding a mapping keep the final
+   counters. */
+static void
+scxrelay_metrics_close ()
+{
+  if (!loop->metrics)
+    return;
+  scxrelay_metrics_publish ();
+  unlink (loop->metrics_path);
+  munmap (loop->metrics, sizeof (*loop->metrics));
+  loop->metrics = NULL;
+}
+
+/* Register a relay's source with the event loop. */
+static void
+scxrelay_watch (scxrelay_t *inst)
+{
+  struct epoll_event epev = { 0, };
+
+  inst->evbytes = 0;
+  inst->state = SCXSTATE_STEADY;
+  scxrelay_apply_drop (inst);
+  if (loop->latency)
+    {
+      /* compare event timestamps against CLOCK_MONOTONIC; a pipe has none. */
+      int clkid = CLOCK_MONOTONIC;
+      ioctl (inst->srcfd, EVIOCSCLOCKID, &clkid);
+    }
+  if (loop->backend == SCXBACKEND_URING)
+    {
+      /* io_uring waits for data itself; keep one read always posted. */
+      scxrelay_uring_post_read (inst);
+      return;
+    }
+
+  if (!loop->per_event)
+    {
+      /* batched reads drain the source until EAGAIN. */
+      fcntl (inst->srcfd, F_SETFL, fcntl (inst->srcfd, F_GETFL) | O_NONBLOCK);
+    }
+
+  epev.events = EPOLLIN;
+  epev.data.ptr = inst;
+  die_on_negative (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, inst->srcfd, &epev));
+}
+
+/* Source went away; drop it from the event loop and start recovery. */
+static void
+scxrelay_unwatch (scxrelay_t *inst)
+{
+  int i;
+
+  relay_logmsg (1, _("Error in fd %d\n"), inst->srcfd);
+  if (loop->backend == SCXBACKEND_EPOLL)
+    epoll_ctl (loop->epfd, EPOLL_CTL_DEL, inst->srcfd, NULL);
+  close (inst->srcfd);
+  inst->srcfd = -1;
+  inst->state = SCXSTATE_FAILED;
+  inst->relayed.dropping = 0;
+  inst->evbytes = 0;
+  scxrelay_resync (inst, -1, NULL);	/* release whatever was held. */
+  for (i = 0; inst->feeds_ff && (i < inst->out->nsinks); i++)
+    {
+      if (inst->out->sinks[i].has_ff)
+	relay_ff_attach (&(inst->out->sinks[i].ff), -1);	/* cache uploads until replug. */
+    }
+}
+
+/* Directory where a failed relay's source may reappear: --devdir, or the
+   directory of its last event device. */
+static void
+scxrelay_device_dir (scxrelay_t *inst, char *dir, size_t size)
+{
+  char *slash;
+
+  snprintf (dir, size, "%s", loop->devdir ? loop->devdir : inst->event_path);
+  if (loop->devdir)
+    return;
+  slash = strrchr (dir, '/');
+  if (slash == dir)
+    dir[1] = 0;
+  else if (slash)
+    *slash = 0;
+  else
+    snprintf (dir, size, ".");
+}
+
+/* A replugged controller usually comes back as another eventNN; it is
+   recognized by vendor, product, name and, when known, uniq. */
+static int
+scxrelay_same_device (scxrelay_t *inst, const struct input_id *id,
+		      const char *name, const char *uniq)
+{
+  return (id->vendor == inst->caps.id.vendor)
+    && (id->product == inst->caps.id.product)
+    && !strcmp (name, inst->caps.name)
+    && (!inst->caps.uniq[0] || !strcmp (uniq, inst->caps.uniq));
+}
+
+/* Whether capabilities 'a' and 'b' would make the same virtual device. */
+static int
+scxrelay_same_caps (const struct relay_caps_s *a, const struct relay_caps_s *b)
+{
+  return !memcmp (a->have_ev, b->have_ev, sizeof (a->have_ev))
+    && !memcmp (a->have_abs, b->have_abs, sizeof (a->have_abs))
+    && !memcmp (a->have_key, b->have_key, sizeof (a->have_key))
+    && !memcmp (a->have_ff, b->have_ff, sizeof (a->have_ff))
+    && (a->ff_max == b->ff_max)
+    && !memcmp (a->absinfo, b->absinfo, sizeof (a->absinfo));
+}
+
+/* The source of 'inst' came back with other capabilities (another mode, a
+   firmware update): re-create the virtual devices it feeds from them, on
+   the same fds, so the event loop and writer threads keep them.  The new
+   devices are at rest; the other sources they merge catch up as on
+   re-attach.  Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_recreate (scxrelay_t *inst)
+{
+  struct relay_caps_s caps;
+  scxrelay_t *other, *ffsrc;
+  int i;
+
+  relay_state_init (&(inst->relayed), &(inst->caps));
+  if (loop->merge)
+    {
+      if (scxrelay_merge_caps (&caps, &ffsrc) < 0)
+	return -1;
+    }
+  else
+    {
+      if (scxrelay_map_caps (inst, &caps) < 0)
+	return -1;
+      ffsrc = (caps.ff_max > 0) ? inst : NULL;
+    }
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      if (loop->relays[i].out == inst->out)
+	loop->relays[i].feeds_ff = 0;
+    }
+  scxrelay_disconnect (inst->out);
+  if (scxrelay_create_sinks (inst->out, &caps, ffsrc) < 0)
+    return -1;
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      other = loop->relays + i;
+      if ((other == inst) || (other->out != inst->out) || (other->srcfd < 0))
+	continue;
+      relay_state_init (&(other->relayed), &(other->caps));
+      scxrelay_resync (other, other->srcfd, NULL);
+    }
+  return 0;
+}
+
+/* Offer an event device node to the failed relays; the first one whose
+   source it is re-attaches to it, keeping its virtual device (unless its
+   capabilities changed).
+   Returns 1 when the node was taken, 0 otherwise. */
+static int
+scxrelay_adopt_node (const char *path)
+{
+  struct input_id id;
+  char name[UINPUT_MAX_NAME_SIZE], uniq[UINPUT_MAX_NAME_SIZE];
+  struct relay_caps_s caps;
+  struct stat st;
+  struct timespec now;
+  scxrelay_t *inst = NULL;
+  int fd, i, j;
+
+  fd = open (path, O_RDWR);
+  if (fd < 0)
+    {
+      /* not (yet) accessible: udev will chmod it, and inotify tells. */
+      return 0;
+    }
+  relay_identify (fd, &id, name, uniq);
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      inst = loop->relays + i;
+      if ((inst->state == SCXSTATE_FAILED) && (inst->notify_wd >= 0)
+	  && scxrelay_same_device (inst, &id, name, uniq))
+	break;
+    }
+  if (i == loop->nrelays)
+    {
+      close (fd);
+      return 0;
+    }
+
+  inst->srcfd = fd;
+  inst->stats.reconnects++;
+  snprintf (inst->event_path, sizeof (inst->event_path), "%s", path);
+  if ((relay_query_caps (fd, &caps) == 0)
+      && !scxrelay_same_caps (&caps, &(inst->caps)))
+    {
+      relay_logmsg (1, _("%s: capabilities changed; re-creating the virtual device\n"),
+		    path);
+      inst->caps = caps;
+      if (scxrelay_recreate (inst) < 0)
+	loop->halt = 1;
+    }
+  else
+    {
+      for (j = 0; inst->feeds_ff && (j < inst->out->nsinks); j++)
+	{
+	  if (inst->out->sinks[j].has_ff)
+	    relay_ff_attach (&(inst->out->sinks[j].ff), fd);	/* effects the game still holds. */
+	}
+    }
+  /* ctime comes from the coarse clock: figures are good to a tick. */
+  if (fstat (fd, &st) == 0)
+    {
+      clock_gettime (CLOCK_REALTIME, &now);
+      inst->replug_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+      relay_logmsg (1, _("%s: re-attached %lld us after the node appeared\n"), path,
+		    (now.tv_sec * 1000000000LL + now.tv_nsec - inst->replug_ns) / 1000);
+    }
+  relay_logmsg (1, _("Recovered as fd %d\n"), inst->srcfd);
+  /* what is held right now; with io_uring, queued ahead of the read. */
+  scxrelay_resync (inst, fd, NULL);
+  scxrelay_watch (inst);
+
+  /* drop the watch unless another failed relay shares the directory. */
+  for (j = 0; j < loop->nrelays; j++)
+    {
+      if ((loop->relays[j].state == SCXSTATE_FAILED)
+	  && (loop->relays[j].notify_wd == inst->notify_wd))
+	break;
+    }
+  if (j == loop->nrelays)
+    inotify_rm_watch (loop->notifyfd, inst->notify_wd);
+  inst->notify_wd = -1;
+  return 1;
+}
+
+/* Offer every event device node in 'dir' to the failed relays. */
+static void
+scxrelay_scan_dir (const char *dir)
+{
+  char path[PATH_MAX + NAME_MAX + 1];
+  struct dirent *ent;
+  DIR *dp;
+
+  dp = opendir (dir);
+  if (!dp)
+    return;
+  while ((ent = readdir (dp)))
+    {
+      if (strncmp (ent->d_name, "event", 5))
+	continue;
+      snprintf (path, sizeof (path), "%s/%s", dir, ent->d_name);
+      scxrelay_adopt_node (path);
+    }
+  closedir (dp);
+}
+
+/* Start waiting for a failed relay's source to come back.  The virtual
+   device stays.  Nodes are looked at when inotify reports them in the
+   device directory (created, or permissions set by udev), never on a
+   timer; one scan covers a node that came back before the watch. */
+static void
+scxrelay_recover (scxrelay_t *inst)
+{
+  char dir[PATH_MAX];
+
+  if (!inst->event_path[0] || !strcmp (inst->event_path, "-"))
+    {
+      /* no recovery, but process remains alive for sake of wrapper script. */
+      return;
+    }
+  scxrelay_device_dir (inst, dir, sizeof (dir));
+  inst->notify_wd = inotify_add_watch (loop->notifyfd, dir,
+				       IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+  if (inst->notify_wd < 0)
+    {
+      relay_logmsg (1, _("%s: %s\n"), dir, strerror (errno));
+      return;
+    }
+  scxrelay_scan_dir (dir);
+}
+
+/* The inotify fd is readable: offer each new or changed event device node
+   to the failed relays watching its directory. */
+static void
+scxrelay_handle_notify ()
+{
+  char buf[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  char dir[PATH_MAX], path[PATH_MAX + NAME_MAX + 1];
+  const struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int i;
+
+  while ((len = read (loop->notifyfd, buf, sizeof (buf))) > 0)
+    {
+      for (p = buf; p < buf + len; p += sizeof (*ev) + ev->len)
+	{
+	  ev = (const struct inotify_event *) p;
+	  for (i = 0; i < loop->nrelays; i++)
+	    {
+	      if ((loop->relays[i].state != SCXSTATE_FAILED)
+		  || ((loop->relays[i].notify_wd != ev->wd)
+		      && !(ev->mask & IN_Q_OVERFLOW)))
+		continue;
+	      scxrelay_device_dir (loop->relays + i, dir, sizeof (dir));
+	      if (ev->mask & IN_Q_OVERFLOW)
+		{
+		  /* events were lost; look at everything. */
+		  scxrelay_scan_dir (dir);
+		  continue;
+		}
+	      if (ev->len && !strncmp (ev->name, "event", 5))
+		{
+		  snprintf (path, sizeof (path), "%s/%s", dir, ev->name);
+		  scxrelay_adopt_node (path);
+		}
+	      break;
+	    }
+	}
+    }
+}
+
+/* The signalfd is readable.  SIGUSR1 prints the latency histograms; the
+   others end the program. */
+static void
+scxrelay_handle_signals ()
+{
+  struct signalfd_siginfo si;
+
+  while (read (loop->sigfd, &si, sizeof (si)) == sizeof (si))
+    {
+      if (si.ssi_signo == SIGUSR1)
+	scxrelay_print_latency ();
+      else
+	loop->halt = 1;
+    }
+}
+
+/* uinputfd of 'sink' is readable: rumble requests from the game. */
+static void
+scxrelay_handle_ff (struct scxrelay_sink_s *sink)
+{
+  if (relay_ff_handle (&(sink->ff)) < 0)
+    relay_logmsg (1, _("%s: %s\n"), sink->relay->uinput_path,
+		  strerror (errno));
+}
+
+/* Frames relayed (or absorbed, with --rate) and force-feedback requests
+   handled so far by all relays; tells idle wakeups apart. */
+static unsigned long long
+scxrelay_frames_relayed ()
+{
+  unsigned long long frames = 0;
+  int i;
+
+  for (i = 0; i < loop->nrelays; i++)
+    frames += loop->relays[i].stats.frames + loop->relays[i].stats.absorbed
+      + scxrelay_ff_requests (loop->relays + i);
+  return frames;
+}
+
+/* The virtual device whose force feedback 'ptr' (epoll data) stands for,
+   or NULL. */
+static struct scxrelay_sink_s *
+scxrelay_ff_owner (void *ptr)
+{
+  int i, j;
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  if (ptr == &(loop->relays[i].sinks[j].ff))
+	    return loop->relays[i].sinks + j;
+	}
+    }
+  return NULL;
+}
+
+/* epoll backend: one epoll instance watches the sources of every relay,
+   their uinput fds for force feedback, the signalfd and the inotify fd; each wakeup services all that are ready.
+   The wait has no timeout, so an idle relay does not wake up at all. */
+static int
+scxrelay_epoll_loop ()
+{
+  int res, i, j, nfds = 3;
+  struct epoll_event ready[(1 + SCXRELAY_MAX_SINKS) * SCXRELAY_MAX_RELAYS + 3];
+  struct epoll_event epev;
+  unsigned long long frames;
+  struct scxrelay_sink_s *sink;
+  scxrelay_t *inst;
+
+  loop->write_frame = scxrelay_epoll_write_frame;
+  if (loop->writer)
+    scxrelay_writers_start ();
+  loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  die_on_negative (loop->epfd);
+  epev.events = EPOLLIN;
+  epev.data.ptr = &(loop->sigfd);
+  die_on_negative (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->sigfd, &epev));
+  epev.data.ptr = &(loop->notifyfd);
+  die_on_negative (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->notifyfd,
+			      &epev));
+  if (loop->rate)
+    {
+      epev.data.ptr = &(loop->timerfd);
+      die_on_negative (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->timerfd,
+				  &epev));
+    }
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      scxrelay_watch (loop->relays + i);
+      nfds += 1 + loop->relays[i].nsinks;
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  sink = loop->relays[i].sinks + j;
+	  if (!sink->has_ff)
+	    continue;
+	  epev.data.ptr = &(sink->ff);
+	  die_on_negative (epoll_ctl (loop->epfd, EPOLL_CTL_ADD,
+				      sink->uinputfd, &epev));
+	}
+    }
+
+  /* main loop */
+  while (!loop->halt)
+    {
+      frames = scxrelay_frames_relayed ();
+      res = epoll_wait (loop->epfd, ready, nfds, -1);
+      loop->polls++;
+
+      for (i = 0; i < res; i++)
+	{
+	  if (ready[i].data.ptr == &(loop->sigfd))
+	    {
+	      scxrelay_handle_signals ();
+	      continue;
+	    }
+	  if (ready[i].data.ptr == &(loop->notifyfd))
+	    {
+	      scxrelay_handle_notify ();
+	      continue;
+	    }
+	  if (ready[i].data.ptr == &(loop->timerfd))
+	    {
+	      scxrelay_handle_tick ();
+	      continue;
+	    }
+	  sink = scxrelay_ff_owner (ready[i].data.ptr);
+	  if (sink)
+	    {
+	      scxrelay_handle_ff (sink);
+	      continue;
+	    }
+	  inst = ready[i].data.ptr;
+	  /* On EPOLLHUP/EPOLLERR too, the read tells end-of-file (pipe)
+	     from an unplugged device (ENODEV). */
+	  if (loop->per_event)
+	    scxrelay_copy_event (inst);
+	  else
+	    scxrelay_copy_frames (inst);
+	  if (inst->state == SCXSTATE_FAILED)
+	    {
+	      /* presumably disconnect. */
+	      scxrelay_unwatch (inst);
+	      scxrelay_recover (inst);
+	    }
+	}
+      scxrelay_merge_flush ();	/* --merge: every ready source is read. */
+      if ((scxrelay_frames_relayed () == frames) && !loop->halt)
+	loop->idle_wakeups++;
+      scxrelay_metrics_publish ();
+    }
+
+  /* loop cleanup */
+  close (loop->epfd);
+
+  return 0;
+}
+
+
+/** io_uring backend **/
+
+static int
+scxrelay_uring_enter (unsigned to_submit, unsigned min_complete,
+		      unsigned flags)
+{
+  loop->polls++;
+  return syscall (__NR_io_uring_enter, loop->uring.fd, to_submit,
+		  min_complete, flags, NULL, 0);
+}
+
+/* Create the ring, optionally with SQPOLL.
+   Returns 0 on success, -1 on failure (then see errno). */
+static int
+scxrelay_uring_setup (int sqpoll)
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  struct io_uring_params params;
+  int fd;
+
+  memset (&params, 0, sizeof (params));
+  if (sqpoll)
+    {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = 1000;	/* ms of idling before the thread sleeps. */
+    }
+  fd = syscall (__NR_io_uring_setup, SCXRELAY_URING_ENTRIES, &params);
+  if ((fd < 0) && sqpoll)
+    {
+      relay_logmsg (1, _("io_uring SQPOLL unavailable, submitting by syscall.\n"));
+      return scxrelay_uring_setup (0);
+    }
+  if (fd < 0)
+    return -1;
+  if (sqpoll && !(params.features & IORING_FEAT_SQPOLL_NONFIXED))
+    {
+      /* old kernel: SQPOLL would need registered files. */
+      close (fd);
+      return scxrelay_uring_setup (0);
+    }
+
+  memset (ring, 0, sizeof (*ring));
+  ring->fd = fd;
+  ring->sqpoll = sqpoll;
+  ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_ring_sz = params.cq_off.cqes
+    + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_sz > ring->sq_ring_sz)
+	ring->sq_ring_sz = ring->cq_ring_sz;
+      ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+  ring->sq_ring = mmap (NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail;
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      ring->cq_ring = ring->sq_ring;
+    }
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+	goto fail;
+    }
+  ring->sqes_sz = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+#define RINGPTR(base, off) ((unsigned *) ((char *) (base) + (off)))
+  ring->sq_head = RINGPTR (ring->sq_ring, params.sq_off.head);
+  ring->sq_tail = RINGPTR (ring->sq_ring, params.sq_off.tail);
+  ring->sq_mask = RINGPTR (ring->sq_ring, params.sq_off.ring_mask);
+  ring->sq_flags = RINGPTR (ring->sq_ring, params.sq_off.flags);
+  ring->sq_array = RINGPTR (ring->sq_ring, params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = RINGPTR (ring->cq_ring, params.cq_off.head);
+  ring->cq_tail = RINGPTR (ring->cq_ring, params.cq_off.tail);
+  ring->cq_mask = RINGPTR (ring->cq_ring, params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring
+					 + params.cq_off.cqes);
+#undef RINGPTR
+
+  return 0;
+
+fail:
+  close (fd);
+  ring->fd = -1;
+  return -1;
+}
+
+static void
+scxrelay_uring_teardown ()
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+
+  if (ring->fd < 0)
+    return;
+  munmap (ring->sqes, ring->sqes_sz);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_sz);
+  munmap (ring->sq_ring, ring->sq_ring_sz);
+  close (ring->fd);
+  ring->fd = -1;
+}
+
+/* No read follows the writes queued so far (a resync on unplug, a tick):
+   end their chain, so the next SQE does not wait on them. */
+static void
+scxrelay_uring_end_link ()
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+
+  if (ring->link)
+    ring->link->flags &= ~IOSQE_IO_LINK;
+  ring->link = NULL;
+}
+
+/* Publish filled SQEs to the kernel; optionally wait for a completion that
+   is not a uinput write (those finish on their own, so waiting for them
+   would only add a wakeup), unless latency tracking needs to see each write
+   return as it happens.  With SQPOLL, submission costs a syscall only
+   to wake an idle poller. */
+static int
+scxrelay_uring_submit (int wait)
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  unsigned flags = 0, to_submit = ring->sq_pending;
+
+  scxrelay_uring_end_link ();
+  ring->sq_pending = 0;
+  if (ring->sqpoll)
+    {
+      to_submit = 0;
+      if (__atomic_load_n (ring->sq_flags, __ATOMIC_ACQUIRE)
+	  & IORING_SQ_NEED_WAKEUP)
+	flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+  if (wait)
+    flags |= IORING_ENTER_GETEVENTS;
+  if (!to_submit && !flags)
+    return 0;
+  if (!wait)
+    return scxrelay_uring_enter (to_submit, 0, flags);
+  return scxrelay_uring_enter (to_submit,
+			       loop->latency ? 1 : ring->writes_inflight + 1,
+			       flags);
+}
+
+/* Next free submission queue entry, zeroed.  Submits when the queue is full. */
+static struct io_uring_sqe *
+scxrelay_uring_get_sqe ()
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  struct io_uring_sqe *sqe;
+  unsigned tail = *ring->sq_tail;
+  unsigned idx;
+
+  while (tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE)
+	 >= ring->sq_entries)
+    {
+      scxrelay_uring_submit (0);
+    }
+  idx = tail & *ring->sq_mask;
+  sqe = ring->sqes + idx;
+  memset (sqe, 0, sizeof (*sqe));
+  ring->sq_array[idx] = idx;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->sq_pending++;
+  return sqe;
+}
+
+/* Tags in the low bits of user_data (relays and their sinks are at least
+   8-aligned). */
+#define SCXRELAY_OP_READ 1
+#define SCXRELAY_OP_WRITE 2
+#define SCXRELAY_OP_SIGNAL 3
+#define SCXRELAY_OP_NOTIFY 4
+#define SCXRELAY_OP_TICK 5
+#define SCXRELAY_OP_FF 6
+#define SCXRELAY_OP_MASK 7
+
+/* Keep a read posted on the source, appending to evbuf.  When frames of
+   the previous read are still being written, the read is linked behind
+   them, so the source is read again only once they are out. */
+static void
+scxrelay_uring_post_read (scxrelay_t *inst)
+{
+  struct io_uring_sqe *sqe = scxrelay_uring_get_sqe ();
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = inst->srcfd;
+  sqe->addr = (uintptr_t) ((char *) inst->evbuf + inst->evbytes);
+  sqe->len = sizeof (inst->evbuf) - inst->evbytes;
+  sqe->off = -1;		/* current file position; for pipes too. */
+  sqe->user_data = (uintptr_t) inst | SCXRELAY_OP_READ;
+  loop->uring.link = NULL;	/* the read closes the chain. */
+  inst->stats.reads++;
+}
+
+static int scxrelay_uring_wait_writes (struct scxrelay_sink_s *sink);
+
+/* Backend write path (io_uring): queue a write SQE linked to the next one;
+   the writes of a frame to every device go out in the same submission.
+   Frames are copied to the sink's wrbuf, since evbuf is compacted right
+   after (and the next sink may transform the frame differently); wrbuf is
+   free again once every write queued from it is complete. */
+static int
+scxrelay_uring_write_frame (struct scxrelay_sink_s *sink,
+			    struct input_event *frame, int nev)
+{
+  struct io_uring_sqe *sqe;
+  struct input_event *dst;
+
+  if (sink->uinputfd < 0)
+    return scxrelay_epoll_write_frame (sink, frame, nev);	/* in place. */
+  if ((sink->wrcount + nev > SCXRELAY_WRBUF_COUNT)
+      || (sink->wrsyn_count == SCXRELAY_WRBUF_COUNT))
+    {
+      /* no room: rather than lose the frame, wait for the writes. */
+      if (scxrelay_uring_wait_writes (sink) < 0)
+	return -1;
+    }
+  dst = sink->wrbuf + sink->wrcount;
+  sqe = scxrelay_uring_get_sqe ();
+  memcpy (dst, frame, nev * sizeof (*frame));
+  sink->wrcount += nev;
+  sink->wrsyn[(sink->wrsyn_head + sink->wrsyn_count++)
+	      % SCXRELAY_WRBUF_COUNT] = dst + nev - 1;
+
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = sink->uinputfd;
+  sqe->addr = (uintptr_t) dst;
+  sqe->len = nev * sizeof (*frame);
+  sqe->off = -1;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = (uintptr_t) sink | SCXRELAY_OP_WRITE;
+  loop->uring.link = sqe;
+  loop->uring.writes_inflight++;
+  sink->relay->stats.writes++;
+  return sqe->len;
+}
+
+/* Arm a one-shot poll on the signalfd, inotify fd, timerfd or a uinput fd
+   ('tag' tells which: the op, ORed with the sink for SCXRELAY_OP_FF). */
+static void
+scxrelay_uring_post_poll (int fd, uint64_t tag)
+{
+  struct io_uring_sqe *sqe;
+
+  scxrelay_uring_end_link ();
+  sqe = scxrelay_uring_get_sqe ();
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = tag;
+}
+
+static void
+scxrelay_uring_complete (struct io_uring_cqe *cqe)
+{
+  void *ptr = (void *) (uintptr_t) (cqe->user_data
+				    & ~(uint64_t) SCXRELAY_OP_MASK);
+  scxrelay_t *inst = ptr;	/* SCXRELAY_OP_READ */
+  struct scxrelay_sink_s *sink = ptr;	/* SCXRELAY_OP_WRITE, _FF */
+  struct input_event *syn;
+
+  switch (cqe->user_data & SCXRELAY_OP_MASK)
+    {
+    case SCXRELAY_OP_READ:
+      if (cqe->res > 0)
+	{
+	  scxrelay_split_frames (inst, cqe->res);
+	  scxrelay_uring_post_read (inst);
+	}
+      else if (cqe->res == 0)
+	{
+	  /* source closed/disappeared. */
+	  loop->halt = 1;
+	}
+      else if (cqe->res == -ECANCELED)
+	{
+	  /* a linked write failed ahead of it. */
+	  scxrelay_uring_post_read (inst);
+	}
+      else
+	{
+	  scxrelay_read_failed (inst, -cqe->res);
+	  if (inst->state == SCXSTATE_FAILED)
+	    {
+	      scxrelay_unwatch (inst);
+	      scxrelay_recover (inst);
+	    }
+	}
+      break;
+    case SCXRELAY_OP_WRITE:
+      loop->uring.writes_inflight--;
+      if ((cqe->res < 0) && (cqe->res != -ECANCELED))
+	{
+	  errno = -cqe->res;
+	  scxrelay_check_write (sink->relay, -1);
+	}
+      /* linked writes complete in submission order. */
+      syn = sink->wrsyn[sink->wrsyn_head];
+      sink->wrsyn_head = (sink->wrsyn_head + 1) % SCXRELAY_WRBUF_COUNT;
+      sink->wrsyn_count--;
+      if (loop->latency && (cqe->res > 0) && scxrelay_sink_last (sink)
+	  && (syn->type == EV_SYN) && (syn->code == SYN_REPORT))
+	{
+	  scxhist_record (&(sink->relay->latency), scxhist_since (syn));
+	}
+      if (!sink->wrsyn_count)
+	sink->wrcount = 0;	/* every write from wrbuf is done. */
+      break;
+    case SCXRELAY_OP_SIGNAL:
+      scxrelay_handle_signals ();
+      scxrelay_uring_post_poll (loop->sigfd, SCXRELAY_OP_SIGNAL);
+      break;
+    case SCXRELAY_OP_NOTIFY:
+      scxrelay_handle_notify ();
+      scxrelay_uring_post_poll (loop->notifyfd, SCXRELAY_OP_NOTIFY);
+      break;
+    case SCXRELAY_OP_TICK:
+      scxrelay_handle_tick ();
+      scxrelay_uring_post_poll (loop->timerfd, SCXRELAY_OP_TICK);
+      break;
+    case SCXRELAY_OP_FF:
+      scxrelay_handle_ff (sink);
+      scxrelay_uring_post_poll (sink->uinputfd,
+				(uintptr_t) sink | SCXRELAY_OP_FF);
+      break;
+    }
+}
+
+/* The wrbuf of 'sink' is full: submit what is queued and wait until every
+   write from it is complete.  Write completions reaped meanwhile are
+   handled at once; the others are set aside for the loop, which is in the
+   middle of handling one.  Returns 0 once wrbuf is free, -1 on failure
+   (then see errno). */
+static int
+scxrelay_uring_wait_writes (struct scxrelay_sink_s *sink)
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  sink->relay->stats.write_waits++;
+  scxrelay_uring_submit (0);
+  while (sink->wrsyn_count)
+    {
+      head = *ring->cq_head;
+      if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  if ((scxrelay_uring_enter (0, 1, IORING_ENTER_GETEVENTS) < 0)
+	      && (errno != EINTR))
+	    return -1;
+	  continue;
+	}
+      cqe = ring->cqes + (head & *ring->cq_mask);
+      if ((cqe->user_data & SCXRELAY_OP_MASK) == SCXRELAY_OP_WRITE)
+	scxrelay_uring_complete (cqe);
+      else
+	{
+	  if (ring->naside == SCXRELAY_URING_ASIDE)
+	    {
+	      /* make room: drop what the loop has handled already. */
+	      memmove (ring->aside, ring->aside + ring->aside_next,
+		       (ring->naside - ring->aside_next) * sizeof (*cqe));
+	      ring->naside -= ring->aside_next;
+	      ring->aside_next = 0;
+	    }
+	  if (ring->naside == SCXRELAY_URING_ASIDE)
+	    {
+	      errno = ENOBUFS;
+	      return -1;
+	    }
+	  ring->aside[ring->naside++] = *cqe;
+	}
+      __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+  return 0;
+}
+
+/* Handle every completion: those set aside first, then the ring's.  Each
+   is taken off the ring before it is handled, so that a handler waiting
+   on its sink's writes (scxrelay_uring_wait_writes()) reaps only new
+   ones. */
+static void
+scxrelay_uring_reap ()
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  struct io_uring_cqe cqe;
+  unsigned head;
+
+  for (;;)
+    {
+      if (ring->aside_next < ring->naside)
+	cqe = ring->aside[ring->aside_next++];
+      else
+	{
+	  ring->naside = ring->aside_next = 0;
+	  head = *ring->cq_head;
+	  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+	    break;
+	  cqe = ring->cqes[head & *ring->cq_mask];
+	  __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	}
+      scxrelay_uring_complete (&cqe);
+    }
+}
+
+/* io_uring backend: every source has a read posted at all times; each
+   completed read is split into frames, and their writes (to every virtual
+   device of the source) go out as linked SQEs together with the next read
+   in a single submission.  Polls on the
+   signalfd, inotify fd and uinput fds (rumble) complete the rest of the
+   wakeups.  */
+static int
+scxrelay_uring_loop ()
+{
+  struct scxrelay_uring_s *ring = &(loop->uring);
+  unsigned long long frames;
+  struct scxrelay_sink_s *sink;
+  unsigned head, tail;
+  int i, j, res, wait;
+
+  loop->write_frame = scxrelay_uring_write_frame;
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      /* io_uring arms its own poll; a non-blocking fd would only EAGAIN. */
+      fcntl (loop->relays[i].srcfd, F_SETFL,
+	     fcntl (loop->relays[i].srcfd, F_GETFL) & ~O_NONBLOCK);
+      scxrelay_watch (loop->relays + i);
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  sink = loop->relays[i].sinks + j;
+	  if (sink->has_ff)
+	    scxrelay_uring_post_poll (sink->uinputfd,
+				      (uintptr_t) sink | SCXRELAY_OP_FF);
+	}
+    }
+  scxrelay_uring_post_poll (loop->sigfd, SCXRELAY_OP_SIGNAL);
+  scxrelay_uring_post_poll (loop->notifyfd, SCXRELAY_OP_NOTIFY);
+  if (loop->rate)
+    scxrelay_uring_post_poll (loop->timerfd, SCXRELAY_OP_TICK);
+
+  while (!loop->halt)
+    {
+      /* Submit what is queued; block only when nothing has completed. */
+      frames = scxrelay_frames_relayed ();
+      head = *ring->cq_head;
+      tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+      wait = (head == tail);
+      res = scxrelay_uring_submit (wait);
+      if ((res < 0) && (errno != EINTR) && (errno != EBUSY))
+	{
+	  relay_logmsg (1, _("io_uring_enter: %s\n"), strerror (errno));
+	  loop->halt = 1;
+	}
+
+      scxrelay_uring_reap ();
+      if (wait && (scxrelay_frames_relayed () == frames) && !loop->halt)
+	loop->idle_wakeups++;
+      scxrelay_metrics_publish ();
+    }
+
+  scxrelay_uring_teardown ();
+
+  return 0;
+}
+
+/** Recording and replay **/
+
+/* Start a recording of the source of 'inst': its capabilities, and every
+   event as it was read, before --coalesce, SYN_DROPPED repair, --drop,
+   --map and the devices' transforms, so that a replay goes through them
+   just once.  Writes are buffered by
+   stdio, so the hot path costs a memcpy per frame.
+   Returns 0 on success, -1 on failure (then see errno). */
+int
+scxrelay_record_open (scxrelay_t *inst, const char *path)
+{
+  const struct relay_caps_s *caps = &(inst->caps);
+  struct scxrec_header_s hdr;
+
+  inst->record = fopen (path, "w");
+  if (!inst->record)
+    return -1;
+  setvbuf (inst->record, NULL, _IOFBF, 1 << 16);
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, SCXREC_MAGIC, sizeof (hdr.magic));
+  hdr.version = SCXREC_VERSION;
+  hdr.header_size = sizeof (hdr);
+  hdr.event_size = sizeof (struct input_event);
+  hdr.id = caps->id;
+  memcpy (hdr.name, caps->name, sizeof (hdr.name));
+  memcpy (hdr.have_ev, caps->have_ev, sizeof (hdr.have_ev));
+  memcpy (hdr.have_abs, caps->have_abs, sizeof (hdr.have_abs));
+  memcpy (hdr.have_key, caps->have_key, sizeof (hdr.have_key));
+  memcpy (hdr.absinfo, caps->absinfo, sizeof (hdr.absinfo));
+  if (fwrite (&hdr, sizeof (hdr), 1, inst->record) != 1)
+    return -1;
+  return 0;
+}
+
+void
+scxrelay_record_close (scxrelay_t *inst)
+{
+  if (inst->record)
+    fclose (inst->record);
+  inst->record = NULL;
+}
+
+/* Map a recording.  On success returns the header and sets *events and
+   *len to the event records; returns NULL for a file that is not a
+   recording (a raw stream, for --bench), or on error with errno set. */
+static const struct scxrec_header_s *
+scxrelay_map_recording (const char *path, const char **events, size_t *len)
+{
+  const struct scxrec_header_s *hdr;
+  struct stat st;
+  char *data;
+  int fd;
+
+  *events = NULL;
+  *len = 0;
+  fd = open (path, O_RDONLY);
+  if ((fd < 0) || (fstat (fd, &st) < 0))
+    return NULL;
+  if (st.st_size == 0)
+    {
+      close (fd);
+      errno = ENODATA;
+      return NULL;
+    }
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  hdr = (const struct scxrec_header_s *) data;
+  if ((st.st_size < (off_t) sizeof (*hdr))
+      || memcmp (hdr->magic, SCXREC_MAGIC, sizeof (hdr->magic)))
+    {
+      /* raw input_event stream. */
+      *events = data;
+      *len = st.st_size;
+      errno = 0;
+      return NULL;
+    }
+  if ((hdr->event_size != sizeof (struct input_event))
+      || (hdr->header_size > st.st_size))
+    {
+      munmap (data, st.st_size);
+      errno = EPROTO;
+      return NULL;
+    }
+  *events = data + hdr->header_size;
+  *len = st.st_size - hdr->header_size;
+  return hdr;
+}
+
+/* Feeder for a replay: write the recorded events into 'fd' with their
+   original spacing (or back-to-back when 'fast'), each frame in one write,
+   with its recorded time, or when 'restamp' (for --latency) the current
+   CLOCK_MONOTONIC time. */
+static void
+scxrelay_replay_feed (int fd, const char *data, size_t len, int fast,
+		      int restamp)
+{
+  const struct input_event *ev = (const struct input_event *) data;
+  const struct input_event *end = ev + len / sizeof (*ev);
+  const struct input_event *start;
+  struct input_event frame[SCXRELAY_EVBUF_COUNT];
+  struct timespec t0, due, now;
+  long long rec0, offset;
+  int n;
+
+  if (ev == end)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  rec0 = ev->time.tv_sec * 1000000LL + ev->time.tv_usec;
+  while (ev < end)
+    {
+      /* one frame, up to SYN_REPORT. */
+      for (start = ev; ev < end; ev++)
+	{
+	  if ((ev->type == EV_SYN) && (ev->code == SYN_REPORT))
+	    {
+	      ev++;
+	      break;
+	    }
+	  if (ev + 1 - start == SCXRELAY_EVBUF_COUNT)
+	    break;
+	}
+      n = ev - start;
+      if (!fast)
+	{
+	  offset = (start[n - 1].time.tv_sec * 1000000LL
+		    + start[n - 1].time.tv_usec - rec0) * 1000;
+	  due.tv_sec = t0.tv_sec + (t0.tv_nsec + offset) / 1000000000LL;
+	  due.tv_nsec = (t0.tv_nsec + offset) % 1000000000LL;
+	  clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+	}
+      memcpy (frame, start, n * sizeof (*start));
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      for (--n; restamp && (n >= 0); n--)
+	{
+	  frame[n].time.tv_sec = now.tv_sec;
+	  frame[n].time.tv_usec = now.tv_nsec / 1000;
+	}
+      if (write (fd, frame, (ev - start) * sizeof (*start)) < 0)
+	return;
+    }
+}
+
+/* Set up 'inst' to relay a recording: capabilities come from the file,
+   events from a pipe fed by a child process, so every backend relays a
+   replay exactly like a device.  EOF of the pipe ends the relay.
+   Returns 0 on success, -1 on failure (then see errno). */
+int
+scxrelay_replay_open (scxrelay_t *inst, const char *path)
+{
+  const struct scxrec_header_s *hdr;
+  const char *events;
+  size_t len;
+  int pfd[2];
+
+  hdr = scxrelay_map_recording (path, &events, &len);
+  if (!hdr)
+    {
+      if (events)
+	{
+	  /* a raw stream has no capabilities to create a device from. */
+	  munmap ((void *) events, len);
+	  errno = EPROTO;
+	}
+      return -1;
+    }
+  inst->source = &scxsource_pipe;
+  inst->replay = events;
+  inst->replay_len = len;
+
+  inst->caps.id = hdr->id;
+  memcpy (inst->caps.name, hdr->name, sizeof (inst->caps.name));
+  memcpy (inst->caps.have_ev, hdr->have_ev, sizeof (hdr->have_ev));
+  memcpy (inst->caps.have_abs, hdr->have_abs, sizeof (hdr->have_abs));
+  memcpy (inst->caps.have_key, hdr->have_key, sizeof (hdr->have_key));
+  memcpy (inst->caps.absinfo, hdr->absinfo, sizeof (hdr->absinfo));
+
+  if (pipe (pfd) < 0)
+    return -1;
+  inst->replay_pid = fork ();
+  if (inst->replay_pid < 0)
+    return -1;
+  if (inst->replay_pid == 0)
+    {
+      close (pfd[0]);
+      scxrelay_replay_feed (pfd[1], inst->replay, inst->replay_len,
+			    loop->replay_fast, loop->latency);
+      _exit (EXIT_SUCCESS);
+    }
+  close (pfd[1]);
+  inst->srcfd = pfd[0];
+  return 0;
+}
+
+
+/** Real-time mode (--rt, --cpu, --mlock) **/
+
+#define SCXRELAY_PREFAULT_STACK (256 * 1024)
+
+/* Read this thread's schedstat: time spent waiting on a run queue (ns),
+   and number of times it was run.  Returns -1 where not available. */
+static int
+scxrelay_schedstat (unsigned long long *delay, unsigned long long *runs)
+{
+  unsigned long long cputime;
+  FILE *fp;
+  int n;
+
+  fp = fopen ("/proc/thread-self/schedstat", "r");
+  if (!fp)
+    return -1;
+  n = fscanf (fp, "%llu %llu %llu", &cputime, delay, runs);
+  fclose (fp);
+  return (n == 3) ? 0 : -1;
+}
+
+/* Touch the stack the loop will use, so growing it never faults. */
+static void __attribute__ ((noinline))
+scxrelay_prefault_stack ()
+{
+  volatile char stack[SCXRELAY_PREFAULT_STACK];
+
+  memset ((char *) stack, 0, sizeof (stack));
+}
+
+/* Apply --cpu, --mlock and --rt before entering the loop.  Failures are
+   reported, and the relay carries on under the default policy. */
+static void
+scxrelay_realtime_setup ()
+{
+  struct sched_param param = { 0, };
+  cpu_set_t cpus;
+
+  if (loop->cpu >= 0)
+    {
+      CPU_ZERO (&(loop->writer_cpus));
+      sched_getaffinity (0, sizeof (loop->writer_cpus), &(loop->writer_cpus));
+      CPU_CLR (loop->cpu, &(loop->writer_cpus));
+      if (!CPU_COUNT (&(loop->writer_cpus)))
+	CPU_SET (loop->cpu, &(loop->writer_cpus));	/* nowhere else. */
+      CPU_ZERO (&cpus);
+      CPU_SET (loop->cpu, &cpus);
+      if (sched_setaffinity (0, sizeof (cpus), &cpus) < 0)
+	perror (_("--cpu"));
+    }
+  if (loop->mlock)
+    {
+      /* keep freed heap mapped: no page faults from later allocations. */
+      mallopt (M_TRIM_THRESHOLD, -1);
+      mallopt (M_MMAP_MAX, 0);
+      /* MCL_CURRENT also faults in the relay buffers (static storage). */
+      if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+	perror (_("--mlock"));
+      scxrelay_prefault_stack ();
+    }
+  if (loop->rt_prio)
+    {
+      param.sched_priority = loop->rt_prio;
+      if (sched_setscheduler (0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) < 0)
+	perror (_("--rt"));
+    }
+}
+
+/* Run the event loop of the selected backend. */
+static int
+scxrelay_run_backend ()
+{
+  if (loop->coalesce && loop->per_event)
+    relay_logmsg (1, _("--coalesce has no effect with --per-event.\n"));
+  if (loop->rate && loop->per_event)
+    {
+      relay_logmsg (1, _("--rate relays whole frames; ignoring --per-event.\n"));
+      loop->per_event = 0;
+    }
+  if (loop->writer && loop->per_event)
+    {
+      relay_logmsg (1, _("--writer relays whole frames; ignoring --per-event.\n"));
+      loop->per_event = 0;
+    }
+  if (loop->merge && loop->per_event)
+    {
+      relay_logmsg (1, _("--merge relays whole frames; ignoring --per-event.\n"));
+      loop->per_event = 0;
+    }
+  if ((loop->backend != SCXBACKEND_EPOLL) && loop->merge)
+    {
+      /* io_uring links each source's writes behind its own read. */
+      relay_logmsg (1, _("--merge needs the epoll backend.\n"));
+      loop->backend = SCXBACKEND_EPOLL;
+    }
+  if ((loop->backend != SCXBACKEND_EPOLL) && loop->per_event)
+    {
+      relay_logmsg (1, _("--per-event needs the epoll backend.\n"));
+      loop->backend = SCXBACKEND_EPOLL;
+    }
+  if ((loop->backend != SCXBACKEND_EPOLL) && loop->writer)
+    {
+      /* io_uring writes are asynchronous already. */
+      relay_logmsg (1, _("--writer needs the epoll backend.\n"));
+      loop->backend = SCXBACKEND_EPOLL;
+    }
+  if (loop->backend != SCXBACKEND_EPOLL)
+    {
+      if (scxrelay_uring_setup (loop->sqpoll) == 0)
+	{
+	  loop->backend = SCXBACKEND_URING;
+	  return scxrelay_uring_loop ();
+	}
+      if (loop->backend == SCXBACKEND_URING)
+	perror (_("io_uring unavailable, using epoll"));
+      loop->backend = SCXBACKEND_EPOLL;
+    }
+
+  return scxrelay_epoll_loop ();
+}
+
+/* Main loop, intended to be terminated with SIGINT (Control-C), SIGTERM or
+   SIGHUP.  Runs the selected backend; io_uring falls back to epoll when
+   missing.  Signals and reconnects both arrive as fd events, so the loop
+   blocks without a timeout.
+   Returns shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE).
+ */
+int
+scxrelay_mainloop ()
+{
+  sigset_t mask, oldmask;
+  unsigned long long delay0, runs0, delay1, runs1;
+  int res, i;
+
+  /* Signals are read from a signalfd instead of interrupting syscalls. */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGHUP);
+  if (loop->latency)
+    sigaddset (&mask, SIGUSR1);
+  sigprocmask (SIG_BLOCK, &mask, &oldmask);
+  loop->sigfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  die_on_negative (loop->sigfd);
+  loop->notifyfd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  die_on_negative (loop->notifyfd);
+  if (loop->rate)
+    {
+      /* armed only while a snapshot has changes to send. */
+      loop->timerfd = timerfd_create (CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+      die_on_negative (loop->timerfd);
+      loop->timer_armed = 0;
+      clock_gettime (CLOCK_MONOTONIC, &(loop->tick_origin));
+      for (i = 0; i < loop->nrelays; i++)
+	{
+	  if (!loop->relays[i].resample)
+	    die_on_negative (scxrelay_resample_init (loop->relays + i));
+	}
+    }
+
+  scxrelay_realtime_setup ();
+  if (scxrelay_schedstat (&delay0, &runs0) == 0)
+    {
+      res = scxrelay_run_backend ();
+      if (scxrelay_schedstat (&delay1, &runs1) == 0)
+	{
+	  loop->sched_delay += delay1 - delay0;
+	  loop->sched_runs += runs1 - runs0;
+	}
+    }
+  else
+    res = scxrelay_run_backend ();
+
+  close (loop->notifyfd);
+  loop->notifyfd = -1;
+  if (loop->rate)
+    {
+      /* the last state goes out too. */
+      for (i = 0; i < loop->nrelays; i++)
+	{
+	  while (loop->relays[i].resample && scxrelay_tick (loop->relays + i))
+	    ;
+	}
+      close (loop->timerfd);
+      loop->timerfd = -1;
+    }
+  scxrelay_writers_stop ();
+  for (i = 0; i < loop->nrelays; i++)
+    loop->relays[i].notify_wd = -1;
+  close (loop->sigfd);
+  loop->sigfd = -1;
+  sigprocmask (SIG_SETMASK, &oldmask, NULL);
+  return res;
+}
+
+/* Milliseconds elapsed since 't0' (CLOCK_MONOTONIC). */
+static double
+scxrelay_ms_since (const struct timespec *t0)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t0->tv_sec) * 1e3 + (now.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/* Tell the launcher the virtual devices are usable: their event nodes,
+   one per line, on --notify-fd, and READY=1 to the service manager when
+   NOTIFY_SOCKET is set (the sd_notify protocol).  Waits for udev first, so
+   the game finds each device set up; waits for nothing if nobody listens. */
+static void
+scxrelay_notify_ready ()
+{
+  const char *sock = getenv ("NOTIFY_SOCKET");
+  char node[PATH_MAX], nodes[SCXRELAY_MAX_RELAYS * SCXRELAY_MAX_SINKS * 64];
+  char msg[sizeof (nodes) + 64];
+  struct sockaddr_un sa;
+  int i, j, fd, len = 0;
+
+  if ((loop->ready_fd < 0) && !sock)
+    return;
+  nodes[0] = 0;
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      for (j = 0; j < loop->relays[i].nsinks; j++)
+	{
+	  if (!loop->relays[i].sinks[j].ops->device)
+	    continue;		/* no node to announce. */
+	  node[0] = 0;
+	  if (relay_device_node (loop->relays[i].sinks[j].uinputfd, node,
+				 sizeof (node), SCXRELAY_READY_TIMEOUT) < 0)
+	    relay_logmsg (1, _("%s: virtual device not confirmed ready: %s\n"),
+			  loop->relays[i].event_path, strerror (errno));
+	  if (node[0] && (len < (ssize_t) sizeof (nodes)))
+	    len += snprintf (nodes + len, sizeof (nodes) - len, "%s\n", node);
+	}
+    }
+  if (len > (ssize_t) sizeof (nodes) - 1)
+    len = sizeof (nodes) - 1;
+
+  if (loop->ready_fd >= 0)
+    {
+      if (write (loop->ready_fd, nodes, len) < 0)
+	perror (_("--notify-fd"));
+      /* Reader sees end of file; the fd number stays taken. */
+      fd = open ("/dev/null", O_WRONLY);
+      dup2 (fd, loop->ready_fd);
+      close (fd);
+      loop->ready_fd = -1;
+    }
+
+  if (sock && ((sock[0] == '/') || (sock[0] == '@')))
+    {
+      memset (&sa, 0, sizeof (sa));
+      sa.sun_family = AF_UNIX;
+      strncpy (sa.sun_path, sock, sizeof (sa.sun_path) - 1);
+      if (sock[0] == '@')
+	sa.sun_path[0] = 0;	/* abstract namespace. */
+      for (i = 0; nodes[i]; i++)
+	if (nodes[i] == '\n')
+	  nodes[i] = (nodes[i + 1]) ? ' ' : 0;
+      len = snprintf (msg, sizeof (msg), "READY=1\nSTATUS=Relaying to %s",
+		      nodes);
+      fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if ((fd < 0)
+	  || (sendto (fd, msg, len, 0, (struct sockaddr *) &sa,
+		      offsetof (struct sockaddr_un, sun_path) + strlen (sock)) < 0))
+	perror (_("NOTIFY_SOCKET"));
+      if (fd >= 0)
+	close (fd);
+    }
+}
+
+/* Runs after resolving event_device and uinput_device (options).
+   Return shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE).  */
+int
+scxrelay_main ()
+{
+  int i;
+  char path[PATH_MAX];
+
+  if (loop->merge && (scxrelay_merge_connect () != 0))
+    {
+      scxrelay_disconnect (loop->relays);
+      return -1;
+    }
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      if (!loop->merge && (scxrelay_connect (loop->relays + i) != 0))
+	{
+	  while (i-- > 0)
+	    scxrelay_disconnect (loop->relays + i);
+	  return -1;
+	}
+    }
+  for (i = 0; loop->record_path && (i < loop->nrelays); i++)
+    {
+      /* each source on its own, --merge or not. */
+      if (loop->nrelays > 1)
+	snprintf (path, sizeof (path), "%s.%d", loop->record_path, i);
+      else
+	snprintf (path, sizeof (path), "%s", loop->record_path);
+      if (scxrelay_record_open (loop->relays + i, path) < 0)
+	perror (_(path));
+    }
+
+  if (loop->show_stats)
+    relay_logmsg (1, _("startup: %.2f ms from launch to UI_DEV_CREATE done\n"),
+		  scxrelay_ms_since (&(loop->launch)));
+  scxrelay_notify_ready ();
+  if (loop->metrics_path && (scxrelay_metrics_open () < 0))
+    perror (_(loop->metrics_path));
+
+  /* Keep formatting and stderr writes out of the relay path. */
+  if (relay_log_start () < 0)
+    perror (_("Starting log thread"));
+  scxrelay_mainloop ();
+  relay_log_stop ();
+  scxrelay_metrics_close ();
+
+  for (i = 0; i < loop->nrelays; i++)
+    {
+      scxrelay_disconnect (loop->relays + i);
+      scxrelay_record_close (loop->relays + i);
+      if (loop->relays[i].replay_pid > 0)
+	{
+	  kill (loop->relays[i].replay_pid, SIGTERM);
+	  waitpid (loop->relays[i].replay_pid, NULL, 0);
+	}
+    }
+  if (loop->show_stats)
+    scxrelay_print_stats ();
+  if (loop->latency)
+    scxrelay_print_latency ();
+  fputs ("", stdout);
+
+  return 0;
+}
+
+
+/** Benchmark **/
+
+static const char *scxbackend_names[] = { "epoll", "uring", "auto", NULL };
+
+/* Synthetic controller load for --synth. */
+struct scxsynth_s
+{
+  int rate;			/* frames per second (125 to 8000 typical). */
+  int frames;			/* frames to generate in total. */
+  int axes;			/* EV_ABS events per frame. */
+  int buttons;			/* EV_KEY events per frame. */
+  int burst;			/* frames written back-to-back, then a pause. */
+};
+
+/* Parse "rate=1000,frames=10000,axes=4,buttons=1,burst=1".
+   Returns 0 on success, -1 on an unknown key. */
+static int
+scxsynth_parse (struct scxsynth_s *synth, char *spec)
+{
+  char *item, *save = NULL, *eq;
+  int value;
+
+  synth->rate = 1000;
+  synth->frames = 10000;
+  synth->axes = 4;
+  synth->buttons = 1;
+  synth->burst = 1;
+  for (item = strtok_r (spec, ",", &save); item;
+       item = strtok_r (NULL, ",", &save))
+    {
+      eq = strchr (item, '=');
+      if (!eq)
+	return -1;
+      *eq = 0;
+      value = atoi (eq + 1);
+      if (value < 0)
+	return -1;
+      if (!strcmp (item, "rate"))
+	synth->rate = value;
+      else if (!strcmp (item, "frames"))
+	synth->frames = value;
+      else if (!strcmp (item, "axes"))
+	synth->axes = value;
+      else if (!strcmp (item, "buttons"))
+	synth->buttons = value;
+      else if (!strcmp (item, "burst"))
+	synth->burst = value;
+      else
+	return -1;
+    }
+  if ((synth->rate < 1) || (synth->burst < 1) || (synth->axes > 8)
+      || (synth->buttons > 16))
+    return -1;
+  return 0;
+}
+
+#define SCXSYNTH_FRAME_MAX (8 + 16 + 1)
+
+static const int scxsynth_axis_codes[8] = {
+  ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ, ABS_HAT0X, ABS_HAT0Y,
+};
+
+/* Frame number 'f' of the load (unstamped); returns its event count. */
+static int
+scxsynth_frame (const struct scxsynth_s *synth, int f,
+		struct input_event *frame)
+{
+  int n = 0, i;
+
+  memset (frame, 0, SCXSYNTH_FRAME_MAX * sizeof (*frame));
+  for (i = 0; i < synth->axes; i++, n++)
+    {
+      frame[n].type = EV_ABS;
+      frame[n].code = scxsynth_axis_codes[i];
+      frame[n].value = ((f * (i + 1) * 97) & 0xffff) - 32768;
+    }
+  for (i = 0; i < synth->buttons; i++, n++)
+    {
+      frame[n].type = EV_KEY;
+      frame[n].code = BTN_SOUTH + i;
+      frame[n].value = (f + i) & 1;
+    }
+  frame[n].type = EV_SYN;
+  frame[n].code = SYN_REPORT;
+  return n + 1;
+}
+
+/* Capabilities of a device producing the load: 16-bit axes. */
+static void
+scxsynth_caps (const struct scxsynth_s *synth, scxrelay_t *inst)
+{
+  int i, code;
+
+  inst->caps.have_ev[0] |= (1 << EV_SYN) | (1 << EV_KEY) | (1 << EV_ABS);
+  for (i = 0; i < synth->axes; i++)
+    {
+      code = scxsynth_axis_codes[i];
+      inst->caps.have_abs[code / 8] |= 1 << (code % 8);
+      inst->caps.absinfo[code].minimum = -32768;
+      inst->caps.absinfo[code].maximum = 32767;
+    }
+  for (i = 0; i < synth->buttons; i++)
+    {
+      code = BTN_SOUTH + i;
+      inst->caps.have_key[code / 8] |= 1 << (code % 8);
+    }
+}
+
+/* Generator: write synthetic frames into 'fd' at the configured rate, each
+   stamped with CLOCK_MONOTONIC just before its write, like the kernel. */
+static void
+scxsynth_feed (int fd, const struct scxsynth_s *synth)
+{
+  struct input_event frame[SCXSYNTH_FRAME_MAX];
+  struct timespec next, now;
+  long long period_ns = 1000000000LL / synth->rate;
+  int n, i, f;
+
+  clock_gettime (CLOCK_MONOTONIC, &next);
+  for (f = 0; f < synth->frames; f++)
+    {
+      if ((f % synth->burst) == 0)
+	{
+	  /* pace bursts so the average rate holds. */
+	  next.tv_nsec += period_ns * synth->burst;
+	  next.tv_sec += next.tv_nsec / 1000000000LL;
+	  next.tv_nsec %= 1000000000LL;
+	  clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+      n = scxsynth_frame (synth, f, frame);
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      for (i = 0; i < n; i++)
+	{
+	  frame[i].time.tv_sec = now.tv_sec;
+	  frame[i].time.tv_usec = now.tv_nsec / 1000;
+	}
+      if (write (fd, frame, n * sizeof (frame[0])) < 0)
+	return;
+    }
+}
+
+/* Feeder for a recorded stream: write it all at once. */
+static void
+scxrelay_bench_feed (int fd, const char *data, size_t len)
+{
+  ssize_t res;
+  size_t done;
+
+  for (done = 0; done < len; done += res)
+    {
+      res = write (fd, data + done, len - done);
+      if (res <= 0)
+	return;
+    }
+}
+
+/* Relay one workload through one backend, from a pipe fed by a child
+   process into an in-memory sink (memfd), and report throughput, CPU and
+   counters.  A synthetic workload (synth != NULL) also reports latency. */
+static void
+scxrelay_bench_run (enum scxbackend_e backend, const char *data, size_t len,
+		    const struct scxsynth_s *synth)
+{
+  scxrelay_t *inst = loop->relays + 0;
+  struct timespec t0, t1;
+  struct rusage ru0, ru1;
+  struct stat sink;
+  double elapsed, cpu;
+  unsigned long long frames, sunk = 0;
+  int pfd[2], i;
+  pid_t pid;
+
+  die_on_negative (pipe (pfd));
+  pid = fork ();
+  die_on_negative (pid);
+  if (pid == 0)
+    {
+      /* feeder: write the workload, then EOF ends the relay loop. */
+      close (pfd[0]);
+      if (synth)
+	scxsynth_feed (pfd[1], synth);
+      else
+	scxrelay_bench_feed (pfd[1], data, len);
+      _exit (EXIT_SUCCESS);
+    }
+  close (pfd[1]);
+
+  scxrelay_init (inst);
+  snprintf (inst->event_path, sizeof (inst->event_path), "bench");
+  inst->source = &scxsource_pipe;
+  inst->srcfd = pfd[0];
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      inst->sinks[i].ops = &scxsink_file;
+      inst->sinks[i].uinputfd = syscall (__NR_memfd_create, "scxrelay-sink", 0);
+      die_on_negative (inst->sinks[i].uinputfd);
+    }
+  if (synth)
+    {
+      /* transforms need axis ranges; a raw stream has none. */
+      scxsynth_caps (synth, inst);
+      die_on_negative (scxrelay_sinks_setup (inst, &(inst->caps)));
+    }
+  loop->nrelays = 1;
+  loop->halt = 0;
+  loop->polls = 0;
+  loop->idle_wakeups = 0;
+  loop->sched_delay = loop->sched_runs = 0;
+  loop->backend = backend;
+  loop->latency = (synth != NULL);
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  getrusage (RUSAGE_SELF, &ru0);
+  scxrelay_mainloop ();
+  getrusage (RUSAGE_SELF, &ru1);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  waitpid (pid, NULL, 0);
+
+  elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec)
+    + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec)
+    + ((ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec)
+       + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)) / 1e6;
+  frames = inst->stats.frames ? inst->stats.frames : 1;
+  relay_logmsg (1, _("== %s%s: %llu frames in %.3f s, %.0f events/s, %.0f frames/s, %.2f us CPU/frame\n"),
+		scxbackend_names[loop->backend],
+		(loop->backend == SCXBACKEND_URING) && loop->uring.sqpoll ? "+sqpoll" : "",
+		inst->stats.frames, elapsed, inst->stats.events / elapsed,
+		inst->stats.frames / elapsed, cpu * 1e6 / frames);
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      fstat (inst->sinks[i].uinputfd, &sink);
+      sunk += sink.st_size;
+    }
+  if (sunk != inst->stats.events * sizeof (struct input_event))
+    {
+      relay_logmsg (1, _("sinks hold %llu bytes, expected %llu\n"),
+		    sunk, inst->stats.events * sizeof (struct input_event));
+    }
+  scxrelay_print_stats ();
+  if (loop->latency)
+    scxrelay_print_latency ();
+
+  free (inst->resample);
+  close (inst->srcfd);
+  for (i = 0; i < inst->nsinks; i++)
+    {
+      scxxform_free (inst->sinks[i].xform);
+      close (inst->sinks[i].uinputfd);
+    }
+}
+
+/* The relay core alone on the synthetic load: the frames are read from
+   memory and written to in-memory sinks (ring with --sink=ring, else
+   null), on the virtual clock, so no syscall is made and nothing sleeps.
+   What it costs per frame is the relay's share of what the backends
+   report; the rest is the kernel's.  Output counts (--rate, --coalesce,
+   --drop) come out the same on every run. */
+static void
+scxrelay_bench_core (const struct scxsynth_s *synth)
+{
+  enum { CHUNK = 256 };		/* frames generated ahead, outside the timing. */
+  static struct input_event buf[CHUNK * SCXSYNTH_FRAME_MAX];
+  int start[CHUNK + 1];
+  scxrelay_t *inst = loop->relays + 0;
+  const struct scxsink_ops_s *ops;
+  long long period_ns = 1000000000LL / synth->rate, t, ns = 0;
+  struct timespec t0, t1;
+  unsigned long long sunk = 0;
+  int f, c, i, n;
+
+  ops = (loop->sink_ops == &scxsink_ring) ? &scxsink_ring : &scxsink_null;
+  scxrelay_init (inst);
+  snprintf (inst->event_path, sizeof (inst->event_path), "core");
+  inst->source = &scxsource_memory;
+  for (i = 0; i < inst->nsinks; i++)
+    inst->sinks[i].ops = ops;
+  scxsynth_caps (synth, inst);
+  loop->nrelays = 1;
+  loop->halt = 0;
+  loop->polls = 0;
+  loop->idle_wakeups = 0;
+  loop->sched_delay = loop->sched_runs = 0;
+  loop->latency = 0;
+  loop->write_frame = scxrelay_epoll_write_frame;
+  loop->vclock = 1;
+  loop->vclock_ns = 0;
+  loop->tick_origin.tv_sec = loop->tick_origin.tv_nsec = 0;
+  loop->timer_armed = 0;
+  die_on_negative (scxrelay_connect (inst));
+  if (loop->rate)
+    die_on_negative (scxrelay_resample_init (inst));
+
+  for (f = 0; f < synth->frames; f += c)
+    {
+      /* stamped as scxsynth_feed() would, on the virtual clock. */
+      c = (synth->frames - f < CHUNK) ? synth->frames - f : CHUNK;
+      for (i = start[0] = 0; i < c; i++)
+	{
+	  n = scxsynth_frame (synth, f + i, buf + start[i]);
+	  t = ((f + i) / synth->burst + 1) * period_ns * synth->burst;
+	  start[i + 1] = start[i] + n;
+	  for (n = start[i]; n < start[i + 1]; n++)
+	    {
+	      buf[n].time.tv_sec = t / 1000000000LL;
+	      buf[n].time.tv_usec = t % 1000000000LL / 1000;
+	    }
+	}
+
+      clock_gettime (CLOCK_MONOTONIC, &t0);
+      for (i = 0; i < c; i = n)
+	{
+	  /* one burst (or what of it is in this chunk) per "wakeup". */
+	  for (n = i + 1; (n < c) && ((f + n) % synth->burst); n++)
+	    ;
+	  scxclock_advance (((f + i) / synth->burst + 1) * period_ns * synth->burst);
+	  inst->mem = (const char *) (buf + start[i]);
+	  inst->mem_len = (start[n] - start[i]) * sizeof (*buf);
+	  while (inst->mem_len && !loop->halt)
+	    scxrelay_copy_frames (inst);
+	  scxrelay_merge_flush ();
+	}
+      clock_gettime (CLOCK_MONOTONIC, &t1);
+      ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    }
+  while (inst->resample && scxrelay_tick (inst))
+    ;
+
+  relay_logmsg (1, _("== core (%s source, %s sinks, virtual clock): %llu frames, %.0f ns/frame, %llu events out\n"),
+		inst->source->name, ops->name, inst->stats.frames,
+		(double) ns / (synth->frames ? synth->frames : 1),
+		inst->stats.events);
+  for (i = 0; i < inst->nsinks; i++)
+    sunk += inst->sinks[i].sunk;
+  if (sunk != inst->stats.events)
+    relay_logmsg (1, _("sinks hold %llu events, expected %llu\n"),
+		  sunk, inst->stats.events);
+
+  scxrelay_disconnect (inst);
+  free (inst->resample);
+  inst->resample = NULL;
+  scxxform_free (inst->map);
+  for (i = 0; i < inst->nsinks; i++)
+    scxxform_free (inst->sinks[i].xform);
+  loop->vclock = 0;
+  loop->timer_armed = 0;
+}
+
+/* Cost of the --transform stage alone: the same frames are copied, with
+   and without transforming them, and the difference is timed. */
+static void
+scxxform_bench (const struct scxsynth_s *synth)
+{
+  enum { NFRAMES = 256, ITERATIONS = 1 << 21 };
+  static struct input_event src[NFRAMES][SCXSYNTH_FRAME_MAX];
+  struct input_event frame[SCXSYNTH_FRAME_MAX];
+  scxrelay_t *inst = loop->relays + 0;
+  struct relay_caps_s caps;
+  struct scxxform_s *xf;
+  struct timespec t0, t1, t2;
+  int nsrc[NFRAMES];
+  unsigned long sum = 0;
+  double base, xform;
+  int i, f, n;
+
+  scxrelay_init (inst);
+  scxsynth_caps (synth, inst);
+  xf = scxxform_compile (&(inst->caps), &caps, loop->xform_rules);
+  if (!xf)
+    {
+      perror (_("transform"));
+      return;
+    }
+  for (f = 0; f < NFRAMES; f++)
+    nsrc[f] = scxsynth_frame (synth, f, src[f]);
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      f = i % NFRAMES;
+      memcpy (frame, src[f], nsrc[f] * sizeof (*frame));
+      __asm__ volatile ("" : : "r" (frame) : "memory");
+      sum += frame[0].value;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      f = i % NFRAMES;
+      memcpy (frame, src[f], nsrc[f] * sizeof (*frame));
+      __asm__ volatile ("" : : "r" (frame) : "memory");
+      n = scxxform_apply (xf, frame, nsrc[f]);
+      sum += frame[0].value + n;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &t2);
+
+  base = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  xform = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+  relay_logmsg (1, _("== transform: %.1f ns/frame (%d events), checksum %lu\n"),
+		(xform - base) / ITERATIONS, nsrc[0], sum);
+  scxxform_free (xf);
+}
+
+/* Compare the backends on the same recorded event stream.
+   Returns shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE). */
+int
+scxrelay_bench (const char *path)
+{
+  const struct scxrec_header_s *hdr;
+  const char *data;
+  size_t len;
+
+  hdr = scxrelay_map_recording (path, &data, &len);
+  if (!data)
+    {
+      perror (_(path));
+      return EXIT_FAILURE;
+    }
+
+  relay_logmsg (1, _("Relaying %lld events from %s%s\n"),
+		(long long) (len / sizeof (struct input_event)), path,
+		hdr ? _(" (recording)") : "");
+  scxrelay_bench_run (SCXBACKEND_EPOLL, data, len, NULL);
+  scxrelay_bench_run (SCXBACKEND_URING, data, len, NULL);
+
+  munmap (hdr ? (void *) hdr : (void *) data, hdr ? len + hdr->header_size : len);
+  return EXIT_SUCCESS;
+}
+
+/* Compare the backends on the same synthetic load.
+   Returns shell-sense status code (EXIT_SUCCESS, EXIT_FAILURE). */
+int
+scxrelay_bench_synth (const struct scxsynth_s *synth)
+{
+  relay_logmsg (1, _("Synthetic load: %d frames at %d Hz, burst %d, %d axes + %d buttons per frame\n"),
+		synth->frames, synth->rate, synth->burst, synth->axes,
+		synth->buttons);
+  if (loop->xform_rules)
+    scxxform_bench (synth);
+  scxrelay_bench_core (synth);
+  scxrelay_bench_run (SCXBACKEND_EPOLL, NULL, 0, synth);
+  scxrelay_bench_run (SCXBACKEND_URING, NULL, 0, synth);
+  return EXIT_SUCCESS;
+}
+
+static int
+scxrelay_cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Time from launch until the first virtual device exists, then 'count'
+   connect cycles (open, query source, create device) on the same source. */
+int
+scxrelay_bench_startup (int count)
+{
+  scxrelay_t *inst = loop->relays + 0;
+  struct timespec t0;
+  double *ms, first = 0;
+  int i, j, reopen;
+
+  /* Sources passed as fd 3 and 4 are kept open across cycles. */
+  reopen = strcmp (inst->event_path, "-") && strcmp (inst->uinput_path, "-");
+  ms = calloc (count, sizeof (*ms));
+  if (!ms)
+    return EXIT_FAILURE;
+  for (i = 0; i < count; i++)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &t0);
+      if (scxrelay_connect (inst) != 0)
+	{
+	  free (ms);
+	  return EXIT_FAILURE;
+	}
+      if (i == 0)
+	first = scxrelay_ms_since (&(loop->launch));
+      ms[i] = scxrelay_ms_since (&t0);
+      scxrelay_disconnect (inst);
+      if (reopen)
+	{
+	  close (inst->srcfd);
+	  inst->srcfd = -1;
+	  for (j = 0; j < inst->nsinks; j++)
+	    {
+	      close (inst->sinks[j].uinputfd);
+	      inst->sinks[j].uinputfd = -1;
+	    }
+	}
+    }
+  qsort (ms, count, sizeof (*ms), scxrelay_cmp_double);
+  relay_logmsg (1, _("startup: %.2f ms from launch to UI_DEV_CREATE done\n"),
+		first);
+  relay_logmsg (1, _("connect (open, query, create), %d runs: min %.2f  median %.2f  max %.2f ms\n"),
+		count, ms[0], ms[count / 2], ms[count - 1]);
+  free (ms);
+  return EXIT_SUCCESS;
+}
+
+
+/** Command-line interface **/
+
+/* Show usage information. */
+void
+usage (char **argv)
+{
+  fprintf (stdout, "Usage: %s [-1] [-s] [-L] [-U UINPUT_PATH] source_event_device [UINPUT_PATH]\n\
+       %s [-1] [-s] [-L] [-U UINPUT_PATH] -m source_event_device...\n\
+\n\
+Minimalist Steam Controller xpad relay device.\n\
+  -1, --per-event  relay one event per read/write instead of whole frames.\n\
+  -s, --stats      print relay counters (syscalls per frame) on exit.\n\
+  -m, --multi      relay every source_event_device (up to %d) from one process.\n\
+  -U, --uinput     uinput device path (default /dev/uinput).\n\
+  -L, --latency    histogram of relay latency per frame (SIGUSR1, exit).\n\
+  --backend=NAME   event loop: epoll (default), uring, or auto.\n\
+  --sqpoll         io_uring: poll submissions from a kernel thread.\n\
+  --bench=FILE     compare backends relaying a recorded raw event stream.\n\
+  --synth=SPEC     compare backends on generated load: rate=HZ,frames=N,\n\
+                   axes=N,buttons=N,burst=N, e.g. rate=8000,burst=4.\n\
+  --bench-startup=N time launch to device created, then N connect cycles.\n\
+  --devdir=DIR     look for replugged sources in DIR (default: their own).\n\
+  --transform=FILE remap/shape axes and buttons by the rules in FILE:\n\
+                   axis|button SRC DST|none, deadzone AXIS F, expo AXIS K,\n\
+                   invert AXIS, scale AXIS F (codes as numbers or ABS_RX...).\n\
+  --rate=HZ        send changed state once per tick, e.g. 250 or 500.\n\
+  --rt=PRIO        SCHED_FIFO at PRIO; --cpu=N: pin to core N; --mlock.\n\
+  --coalesce       merge frames read together; keeps every key transition.\n\
+  --writer=POLICY  write from a thread; full ring: block, coalesce, drop-oldest.\n\
+  --identity=SPEC  a virtual device per source as VID:PID[,bus=,version=,\n\
+                   transform=FILE|none,name=]; repeat for more (up to %d).\n\
+  --merge          as -m, but every source feeds the same virtual device(s).\n\
+  --map=N:FILE     remap the Nth source (from 0) by transform rules first.\n\
+  --sink=KIND      virtual devices: uinput (default), file, ring or null.\n\
+  --drop=TYPE:CODE never relay these events, e.g. key:10,abs:3 (or abs:*).\n\
+  --record=FILE    append source events to FILE (FILE.N with -m).\n\
+  --notify-fd=N    when the device is usable, write its node path to fd N.\n\
+  --metrics=FILE   publish live counters in FILE (e.g. /dev/shm/scxrelay).\n\
+  --replay=FILE    relay a recording instead of a device; --fast: no timing.\n\
+May omit 'source_event_device' if fd 3 is opened for read-write on event device.\n\
+If fd 4 is opened, it is treated as read-write fd for uinput device.\n\
+Terminate the program by sending signal SIGINT (press Control-C).\n\
+", argv[0], argv[0], SCXRELAY_MAX_RELAYS, SCXRELAY_MAX_SINKS);
+}
+
+static int
+is_fd_open (int probe_fd)
+{
+  int res = fcntl (probe_fd, F_GETFD);
+  return (res == 0);
+}
+
+/* Options without a short form. */
+enum {
+  OPT_BACKEND = 256,
+  OPT_SQPOLL,
+  OPT_BENCH,
+  OPT_SYNTH,
+  OPT_RECORD,
+  OPT_REPLAY,
+  OPT_FAST,
+  OPT_DEVDIR,
+  OPT_DROP,
+  OPT_COALESCE,
+  OPT_TRANSFORM,
+  OPT_RATE,
+  OPT_RT,
+  OPT_CPU,
+  OPT_MLOCK,
+  OPT_BENCH_STARTUP,
+  OPT_NOTIFY_FD,
+  OPT_METRICS,
+  OPT_WRITER,
+  OPT_IDENTITY,
+  OPT_MERGE,
+  OPT_MAP,
+  OPT_SINK,
+};
+
+static const struct option long_options[] = {
+  { "per-event", no_argument, NULL, '1' },
+  { "stats", no_argument, NULL, 's' },
+  { "multi", no_argument, NULL, 'm' },
+  { "uinput", required_argument, NULL, 'U' },
+  { "latency", no_argument, NULL, 'L' },
+  { "backend", required_argument, NULL, OPT_BACKEND },
+  { "sqpoll", no_argument, NULL, OPT_SQPOLL },
+  { "bench", required_argument, NULL, OPT_BENCH },
+  { "synth", required_argument, NULL, OPT_SYNTH },
+  { "record", required_argument, NULL, OPT_RECORD },
+  { "replay", required_argument, NULL, OPT_REPLAY },
+  { "fast", no_argument, NULL, OPT_FAST },
+  { "devdir", required_argument, NULL, OPT_DEVDIR },
+  { "drop", required_argument, NULL, OPT_DROP },
+  { "coalesce", no_argument, NULL, OPT_COALESCE },
+  { "transform", required_argument, NULL, OPT_TRANSFORM },
+  { "rate", required_argument, NULL, OPT_RATE },
+  { "rt", required_argument, NULL, OPT_RT },
+  { "cpu", required_argument, NULL, OPT_CPU },
+  { "mlock", no_argument, NULL, OPT_MLOCK },
+  { "bench-startup", required_argument, NULL, OPT_BENCH_STARTUP },
+  { "notify-fd", required_argument, NULL, OPT_NOTIFY_FD },
+  { "metrics", required_argument, NULL, OPT_METRICS },
+  { "writer", required_argument, NULL, OPT_WRITER },
+  { "identity", required_argument, NULL, OPT_IDENTITY },
+  { "merge", no_argument, NULL, OPT_MERGE },
+  { "map", required_argument, NULL, OPT_MAP },
+  { "sink", required_argument, NULL, OPT_SINK },
+  { "help", no_argument, NULL, 'h' },
+  { NULL, 0, NULL, 0 },
+};
+
+int
+main (int argc, char **argv)
+{
+  int res;
+  int opt;
+  int multi = 0;
+  char *end;
+  const char *uinput_path = NULL;
+  const char *bench_path = NULL;
+  const char *replay_path = NULL;
+  struct scxsynth_s synth = { 0, };
+  int startup_runs = 0;
+  scxrelay_t *inst = loop->relays + 0;
+
+  clock_gettime (CLOCK_MONOTONIC, &(loop->launch));
+  loop->cpu = -1;
+  loop->ready_fd = -1;
+  while ((opt = getopt_long (argc, argv, "1smU:Lh", long_options, NULL)) != -1)
+    {
+      switch (opt)
+	{
+	case '1':
+	  loop->per_event = 1;
+	  break;
+	case 's':
+	  loop->show_stats = 1;
+	  break;
+	case 'm':
+	  multi = 1;
+	  break;
+	case 'L':
+	  loop->latency = 1;
+	  break;
+	case 'U':
+	  uinput_path = optarg;
+	  break;
+	case OPT_BACKEND:
+	  for (res = 0; scxbackend_names[res]; res++)
+	    {
+	      if (!strcmp (optarg, scxbackend_names[res]))
+		break;
+	    }
+	  if (!scxbackend_names[res])
+	    {
+	      usage (argv);
+	      return EXIT_FAILURE;
+	    }
+	  loop->backend = res;
+	  break;
+	case OPT_SQPOLL:
+	  loop->sqpoll = 1;
+	  break;
+	case OPT_BENCH:
+	  bench_path = optarg;
+	  break;
+	case OPT_RECORD:
+	  loop->record_path = optarg;
+	  break;
+	case OPT_REPLAY:
+	  replay_path = optarg;
+	  break;
+	case OPT_FAST:
+	  loop->replay_fast = 1;
+	  break;
+	case OPT_DEVDIR:
+	  loop->devdir = optarg;
+	  break;
+	case OPT_RT:
+	  loop->rt_prio = atoi (optarg);
+	  if ((loop->rt_prio < sched_get_priority_min (SCHED_FIFO))
+	      || (loop->rt_prio > sched_get_priority_max (SCHED_FIFO)))
+	    {
+	      relay_logmsg (1, _("Bad --rt priority: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_CPU:
+	  loop->cpu = atoi (optarg);
+	  break;
+	case OPT_MLOCK:
+	  loop->mlock = 1;
+	  break;
+	case OPT_NOTIFY_FD:
+	  loop->ready_fd = atoi (optarg);
+	  if (!is_fd_open (loop->ready_fd))
+	    {
+	      relay_logmsg (1, _("Bad --notify-fd: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_METRICS:
+	  loop->metrics_path = optarg;
+	  break;
+	case OPT_BENCH_STARTUP:
+	  startup_runs = atoi (optarg);
+	  if (startup_runs < 1)
+	    {
+	      relay_logmsg (1, _("Bad --bench-startup count: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_RATE:
+	  loop->rate = atoi (optarg);
+	  if ((loop->rate < 1) || (loop->rate > 100000))
+	    {
+	      relay_logmsg (1, _("Bad --rate: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_TRANSFORM:
+	  loop->xform_rules = scxxform_load (optarg);
+	  if (!loop->xform_rules)
+	    return EXIT_FAILURE;
+	  break;
+	case OPT_COALESCE:
+	  loop->coalesce = 1;
+	  break;
+	case OPT_WRITER:
+	  for (res = 0; relay_backpressure_names[res]; res++)
+	    {
+	      if (!strcmp (optarg, relay_backpressure_names[res]))
+		break;
+	    }
+	  if (!relay_backpressure_names[res])
+	    {
+	      usage (argv);
+	      return EXIT_FAILURE;
+	    }
+	  loop->writer = 1;
+	  loop->backpressure = res;
+	  break;
+	case OPT_IDENTITY:
+	  if (scxrelay_identity_parse (optarg) < 0)
+	    {
+	      relay_logmsg (1, _("Bad --identity: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_SINK:
+	  for (res = 0; scxsinks[res]; res++)
+	    {
+	      if (!strcmp (optarg, scxsinks[res]->name))
+		break;
+	    }
+	  if (!scxsinks[res])
+	    {
+	      usage (argv);
+	      return EXIT_FAILURE;
+	    }
+	  loop->sink_ops = scxsinks[res];
+	  break;
+	case OPT_MERGE:
+	  loop->merge = 1;
+	  multi = 1;
+	  break;
+	case OPT_MAP:
+	  res = strtol (optarg, &end, 10);
+	  if ((end == optarg) || (*end != ':') || (res < 0)
+	      || (res >= SCXRELAY_MAX_RELAYS))
+	    {
+	      relay_logmsg (1, _("Bad --map: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  loop->map_rules[res] = scxxform_load (end + 1);
+	  if (!loop->map_rules[res])
+	    return EXIT_FAILURE;
+	  break;
+	case OPT_DROP:
+	  if (scxdrop_parse (optarg) < 0)
+	    {
+	      relay_logmsg (1, _("Bad --drop list: %s\n"), optarg);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	case OPT_SYNTH:
+	  if (scxsynth_parse (&synth, optarg) < 0)
+	    {
+	      usage (argv);
+	      return EXIT_FAILURE;
+	    }
+	  break;
+	default:
+	  usage (argv);
+	  return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+  /* Remaining arguments are positional, as argv[1] and argv[2]. */
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (!loop->nidentities)
+    scxrelay_identity_default (loop->identities + loop->nidentities++);
+  loop->uring.fd = -1;
+  if (bench_path)
+    {
+      loop->show_stats = 1;
+      return scxrelay_bench (bench_path);
+    }
+  if (synth.rate)
+    {
+      loop->show_stats = 1;
+      return scxrelay_bench_synth (&synth);
+    }
+
+  if (replay_path)
+    {
+      /* A recording takes the place of the source device. */
+      scxrelay_init (inst);
+      loop->nrelays = 1;
+      snprintf (inst->event_path, sizeof (inst->event_path), "%s", replay_path);
+      if (uinput_path)
+	snprintf (inst->uinput_path, sizeof (inst->uinput_path), "%s",
+		  uinput_path);
+      else if (argc > 1)
+	snprintf (inst->uinput_path, sizeof (inst->uinput_path), "%s", argv[1]);
+      if (scxrelay_replay_open (inst, replay_path) < 0)
+	{
+	  perror (_(replay_path));
+	  return EXIT_FAILURE;
+	}
+      res = scxrelay_main ();
+      return (res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+  if (multi)
+    {
+      /* One relay per source device argument. */
+      if ((argc < 2) || (argc - 1 > SCXRELAY_MAX_RELAYS))
+	{
+	  usage (argv);
+	  return EXIT_FAILURE;
+	}
+      for (loop->nrelays = 0; loop->nrelays < argc - 1; loop->nrelays++)
+	{
+	  inst = loop->relays + loop->nrelays;
+	  scxrelay_init (inst);
+	  snprintf (inst->event_path, sizeof (inst->event_path), "%s",
+		    argv[1 + loop->nrelays]);
+	  if (uinput_path)
+	    snprintf (inst->uinput_path, sizeof (inst->uinput_path), "%s",
+		      uinput_path);
+	  if (loop->merge && (inst != loop->relays))
+	    {
+	      /* frames go to the first source's virtual devices. */
+	      inst->nsinks = 0;
+	      inst->out = loop->relays;
+	    }
+	}
+      res = scxrelay_main ();
+      return (res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-  scxrelay_init ();
+  scxrelay_init (inst);
+  loop->nrelays = 1;
+  if (uinput_path)
+    snprintf (inst->uinput_path, sizeof (inst->uinput_path), "%s", uinput_path);
 
   if (argc < 2)
     {
@@ -503,14 +4997,14 @@ main (int argc, char **argv)
 
       if (is_fd_open (4))
 	{
-	  inst->uinputfd = 4;
+	  inst->sinks[0].uinputfd = 4;
 	  strcpy (inst->uinput_path, "-");
 	}
 
       if (inst->srcfd == -1)
 	{
 	  /* No event device specified, and insufficient arguments. */
-	  usage (argc, argv);
+	  usage (argv);
 	  return EXIT_FAILURE;
 	}
     }
@@ -526,6 +5020,8 @@ main (int argc, char **argv)
       snprintf (inst->uinput_path, sizeof (inst->uinput_path), "%s", argv[2]);
     }
 
+  if (startup_runs)
+    return scxrelay_bench_startup (startup_runs);
   res = scxrelay_main ();
 
   return (res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -0,0 +1,32 @@
+# Shared by the test scripts (sourced): a scratch directory, the relay, and
+# input_event records.  This script is public domain.
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# SCXRELAY=path/to/scxrelay uses that binary instead of building one.
+if [ -z "$SCXRELAY" ]; then
+  SCXRELAY=$TMP/scxrelay
+  ${CC:-cc} -O2 -pthread -o "$SCXRELAY" "$TOP/scxrelay.c" "$TOP/librelay.c" \
+    || exit 1
+fi
+
+# Little-endian fields, as printf escapes.
+le () {
+  local value=$1 bytes=$2 i out=
+  for ((i = 0; i < bytes; i++)); do
+    out+=$(printf '\\x%02x' $(( (value >> (8 * i)) & 0xff )))
+  done
+  printf "$out"
+}
+
+# struct input_event (64-bit time_t): sec, usec, type, code, value.
+event () {
+  le "$1" 8; le 0 8; le "$2" 2; le "$3" 2; le "$4" 4
+}
+
+# Events in a file of input_event records, one "type code value" per line.
+events () {
+  od -An -v -t d4 -w24 "$1" | awk '{ print $5 % 65536, int($5 / 65536), $6 }'
+}
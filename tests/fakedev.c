@@ -0,0 +1,161 @@
+/* LD_PRELOAD shim for the tests: lets fifos stand in for event devices and
+   a plain file for /dev/uinput, so the relay runs without a controller or
+   uinput.  This file is public domain.
+
+   Event devices: every node reports EV_SYN, EV_KEY and EV_ABS with ABS_X,
+   ABS_Y and BTN_SOUTH..BTN_EAST, at rest; axes range -32768..32767, or
+   0..1023 for the node named by $FAKEDEV_NARROW (e.g. "event1"), which so
+   comes back with other capabilities.  A read from a node that has been
+   removed fails with ENODEV, as from an unplugged device.
+
+   uinput: the setup ioctls succeed, and UI_DEV_SETUP, UI_ABS_SETUP,
+   UI_DEV_CREATE and UI_DEV_DESTROY are logged on stderr; events written go
+   to the file.
+
+   cc -shared -fPIC -o fakedev.so fakedev.c -ldl */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+/* What 'fd' is open on; "" if unknown. */
+static void
+fakedev_path (int fd, char *path, size_t size)
+{
+  char link[64];
+  ssize_t len;
+
+  snprintf (link, sizeof (link), "/proc/self/fd/%d", fd);
+  len = readlink (link, path, size - 1);
+  path[len > 0 ? len : 0] = 0;
+}
+
+/* Whether 'fd' is open on the node named in $FAKEDEV_NARROW. */
+static int
+fakedev_narrow (int fd)
+{
+  const char *narrow = getenv ("FAKEDEV_NARROW");
+  char path[4096], *base;
+
+  if (!narrow)
+    return 0;
+  fakedev_path (fd, path, sizeof (path));
+  base = strrchr (path, '/');
+  return base && !strcmp (base + 1, narrow);
+}
+
+static void
+fakedev_setbit (void *bv, int bit)
+{
+  ((unsigned char *) bv)[bit / 8] |= 1 << (bit % 8);
+}
+
+int
+ioctl (int fd, unsigned long req, ...)
+{
+  static int (*real) (int, unsigned long, ...);
+  struct uinput_abs_setup *abs;
+  struct input_absinfo *absinfo;
+  unsigned int len = _IOC_SIZE (req);
+  va_list ap;
+  void *arg;
+  int code;
+
+  va_start (ap, req);
+  arg = va_arg (ap, void *);
+  va_end (ap);
+
+  if (req == EVIOCGBIT (0, len))
+    {
+      memset (arg, 0, len);
+      fakedev_setbit (arg, EV_SYN);
+      fakedev_setbit (arg, EV_KEY);
+      fakedev_setbit (arg, EV_ABS);
+      return len;
+    }
+  if (req == EVIOCGBIT (EV_ABS, len))
+    {
+      memset (arg, 0, len);
+      fakedev_setbit (arg, ABS_X);
+      fakedev_setbit (arg, ABS_Y);
+      return len;
+    }
+  if (req == EVIOCGBIT (EV_KEY, len))
+    {
+      memset (arg, 0, len);
+      for (code = BTN_SOUTH; code <= BTN_EAST; code++)
+	fakedev_setbit (arg, code);
+      return len;
+    }
+  if ((req == EVIOCGBIT (EV_FF, len)) || (req == EVIOCGKEY (len)))
+    {
+      memset (arg, 0, len);
+      return len;
+    }
+  if ((req & ~(unsigned long) ABS_MAX) == EVIOCGABS (0))
+    {
+      absinfo = arg;
+      memset (absinfo, 0, sizeof (*absinfo));
+      absinfo->minimum = fakedev_narrow (fd) ? 0 : -32768;
+      absinfo->maximum = fakedev_narrow (fd) ? 1023 : 32767;
+      return 0;
+    }
+
+  if (req == UI_DEV_SETUP)
+    {
+      fprintf (stderr, "fakedev: UI_DEV_SETUP %s\n",
+	       ((struct uinput_setup *) arg)->name);
+      return 0;
+    }
+  if (req == UI_ABS_SETUP)
+    {
+      abs = arg;
+      fprintf (stderr, "fakedev: UI_ABS_SETUP %d %d..%d\n", abs->code,
+	       abs->absinfo.minimum, abs->absinfo.maximum);
+      return 0;
+    }
+  if (req == UI_DEV_CREATE)
+    {
+      fprintf (stderr, "fakedev: UI_DEV_CREATE\n");
+      return 0;
+    }
+  if (req == UI_DEV_DESTROY)
+    {
+      fprintf (stderr, "fakedev: UI_DEV_DESTROY\n");
+      return 0;
+    }
+  if ((req == UI_SET_EVBIT) || (req == UI_SET_KEYBIT)
+      || (req == UI_SET_ABSBIT) || (req == UI_SET_FFBIT))
+    return 0;
+
+  if (!real)
+    real = dlsym (RTLD_NEXT, "ioctl");
+  return real (fd, req, arg);
+}
+
+ssize_t
+read (int fd, void *buf, size_t count)
+{
+  static ssize_t (*real) (int, void *, size_t);
+  char path[4096];
+  size_t len;
+
+  fakedev_path (fd, path, sizeof (path));
+  len = strlen (path);
+  if (strstr (path, "/event") && (len > 10)
+      && !strcmp (path + len - 10, " (deleted)"))
+    {
+      errno = ENODEV;
+      return -1;
+    }
+  if (!real)
+    real = dlsym (RTLD_NEXT, "read");
+  return real (fd, buf, count);
+}
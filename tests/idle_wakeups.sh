@@ -0,0 +1,44 @@
+#!/bin/bash
+# Check that an idle relay does not wake up: replay a recording whose frames
+# are IDLE seconds apart into null sinks, on each backend, and require that
+# every wakeup relayed a frame ("0 idle" in the -s counters).
+# Needs neither a controller nor /dev/uinput.  This script is public domain.
+#
+# Usage: tests/idle_wakeups.sh [IDLE_SECONDS]
+# SCXRELAY=path/to/scxrelay uses that binary instead of building one.
+
+IDLE=${1:-2}
+. "$(dirname "$0")/common.sh"
+
+# A recording (struct scxrec_header_s, 1760 bytes; no capabilities needed
+# for null sinks), then three frames IDLE seconds apart.
+REC=$TMP/idle.scx
+{
+  printf 'SCXREC\n\0'
+  le 1 4; le 1760 4; le 24 4
+  head -c $((1760 - 20)) /dev/zero
+  for ((t = 0; t < 3; t++)); do
+    event $((t * IDLE)) 3 0 $((t * 1000))	# EV_ABS ABS_X
+    event $((t * IDLE)) 0 0 0			# SYN_REPORT
+  done
+} > "$REC"
+
+fail=0
+for backend in epoll uring; do
+  out=$("$SCXRELAY" -s --backend=$backend --sink=null --replay="$REC" 2>&1)
+  line=$(grep -E '(wakeups|io_uring_enter) for [0-9]+ frames' <<< "$out")
+  if [ -z "$line" ]; then
+    echo "$backend: no counters (not supported here?)"
+    echo "$out" | sed 's/^/  /'
+    [ $backend = epoll ] && fail=1
+    continue
+  fi
+  idle=$(sed -E 's/.* ([0-9]+) idle.*/\1/' <<< "$line")
+  frames=$(sed -E 's/.* for ([0-9]+) frames.*/\1/' <<< "$line")
+  echo "$backend: $line"
+  if [ "$frames" != 3 ] || [ "$idle" != 0 ]; then
+    echo "$backend: FAIL (expected 3 frames, 0 idle)"
+    fail=1
+  fi
+done
+exit $fail
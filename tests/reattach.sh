@@ -0,0 +1,67 @@
+#!/bin/bash
+# Check re-attaching to a source that comes back with other capabilities:
+# in a fake device directory (--devdir), event0 is unplugged (removed, its
+# reads then fail with ENODEV) and event1 appears with narrower axes.  The
+# relay must adopt event1, re-create the virtual device with the new axis
+# range, and relay from it.  tests/fakedev.c stands in for evdev and uinput.
+# This script is public domain.
+#
+# SCXRELAY=path/to/scxrelay uses that binary instead of building one.
+
+. "$(dirname "$0")/common.sh"
+
+${CC:-cc} -shared -fPIC -o "$TMP/fakedev.so" "$TOP/tests/fakedev.c" -ldl \
+  || exit 1
+
+DEV=$TMP/dev
+OUT=$TMP/uinput
+LOG=$TMP/log
+mkdir "$DEV"
+mkfifo "$DEV/event0"
+: > "$OUT"
+
+LD_PRELOAD=$TMP/fakedev.so FAKEDEV_NARROW=event1 \
+  "$SCXRELAY" -s --devdir="$DEV" -U "$OUT" "$DEV/event0" > "$LOG" 2>&1 &
+relay=$!
+
+# One frame at time SEC: ABS_X VALUE, SYN_REPORT; in a single write.
+frame () {
+  { event "$1" 3 0 "$2"; event "$1" 0 0 0; } > "$TMP/frame"
+  cat "$TMP/frame"
+}
+
+exec 5<> "$DEV/event0"
+sleep 0.5
+frame 1 100 >&5
+sleep 0.5
+rm "$DEV/event0"		# unplug
+frame 2 300 >&5			# read fails: ENODEV
+sleep 0.5
+mkfifo "$DEV/event1"		# replug, narrower
+exec 6<> "$DEV/event1"
+sleep 0.5
+frame 3 200 >&6
+sleep 0.5
+
+kill -INT $relay
+wait $relay
+exec 5>&- 6>&-
+
+fail=0
+check () {
+  if eval "$2"; then
+    echo "ok: $1"
+  else
+    echo "FAIL: $1"
+    fail=1
+  fi
+}
+check "relayed from event0" "events '$OUT' | grep -qx '3 0 100'"
+check "nothing relayed after the unplug" "! events '$OUT' | grep -qx '3 0 300'"
+check "re-attached to event1" "grep -q 'event1: re-attached' '$LOG'"
+check "device re-created" \
+  "[ \$(grep -c 'fakedev: UI_DEV_CREATE' '$LOG') = 2 ] && grep -q 'UI_DEV_DESTROY' '$LOG'"
+check "new axis range" "grep -q 'UI_ABS_SETUP 0 0..1023' '$LOG'"
+check "relayed from event1" "events '$OUT' | grep -qx '3 0 200'"
+[ $fail = 0 ] || sed 's/^/  /' "$LOG"
+exit $fail
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Check that the relay core runs on the virtual clock: --synth feeds 1000
+# frames at 1000 Hz, one axis-only frame per millisecond, and --rate=250
+# resamples them.  The ticks fall at 0, 4, ... 1000 ms of virtual time, so
+# the core must report 251 frames of 5 events (4 axes, SYN_REPORT), and the
+# same on a second run, however the host schedules it.
+# Needs neither a controller nor /dev/uinput.  This script is public domain.
+#
+# SCXRELAY=path/to/scxrelay uses that binary instead of building one.
+
+. "$(dirname "$0")/common.sh"
+
+expect="251 frames 1255 events"
+fail=0
+for run in 1 2; do
+  out=$("$SCXRELAY" --synth=rate=1000,frames=1000,buttons=0 --rate=250 2>&1)
+  line=$(grep -E '^== core' <<< "$out")
+  got=$(sed -E 's/.*: ([0-9]+) frames, .* ([0-9]+) events out.*/\1 frames \2 events/' <<< "$line")
+  echo "run $run: $line"
+  if [ "$got" != "$expect" ]; then
+    echo "run $run: FAIL (expected $expect)"
+    echo "$out" | sed 's/^/  /'
+    fail=1
+  fi
+  if grep -q 'sinks hold' <<< "$out"; then
+    echo "run $run: FAIL (sinks disagree with the counters)"
+    fail=1
+  fi
+done
+exit $fail
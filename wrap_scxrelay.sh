@@ -6,20 +6,36 @@
 SCXRELAY=$(PATH=.:"$PATH" which scxrelay || which scxrelay.x86)
 
 # Paths to system utilities.
-UDEVADM=udevadm
-GREP=grep
 KILL=kill
 
 # Default paths.
 UINPUT_PATH=/dev/uinput
 EVENT_PREFIX=/dev/input/event
+SYSFS=/sys
+
+# Virtual device (under /sys/devices/virtual) with X/Y axes and joystick or
+# gamepad buttons (udev's ID_INPUT_JOYSTICK), which is characteristic of the
+# Steam Controller virtual xpad device.  Reads sysfs with builtins only, so
+# the search forks no process.  Capability files hold 64-bit hex words,
+# most significant first.
+is_xpad () {
+  local caps="$1/device/capabilities" abs key word
+  read -r -a abs < "$caps/abs" || return 1
+  read -r -a key < "$caps/key" || return 1
+  # ABS_X, ABS_Y: bits 0 and 1.
+  (( (16#${abs[-1]} & 3) == 3 )) || return 1
+  # BTN_JOYSTICK..BTN_DIGI-1 (0x120-0x13f): upper half of word 4.
+  (( ${#key[@]} > 4 )) || return 1
+  word=${key[${#key[@]} - 5]}
+  (( ((16#$word >> 32) & 0xffffffff) != 0 ))
+}
 
 EVENT_PATH=
 RELAYPID=0
 
-for evdev in "$EVENT_PREFIX"*; do
-  # Search for the two lines "P: [...]/virtual/[...]" and "E: ID_INPUT_JOYSTICK=1", which are characteristic of the Steam Controller virtual xpad device.
-  if [ `$UDEVADM info -n "$evdev" | $GREP -c '^\(P: .*/virtual/\|E: ID_INPUT_JOYSTICK=1\)'` = 2 ]; then
+for sysdev in "$SYSFS"/devices/virtual/input/input*/event*; do
+  if [ -e "$sysdev" ] && is_xpad "$sysdev"; then
+    evdev="$EVENT_PREFIX${sysdev##*/event}"
     if [ x"$EVENT_PATH" = "x" ]; then
       EVENT_PATH="$evdev"  # store first match.
     fi
@@ -28,10 +44,11 @@ done
 
 # Start up the relay in background.
 if [ x"$EVENT_PATH" != "x" ]; then
-  $SCXRELAY "$EVENT_PATH" "$UINPUT_PATH" &
-  RELAYPID=$!
-  # Short sleep for udev to settle.
-  sleep 0.5
+  coproc RELAY { exec $SCXRELAY --notify-fd=1 "$EVENT_PATH" "$UINPUT_PATH"; }
+  RELAYPID=$RELAY_PID
+  # Wait until the relay reports its device node (udev done with it), or
+  # gives up; no fixed delay.
+  read -r -t 5 RELAY_NODE <&"${RELAY[0]}"
 fi
 
 # Run rest of command line (e.g. the actual game)